@@ -0,0 +1,158 @@
+/**
+ * @file arena.cpp
+ * @author Daniel Rencricca
+ * @brief The memory the buffer array records are allocated from: one block
+ * backed by huge pages where possible, reset rather than freed between uses.
+ *
+ * @version 1.1
+ * @date 2015-12-22
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+/**
+ * @brief Construct a new Arena object, with no memory until Reserve is
+ * called.
+ */
+Arena::Arena()
+{
+    m_pBase = NULL;
+    m_iSize = 0;
+    m_iUsed = 0;
+    m_bHuge = false;
+}
+
+/**
+ * @brief Destroy the Arena object and unmap its memory. Objects in it must
+ * have been destroyed already.
+ */
+Arena::~Arena()
+{
+    Release();
+}
+
+/**
+ * @brief Makes sure the arena holds at least size bytes, and resets it. The
+ * block is kept if it is already big enough, else it is replaced. Reserved
+ * huge pages (MAP_HUGETLB) are used if the system has them, else the block
+ * is aligned to HUGE_PAGE_SZ and the kernel asked to back it with
+ * transparent huge pages (MADV_HUGEPAGE).
+ *
+ * @param size Bytes needed.
+ *
+ * @return true if successful, else false if there is not enough memory.
+ */
+bool Arena::Reserve(size_t size)
+{
+    size_t mapSz;
+    char* map;
+
+    m_iUsed = 0;
+
+    if (m_pBase && m_iSize >= size)
+        return true;
+
+    Release();
+
+    size = (size + HUGE_PAGE_SZ - 1) & ~(size_t)(HUGE_PAGE_SZ - 1);
+
+    map = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (map != MAP_FAILED)
+    {
+        m_pBase = map;
+        m_iSize = size;
+        m_bHuge = true;
+        return true;
+    }
+
+    // Map an extra huge page so the block can start on a huge page boundary,
+    // then unmap the ends that are not needed.
+    mapSz = size + HUGE_PAGE_SZ;
+    map = (char*)mmap(NULL, mapSz, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (map == MAP_FAILED)
+        return false;
+
+    m_pBase = (char*)(((uintptr_t)map + HUGE_PAGE_SZ - 1) &
+                      ~(uintptr_t)(HUGE_PAGE_SZ - 1));
+
+    if (m_pBase > map)
+        munmap(map, m_pBase - map);
+    if (m_pBase + size < map + mapSz)
+        munmap(m_pBase + size, map + mapSz - (m_pBase + size));
+
+    m_iSize = size;
+
+#ifdef MADV_HUGEPAGE
+    m_bHuge = !madvise(m_pBase, m_iSize, MADV_HUGEPAGE);
+#endif
+
+    return true;
+}
+
+/**
+ * @brief Allocates memory from the arena. It is not given back until Reset.
+ *
+ * @param size  Bytes needed.
+ * @param align Alignment needed (a power of 2).
+ *
+ * @return The memory, or NULL if the arena is full.
+ */
+void* Arena::Alloc(size_t size, size_t align)
+{
+    size_t pos = (m_iUsed + align - 1) & ~(align - 1);
+
+    if (!m_pBase || pos + size > m_iSize)
+        return NULL;
+
+    m_iUsed = pos + size;
+    return m_pBase + pos;
+}
+
+/**
+ * @brief Tells if memory was allocated from the arena.
+ *
+ * @param ptr Memory to check.
+ *
+ * @return true if ptr is in the arena, else false.
+ */
+bool Arena::Owns(const void* ptr) const
+{
+    return m_pBase && (const char*)ptr >= m_pBase &&
+           (const char*)ptr < m_pBase + m_iSize;
+}
+
+/**
+ * @brief Frees everything allocated from the arena at once, keeping its
+ * memory for the next allocations.
+ *
+ * @return Void.
+ */
+void Arena::Reset(void)
+{
+    m_iUsed = 0;
+}
+
+/**
+ * @brief Unmaps the arena's memory.
+ *
+ * @return Void.
+ */
+void Arena::Release(void)
+{
+    if (m_pBase)
+        munmap(m_pBase, m_iSize);
+
+    m_pBase = NULL;
+    m_iSize = 0;
+    m_iUsed = 0;
+    m_bHuge = false;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file arena.h
+ * @author Daniel Rencricca
+ * @brief  Header file for arena.cpp, the memory the buffer array records
+ * are allocated from.
+ * @version 1.1
+ * @date 2015-12-22
+ *
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define HUGE_PAGE_SZ    0x200000  // size of a huge page (2MB)
+
+/**
+ * A block of memory that objects are allocated from in order, and that is
+ * reset rather than freed when they are done with, so it can be used again.
+ * The block is mapped on 2MB boundaries and backed by huge pages where the
+ * system allows (transparent huge pages, else reserved ones), so records
+ * spread over many megabytes need few TLB entries. Pages are only given
+ * memory when first written, so they are placed on the NUMA node of the
+ * thread that first uses them.
+ */
+class Arena
+{
+public:
+    Arena();
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    bool      Reserve(size_t size);
+    void*     Alloc(size_t size, size_t align);
+    bool      Owns(const void* ptr) const;
+    void      Reset(void);
+    bool      IsHuge(void) const { return m_bHuge; }
+    size_t    Size(void) const { return m_iSize; }
+
+protected:
+    void      Release(void);
+
+    char*     m_pBase;     // start of the block, or NULL if none
+    size_t    m_iSize;     // bytes in the block
+    size_t    m_iUsed;     // bytes allocated so far
+    bool      m_bHuge;     // the block is backed by huge pages
+};
+
+#endif // _ARENA_H_
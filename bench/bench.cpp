@@ -0,0 +1,421 @@
+/**
+ * @file bench.cpp
+ * @author Daniel Rencricca
+ * @brief Benchmarks the sorter on a csv file: SortFile end to end, and the
+ * kernels it is built from (key extraction, key comparison, sorting the
+ * buffer array and merging the sort files). Reports MB/s and records/s.
+ * "pointer sort" sorts the buffer array as an array of record pointers, for
+ * comparison with "buffer sort", which sorts it by key prefix.
+ *
+ * Example:
+ *   ./gendata -n 1000000 -o data.csv --dist random
+ *   ./bench -i data.csv -c1 1 --reps 3
+ *
+ * @version 1.1
+ * @date 2015-12-22
+ *
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#include "../sortroutines.h"
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief Elapsed seconds since start.
+ */
+static double Since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Prints one line of results.
+ *
+ * @param name  Name of the benchmark.
+ * @param recs  Records processed.
+ * @param bytes Bytes processed.
+ * @param sec   Seconds taken.
+ *
+ * @return Void.
+ */
+static void Report(const char *name, double recs, double bytes, double sec)
+{
+    printf("%-16s %12.0f %10.1f %9.3f %10.1f %12.0f\n", name, recs,
+           bytes / 1e6, sec, sec > 0 ? bytes / 1e6 / sec : 0,
+           sec > 0 ? recs / sec : 0);
+}
+
+/**
+ * Gives the benchmark the protected kernels of SortRoutines.
+ */
+class BenchSorter : public SortRoutines
+{
+public:
+    using SortRoutines::SortRoutines;
+
+    /**
+     * @brief Reads every record of the input file (after the header).
+     *
+     * @param lines Set to the records, each with its line ending.
+     * @param bytes Set to the bytes read.
+     *
+     * @return true if successful, else false if error.
+     */
+    bool ReadLines(vector<wstring> *lines, size_t *bytes)
+    {
+        BufRecType *rec = m_aBufArr[0].rec;
+        FILE *fP = fopen(m_sUserFile.c_str(), "rb");
+
+        if (!fP)
+            return false;
+
+        if (ReadRecord(m_bFirstLn, fP))
+            DetectDelimiter(m_bFirstLn);
+
+        while (ReadRecord(rec->dataLn, fP))
+            lines->push_back(rec->dataLn);
+
+        *bytes = ftell(fP);
+        fclose(fP);
+        return true;
+    }
+
+    /**
+     * @brief Times GetKey on every record.
+     *
+     * @param lines Records to get the keys of.
+     * @param keys  Set to the key of each record.
+     *
+     * @return Seconds taken.
+     */
+    double KeyExtract(const vector<wstring> &lines, vector<KeyRecType> *keys)
+    {
+        BufRecType *rec = m_aBufArr[0].rec;
+        auto start = chrono::steady_clock::now();
+
+        keys->resize(lines.size());
+
+        for (size_t x = 0; x < lines.size(); x++)
+        {
+            wmemcpy(rec->dataLn, lines[x].c_str(), lines[x].length() + 1);
+            rec->seq = x;
+            GetKey(rec);
+            (*keys)[x].nkey.swap(rec->nkey);
+        }
+
+        return Since(start);
+    }
+
+    /**
+     * @brief Times RecCmp on each pair of neighbouring keys.
+     *
+     * @param keys Keys to compare.
+     * @param reps Times to compare the keys.
+     *
+     * @return Seconds taken.
+     */
+    double Compare(const vector<KeyRecType> &keys, int reps)
+    {
+        volatile int sum = 0;
+        auto start = chrono::steady_clock::now();
+
+        for (int r = 0; r < reps; r++)
+            for (size_t x = 1; x < keys.size(); x++)
+                sum += RecCmp(&keys[x - 1], &keys[x]) < 0;
+
+        return Since(start);
+    }
+
+    /**
+     * @brief Times SortList on buffer-array sized groups of keys, then
+     * SortListIncr as each buffer element is replaced in turn, as MakeRuns
+     * does.
+     *
+     * @param keys    Keys to sort.
+     * @param sortN   Set to the number of keys sorted by SortList.
+     * @param incrSec Set to the seconds taken by SortListIncr.
+     * @param incrN   Set to the number of keys added by SortListIncr.
+     *
+     * @return Seconds taken by SortList.
+     */
+    double BufferSort(const vector<KeyRecType> &keys, size_t *sortN,
+                      double *incrSec, size_t *incrN)
+    {
+        mt19937 rng(1);
+        double sec = 0;
+        size_t x = 0;
+
+        *incrSec = 0;
+        *sortN = *incrN = 0;
+
+        while (x + m_iBufArrSz <= keys.size())
+        {
+            for (int y = 0; y < m_iBufArrSz; y++)
+                SetKey(y, keys[x++].nkey);
+
+            auto start = chrono::steady_clock::now();
+            SortList(m_iBufArrSz);
+            sec += Since(start);
+            *sortN += m_iBufArrSz;
+
+            start = chrono::steady_clock::now();
+            for (int y = 0; y < m_iBufArrSz && x < keys.size(); y++)
+            {
+                int pos = rng() % m_iBufArrSz;
+
+                SetKey(pos, keys[x++].nkey);
+                SortListIncr(m_iBufArrSz, pos);
+                (*incrN)++;
+            }
+            *incrSec += Since(start);
+        }
+
+        return sec;
+    }
+
+    /**
+     * @brief Times the same sort as SortList on buffer-array sized groups of
+     * keys, but of an array of pointers to the records, so that every
+     * comparison follows the pointers to the keys. This is how the buffer
+     * array was sorted before it held key prefixes.
+     * 
+     * @param keys  Keys to sort.
+     * @param sortN Set to the number of keys sorted.
+     * 
+     * @return Seconds taken.
+     */
+    double PointerSort(const vector<KeyRecType> &keys, size_t *sortN)
+    {
+        vector<BufRecType *> ptrs(m_iBufArrSz);
+        double sec = 0;
+
+        *sortN = 0;
+
+        for (size_t x = 0; x + m_iBufArrSz <= keys.size();)
+        {
+            for (int y = 0; y < m_iBufArrSz; y++)
+            {
+                ptrs[y] = m_aBufArr[y].rec;
+                ptrs[y]->nkey = keys[x++].nkey;
+            }
+
+            auto start = chrono::steady_clock::now();
+
+            for (int y = 0; y < m_iBufArrSz - 1; y++)
+                for (int z = y + 1; z < m_iBufArrSz; z++)
+                    if (RecCmp(ptrs[z], ptrs[y]) > 0)
+                        swap(ptrs[y], ptrs[z]);
+
+            sec += Since(start);
+            *sortN += m_iBufArrSz;
+        }
+
+        return sec;
+    }
+
+    /**
+     * @brief Splits the records into sorted runs, one per sort file, and
+     * times MergeSort merging them.
+     *
+     * @param lines Records to merge.
+     * @param keys  Key of each record.
+     * @param bytes Set to the bytes merged.
+     *
+     * @return Seconds taken, or -1 if error.
+     */
+    double Merge(const vector<wstring> &lines, const vector<KeyRecType> &keys,
+                 size_t *bytes)
+    {
+        int runN = m_iSrtFlArrSz - 1;
+        vector<size_t> order(lines.size());
+        double sec;
+
+        if (!InitWorkDir() || !InitTempFiles(0))
+            return -1;
+
+        for (size_t x = 0; x < order.size(); x++)
+            order[x] = x;
+
+        // Record x goes to run x % runN; each run is then sorted by key.
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return a % runN != b % runN ? a % runN < b % runN :
+                   keys[a].nkey < keys[b].nkey;
+        });
+
+        for (size_t x : order)
+            fwprintf(m_aSrtFlArr[x % runN]->fp, L"%S", lines[x].c_str());
+
+        m_iSrtFileN = runN;
+        auto start = chrono::steady_clock::now();
+
+        if (!MergeSort())
+            return -1;
+
+        fflush(m_aSrtFlArr[m_iSrtFlArrSz - 1]->fp);
+        sec = Since(start);
+
+        *bytes = ftell(m_aSrtFlArr[m_iSrtFlArrSz - 1]->fp);
+        DeleteSortFiles();
+
+        return sec;
+    }
+
+    /**
+     * @brief Sets the key of a buffer array item, and its prefix.
+     */
+    void SetKey(int pos, const string &nkey)
+    {
+        m_aBufArr[pos].rec->nkey = nkey;
+        m_aBufArr[pos].prefix = KeyPrefix(nkey);
+    }
+
+    /**
+     * @brief Number of records read by SortFile.
+     */
+    uint64_t Records(void)
+    {
+        return m_iRecTot;
+    }
+
+    /**
+     * @brief Sizes the buffer array and sort files as SortFile would.
+     */
+    bool Plan(uint recCnt)
+    {
+        if (!InitWorkDir())
+            return false;
+
+        PlanSort(recCnt);
+        return true;
+    }
+};
+
+int main(int argc, const char *argv[])
+{
+    string inFile;
+    int col1 = 0, col2 = 0, col3 = 0;
+    int reps = 1;
+    long memMB = SORT_MEM_SZ >> 20;
+    vector<wstring> lines;
+    vector<KeyRecType> keys;
+    size_t bytes = 0, keyBytes = 0;
+    double sec;
+    bool badArgs = false; // an unknown option, or one missing its value
+
+    for (int i = 1; i < argc && !badArgs; i++)
+    {
+        if (i + 1 == argc)
+            badArgs = true;
+        else if (strcmp(argv[i], "-i") == 0)
+            inFile = argv[++i];
+        else if (strcmp(argv[i], "-c1") == 0)
+            col1 = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c2") == 0)
+            col2 = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c3") == 0)
+            col3 = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--reps") == 0)
+            reps = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--mem") == 0)
+            memMB = atol(argv[++i]);
+        else
+            badArgs = true;
+    }
+
+    if (inFile.empty() || col1 <= 0 || memMB <= 0 || badArgs)
+    {
+        printf("Usage is -i <csv file> -c1 <sort column 1> [-c2 <sort column 2>] "
+               "[-c3 <sort column 3>] [--reps <times>] [--mem <MB>]\n");
+        return 1;
+    }
+
+    printf("%-16s %12s %10s %9s %10s %12s\n", "benchmark", "records", "MB",
+           "sec", "MB/s", "records/s");
+
+    // SortFile end to end, as the sorter program runs it.
+    for (int r = 0; r < reps; r++)
+    {
+        string outFile = inFile + ".bench.out";
+        BenchSorter sorter(inFile, outFile, col1, col2, col3);
+        FILE *fP = fopen(inFile.c_str(), "rb");
+        auto start = chrono::steady_clock::now();
+
+        sorter.SetMemory((size_t)memMB << 20);
+
+        if (!sorter.SortFile())
+            return 1;
+
+        sec = Since(start);
+
+        if (fP)
+        {
+            fseek(fP, 0, SEEK_END);
+            bytes = ftell(fP);
+            fclose(fP);
+        }
+
+        remove(outFile.c_str());
+        Report("SortFile", sorter.Records(), bytes, sec);
+    }
+
+    // The kernels, on records already in memory.
+    BenchSorter sorter(inFile, inFile + ".bench.out", col1, col2, col3);
+
+    sorter.SetMemory((size_t)memMB << 20);
+
+    if (!sorter.ReadLines(&lines, &bytes) || lines.empty())
+    {
+        printf("Error reading from file: %s\n", inFile.c_str());
+        return 1;
+    }
+
+    sorter.Plan(lines.size());
+
+    for (int r = 0; r < reps; r++)
+    {
+        sec = sorter.KeyExtract(lines, &keys);
+        Report("key extract", lines.size(), bytes, sec);
+    }
+
+    for (const KeyRecType &key : keys)
+        keyBytes += key.nkey.length();
+
+    sec = sorter.Compare(keys, reps);
+    Report("compare", (double)(keys.size() - 1) * reps,
+           2.0 * keyBytes * reps, sec);
+
+    for (int r = 0; r < reps; r++)
+    {
+        double incrSec;
+        size_t sortN, incrN;
+        double avgKey = (double)keyBytes / keys.size();
+
+        sec = sorter.BufferSort(keys, &sortN, &incrSec, &incrN);
+        Report("buffer sort", sortN, sortN * avgKey, sec);
+        Report("buffer insert", incrN, incrN * avgKey, incrSec);
+
+        sec = sorter.PointerSort(keys, &sortN);
+        Report("pointer sort", sortN, sortN * avgKey, sec);
+    }
+
+    for (int r = 0; r < reps; r++)
+    {
+        size_t mrgBytes = 0;
+
+        if ((sec = sorter.Merge(lines, keys, &mrgBytes)) < 0)
+            return 1;
+        Report("merge", lines.size(), mrgBytes, sec);
+    }
+
+    return 0;
+}
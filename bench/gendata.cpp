@@ -0,0 +1,224 @@
+/**
+ * @file gendata.cpp
+ * @author Daniel Rencricca
+ * @brief Writes a csv file of synthetic records for benchmarking the sorter.
+ *
+ * The first column of each record is the sort key, followed by payload
+ * columns of random letters. The keys can be:
+ *
+ *   random   uniform over 10 x rows values (few duplicates)
+ *   sorted   already in ascending order
+ *   reverse  in descending order
+ *   few      uniform over --unique values (many duplicates)
+ *   zipf     Zipf distributed over --unique values, exponent --skew
+ *
+ * and formatted as zero-padded integers, fixed point numbers, base-26
+ * strings or dates. All formats sort as text in the order of their value,
+ * so "sorted" input is sorted for the sorter too.
+ *
+ * Example: ./gendata -n 1000000 -o data.csv --dist zipf --type str
+ *
+ * @version 1.1
+ * @date 2015-12-22
+ *
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+enum { DIST_RANDOM, DIST_SORTED, DIST_REVERSE, DIST_FEW, DIST_ZIPF };
+enum { TYPE_INT, TYPE_FLOAT, TYPE_STR, TYPE_DATE };
+
+/**
+ * @brief Writes a key value in the chosen format.
+ *
+ * @param buf  Buffer of at least 32 characters.
+ * @param type One of the TYPE_ values.
+ * @param val  Key value.
+ *
+ * @return Void.
+ */
+static void FormatKey(char *buf, int type, unsigned long long val)
+{
+    switch (type)
+    {
+    case TYPE_FLOAT:
+        sprintf(buf, "%015.2f", val / 100.0);
+        break;
+
+    case TYPE_STR: // 10 base-26 digits
+        for (int x = 9; x >= 0; x--, val /= 26)
+            buf[x] = 'a' + val % 26;
+        buf[10] = '\0';
+        break;
+
+    case TYPE_DATE: // seconds after 2000-01-01
+    {
+        time_t t = 946684800 + (time_t)(val % 3000000000ULL);
+        struct tm tmv;
+
+        gmtime_r(&t, &tmv);
+        strftime(buf, 32, "%Y-%m-%d %H:%M:%S", &tmv);
+        break;
+    }
+
+    default:
+        sprintf(buf, "%012llu", val);
+        break;
+    }
+}
+
+int main(int argc, const char *argv[])
+{
+    unsigned long long rows = 100000;
+    unsigned long long unique = 1000; // distinct keys for few and zipf
+    int cols = 4, width = 16;
+    int dist = DIST_RANDOM, type = TYPE_INT;
+    double skew = 1.1;
+    unsigned seed = 1;
+    char delim = ',';
+    bool quote = false;
+    const char *outFile = NULL;
+    vector<double> cdf; // zipf cumulative distribution
+    FILE *fP;
+    bool badArgs = false; // an unknown option, or one missing its value
+
+    for (int i = 1; i < argc && !badArgs; i++)
+    {
+        if (strcmp(argv[i], "--tab") == 0)
+            delim = '\t';
+        else if (strcmp(argv[i], "--quote") == 0)
+            quote = true;
+        else if (i + 1 == argc)
+            badArgs = true;
+        else if (strcmp(argv[i], "-n") == 0)
+            rows = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-o") == 0)
+            outFile = argv[++i];
+        else if (strcmp(argv[i], "--cols") == 0)
+            cols = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--width") == 0)
+            width = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--unique") == 0)
+            unique = max(1ULL, strtoull(argv[++i], NULL, 10));
+        else if (strcmp(argv[i], "--skew") == 0)
+            skew = atof(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0)
+            seed = (unsigned)atoi(argv[++i]);
+        else if (strcmp(argv[i], "--dist") == 0)
+        {
+            const char *arg = argv[++i];
+
+            dist = !strcmp(arg, "sorted")  ? DIST_SORTED :
+                   !strcmp(arg, "reverse") ? DIST_REVERSE :
+                   !strcmp(arg, "few")     ? DIST_FEW :
+                   !strcmp(arg, "zipf")    ? DIST_ZIPF : DIST_RANDOM;
+        }
+        else if (strcmp(argv[i], "--type") == 0)
+        {
+            const char *arg = argv[++i];
+
+            type = !strcmp(arg, "float") ? TYPE_FLOAT :
+                   !strcmp(arg, "str")   ? TYPE_STR :
+                   !strcmp(arg, "date")  ? TYPE_DATE : TYPE_INT;
+        }
+        else
+            badArgs = true;
+    }
+
+    if (!outFile || badArgs)
+    {
+        printf("Usage is -n <rows> -o <outfile> [--cols <columns>] "
+               "[--width <payload chars>] [--dist random|sorted|reverse|few|zipf] "
+               "[--type int|float|str|date] [--unique <keys>] [--skew <zipf s>] "
+               "[--seed <n>] [--tab] [--quote]\n");
+        return 1;
+    }
+
+    if (!(fP = fopen(outFile, "w")))
+    {
+        printf("Error opening file: %s\n", outFile);
+        return 1;
+    }
+
+    mt19937_64 rng(seed);
+
+    if (dist == DIST_ZIPF)
+    {
+        double sum = 0;
+
+        cdf.resize(unique);
+        for (unsigned long long k = 0; k < unique; k++)
+            cdf[k] = (sum += 1.0 / pow((double)(k + 1), skew));
+        for (double &c : cdf)
+            c /= sum;
+    }
+
+    // The header line.
+    const char *q = quote ? "\"" : "";
+
+    fprintf(fP, "%skey%s", q, q);
+    for (int c = 1; c < cols; c++)
+        fprintf(fP, "%c%scol%d%s", delim, q, c + 1, q);
+    fputc('\n', fP);
+
+    uniform_real_distribution<double> real01(0.0, 1.0);
+    char key[32];
+    string payload(width, ' ');
+
+    for (unsigned long long r = 0; r < rows; r++)
+    {
+        unsigned long long val;
+
+        switch (dist)
+        {
+        case DIST_SORTED:
+            val = r;
+            break;
+        case DIST_REVERSE:
+            val = rows - 1 - r;
+            break;
+        case DIST_FEW:
+            val = rng() % unique;
+            break;
+        case DIST_ZIPF: // scattered so the most common keys are not all lowest
+            val = (lower_bound(cdf.begin(), cdf.end(), real01(rng)) -
+                   cdf.begin()) * 2654435761ULL % (unique * 10);
+            break;
+        default:
+            val = rng() % (rows * 10);
+            break;
+        }
+
+        FormatKey(key, type, val);
+        fprintf(fP, "%s%s%s", q, key, q);
+
+        for (int c = 1; c < cols; c++)
+        {
+            for (int x = 0; x < width; x++)
+                payload[x] = 'a' + rng() % 26;
+            fprintf(fP, "%c%s%s%s", delim, q, payload.c_str(), q);
+        }
+
+        fputc('\n', fP);
+    }
+
+    if (fclose(fP))
+    {
+        printf("Error writing to file: %s\n", outFile);
+        return 1;
+    }
+
+    return 0;
+}
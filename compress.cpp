@@ -0,0 +1,1180 @@
+/**
+ * @file compress.cpp
+ * @author Daniel Rencricca
+ * @brief The streams that read and write gzip and zstd files, with the
+ * (de)compression spread over several threads where the format allows.
+ *
+ * @version 1.1
+ * @date 2015-12-22
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <system_error>
+
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+using namespace std;
+
+// The empty block that ends a bgzf file.
+static const unsigned char cBgzfEof[28] = {
+    0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0,
+    0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/**
+ * The (de)compression state of a worker thread, kept from job to job.
+ */
+struct ZipStream::CtxType
+{
+    z_stream   inf;             // inflates bgzf blocks
+    bool       infInit = false;
+    z_stream   def;             // deflates bgzf blocks
+    bool       defInit = false;
+#ifdef USE_ZSTD
+    ZSTD_DCtx* dctx = NULL;
+    ZSTD_CCtx* cctx = NULL;
+#endif
+
+    ~CtxType()
+    {
+        if (infInit)
+            inflateEnd(&inf);
+        if (defInit)
+            deflateEnd(&def);
+#ifdef USE_ZSTD
+        ZSTD_freeDCtx(dctx);
+        ZSTD_freeCCtx(cctx);
+#endif
+    }
+};
+
+static uint32_t Get16(const void* pos)
+{
+    const unsigned char* p = (const unsigned char*)pos;
+
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t Get32(const void* pos)
+{
+    const unsigned char* p = (const unsigned char*)pos;
+
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void Put32(void* pos, uint32_t val)
+{
+    unsigned char* p = (unsigned char*)pos;
+
+    for (int x = 0; x < 4; x++)
+        p[x] = val >> (8 * x);
+}
+
+/**
+ * @brief Gives the size of a bgzf block from its header: a gzip member
+ * header whose extra field holds a "BC" subfield with the block size.
+ *
+ * @param hdr The header.
+ * @param len Bytes of hdr that can be looked at.
+ *
+ * @return Bytes in the whole block, or 0 if hdr is not a bgzf header.
+ */
+static size_t BgzfSize(const unsigned char* hdr, size_t len)
+{
+    size_t xlen, x;
+
+    if (len < 12 || hdr[0] != 0x1f || hdr[1] != 0x8b || hdr[2] != 8 ||
+        !(hdr[3] & 4))
+        return 0;
+
+    xlen = Get16(hdr + 10);
+
+    if (len < 12 + xlen)
+        return 0;
+
+    for (x = 12; x + 4 <= 12 + xlen; x += 4 + Get16(hdr + x + 2))
+    {
+        if (hdr[x] == 'B' && hdr[x + 1] == 'C' && Get16(hdr + x + 2) == 2 &&
+            x + 6 <= 12 + xlen)
+            return Get16(hdr + x + 4) + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Writes all of a buffer to a file descriptor.
+ *
+ * @return true if successful, else false if error.
+ */
+static bool WriteAll(int fd, const char* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Tells how a file is compressed, from its first bytes.
+ *
+ * @param name Name of the file.
+ *
+ * @return ZIP_GZIP, ZIP_ZSTD, or ZIP_NONE if it is not compressed or cannot
+ * be read.
+ */
+int ZipType(const char* name)
+{
+    unsigned char magic[4];
+    int fd = open(name, O_RDONLY);
+    ssize_t n;
+
+    if (fd < 0)
+        return ZIP_NONE;
+
+    n = read(fd, magic, sizeof(magic));
+    close(fd);
+
+    if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return ZIP_GZIP;
+
+    if (n == 4 && Get32(magic) == 0xfd2fb528)
+        return ZIP_ZSTD;
+
+    return ZIP_NONE;
+}
+
+/**
+ * @brief Tells if the program was built to read and write a format. zstd
+ * needs USE_ZSTD and libzstd.
+ *
+ * @param type ZIP_NONE, ZIP_GZIP or ZIP_ZSTD.
+ *
+ * @return true if it was, else false.
+ */
+bool ZipSupported(int type)
+{
+#ifdef USE_ZSTD
+    return type == ZIP_NONE || type == ZIP_GZIP || type == ZIP_ZSTD;
+#else
+    return type == ZIP_NONE || type == ZIP_GZIP;
+#endif
+}
+
+/**
+ * @brief Construct a new ZipStream object, with no file open.
+ */
+ZipStream::ZipStream()
+{
+    m_iFd = -1;
+    m_iType = ZIP_NONE;
+    m_bWrite = false;
+    m_bBgzf = false;
+    m_iPos = 0;
+    m_iSrcDone = 0;
+    m_iCurPos = 0;
+    m_iMaxJobs = 0;
+    m_bEnd = false;
+    m_bFailed = false;
+    m_bStop = false;
+}
+
+/**
+ * @brief Destroy the ZipStream object. Its stream should have been closed
+ * already, else its threads are stopped and the file closed.
+ */
+ZipStream::~ZipStream()
+{
+    if (m_iFd >= 0)
+    {
+        Stop();
+        close(m_iFd);
+    }
+}
+
+/**
+ * @brief Opens a compressed file for reading, and starts decompressing it.
+ *
+ * @param name Name of the file.
+ * @param type ZIP_GZIP or ZIP_ZSTD, as found by ZipType.
+ *
+ * @return The stream of uncompressed data, to be closed with fclose, or NULL
+ * if error (errno is ENOTSUP if the format is not supported).
+ */
+FILE* ZipStream::OpenRead(const char* name, int type)
+{
+    cookie_io_functions_t io = {Read, NULL, Seek, Close};
+    FILE* fP;
+
+    if (type == ZIP_NONE || !ZipSupported(type))
+    {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    if ((m_iFd = open(name, O_RDONLY)) < 0)
+        return NULL;
+
+    posix_fadvise(m_iFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    m_iType = type;
+    m_bWrite = false;
+
+    if (Start() && (fP = fopencookie(this, "r", io)))
+        return fP;
+
+    Stop();
+    close(m_iFd);
+    m_iFd = -1;
+
+    return NULL;
+}
+
+/**
+ * @brief Creates a compressed file. gzip output is written as bgzf blocks,
+ * which any gzip reader can read, and zstd output as one frame per
+ * ZIP_JOB_SZ bytes.
+ *
+ * @param name Name of the file.
+ * @param type ZIP_GZIP or ZIP_ZSTD.
+ *
+ * @return The stream to write the uncompressed data to, to be closed with
+ * fclose, or NULL if error (errno is ENOTSUP if the format is not
+ * supported).
+ */
+FILE* ZipStream::OpenWrite(const char* name, int type)
+{
+    cookie_io_functions_t io = {NULL, Write, Seek, Close};
+    FILE* fP;
+
+    if (type == ZIP_NONE || !ZipSupported(type))
+    {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    if ((m_iFd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        return NULL;
+
+    m_iType = type;
+    m_bWrite = true;
+
+    if (Start() && (fP = fopencookie(this, "w", io)))
+        return fP;
+
+    Stop();
+    close(m_iFd);
+    m_iFd = -1;
+
+    return NULL;
+}
+
+/**
+ * @brief Gives the bytes of the compressed file behind the data read so far,
+ * estimated within the job being read. Used to show progress and to guess
+ * how large the file is once decompressed.
+ *
+ * @return The compressed bytes.
+ */
+uint64_t ZipStream::SrcPos(void) const
+{
+    if (m_Cur.out.empty())
+        return m_iSrcDone;
+
+    return m_iSrcDone + m_Cur.srcLen * m_iCurPos / m_Cur.out.size();
+}
+
+/**
+ * @brief Starts the threads, from the start of the file.
+ *
+ * @return true if successful, else false if error.
+ */
+bool ZipStream::Start(void)
+{
+    uint threads = min(max(1u, thread::hardware_concurrency()),
+                       (uint)ZIP_MAX_THREADS);
+
+    if (!m_bWrite && lseek(m_iFd, 0, SEEK_SET) < 0)
+        return false;
+
+    m_iPos = 0;
+    m_iSrcDone = 0;
+    m_Cur = JobType();
+    m_iCurPos = 0;
+    m_aJobs.clear();
+    m_iMaxJobs = 2 * threads + 2;
+    m_bEnd = false;
+    m_bFailed = false;
+    m_bStop = false;
+    m_bBgzf = false;
+
+    try
+    {
+        for (uint x = 0; x < threads; x++)
+            m_aWorkers.emplace_back(&ZipStream::Work, this);
+
+        if (!m_bWrite)
+            m_Producer = thread(&ZipStream::Produce, this);
+    }
+    catch (const system_error&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Stops the threads and drops any jobs not yet read or written.
+ *
+ * @return Void.
+ */
+void ZipStream::Stop(void)
+{
+    {
+        lock_guard<mutex> lock(m_Lock);
+        m_bStop = true;
+    }
+    m_Cond.notify_all();
+
+    if (m_Producer.joinable())
+        m_Producer.join();
+
+    for (thread& worker : m_aWorkers)
+        worker.join();
+
+    m_aWorkers.clear();
+    m_aJobs.clear();
+}
+
+/**
+ * @brief Adds a job to the end of m_aJobs, once there is room for it.
+ *
+ * @param job The job, which is moved out and left empty.
+ *
+ * @return true if successful, else false if the threads are stopping.
+ */
+bool ZipStream::Submit(JobType* job)
+{
+    unique_lock<mutex> lock(m_Lock);
+
+    m_Cond.wait(lock, [this] { return m_bStop || m_aJobs.size() < m_iMaxJobs; });
+
+    if (m_bStop)
+        return false;
+
+    m_aJobs.push_back(move(*job));
+    *job = JobType();
+    m_Cond.notify_all();
+
+    return true;
+}
+
+/**
+ * @brief Makes the first job of m_aJobs the one read from, once it has been
+ * decompressed.
+ *
+ * @return true if successful, else false at the end of the file or if error.
+ */
+bool ZipStream::NextJob(void)
+{
+    unique_lock<mutex> lock(m_Lock);
+
+    m_iSrcDone += m_Cur.srcLen;
+    m_Cur = JobType();
+    m_iCurPos = 0;
+
+    m_Cond.wait(lock, [this] {
+        return m_aJobs.empty() ? m_bEnd : m_aJobs.front().state >= JOB_DONE;
+    });
+
+    if (m_aJobs.empty())
+        return false;
+
+    if (m_aJobs.front().state == JOB_FAIL)
+    {
+        m_bFailed = true;
+        return false;
+    }
+
+    m_Cur = move(m_aJobs.front());
+    m_aJobs.pop_front();
+    m_Cond.notify_all();
+
+    return true;
+}
+
+/**
+ * @brief Writes the compressed jobs at the front of m_aJobs to the file, in
+ * order, waiting for them to be compressed until at most keep are left.
+ *
+ * @param keep Jobs that may be left.
+ *
+ * @return true if successful, else false if error.
+ */
+bool ZipStream::Drain(size_t keep)
+{
+    unique_lock<mutex> lock(m_Lock);
+
+    while (!m_aJobs.empty() && !m_bFailed)
+    {
+        if (m_aJobs.front().state == JOB_FAIL)
+        {
+            m_bFailed = true;
+        }
+        else if (m_aJobs.front().state == JOB_DONE)
+        {
+            vector<char> out;
+
+            out.swap(m_aJobs.front().out);
+            m_aJobs.pop_front();
+
+            lock.unlock();
+            bool ok = WriteAll(m_iFd, out.data(), out.size());
+            lock.lock();
+
+            m_bFailed = !ok;
+        }
+        else if (m_aJobs.size() > keep)
+        {
+            m_Cond.wait(lock);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    return !m_bFailed;
+}
+
+/**
+ * @brief stdio read function: copies decompressed data to buf.
+ *
+ * @return Bytes copied, 0 at the end of the file, or -1 if error.
+ */
+ssize_t ZipStream::Read(void* cookie, char* buf, size_t size)
+{
+    ZipStream* zs = (ZipStream*)cookie;
+    size_t n = 0;
+
+    while (n < size)
+    {
+        size_t len = zs->m_Cur.out.size() - zs->m_iCurPos;
+
+        if (len == 0)
+        {
+            if (!zs->NextJob())
+                break;
+            continue;
+        }
+
+        len = min(len, size - n);
+        memcpy(buf + n, zs->m_Cur.out.data() + zs->m_iCurPos, len);
+        zs->m_iCurPos += len;
+        n += len;
+    }
+
+    zs->m_iPos += n;
+
+    if (n == 0 && zs->m_bFailed)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    return n;
+}
+
+/**
+ * @brief stdio write function: adds buf to the job being filled, and hands
+ * the job to the workers once it holds ZIP_JOB_SZ bytes.
+ *
+ * @return Bytes taken, or 0 if error.
+ */
+ssize_t ZipStream::Write(void* cookie, const char* buf, size_t size)
+{
+    ZipStream* zs = (ZipStream*)cookie;
+    size_t n = 0;
+
+    while (n < size)
+    {
+        size_t len = min(size - n, ZIP_JOB_SZ - zs->m_Cur.in.size());
+
+        if (zs->m_Cur.in.empty())
+            zs->m_Cur.in.reserve(ZIP_JOB_SZ);
+
+        zs->m_Cur.in.insert(zs->m_Cur.in.end(), buf + n, buf + n + len);
+        n += len;
+
+        if (zs->m_Cur.in.size() == ZIP_JOB_SZ &&
+            !(zs->Drain(zs->m_iMaxJobs - 1) && zs->Submit(&zs->m_Cur)))
+            return 0;
+    }
+
+    zs->m_iPos += size;
+
+    return size;
+}
+
+/**
+ * @brief stdio seek function. A read stream seeks by decompressing up to
+ * the new position, from the start of the file if it is behind the current
+ * one. A write stream can only tell its position.
+ *
+ * @return 0 if successful, else -1 if error.
+ */
+int ZipStream::Seek(void* cookie, off64_t* offset, int whence)
+{
+    ZipStream* zs = (ZipStream*)cookie;
+    off64_t target;
+
+    if (whence == SEEK_SET)
+        target = *offset;
+    else if (whence == SEEK_CUR)
+        target = zs->m_iPos + *offset;
+    else
+        target = -1;
+
+    if (target < 0 || (zs->m_bWrite && (uint64_t)target != zs->m_iPos))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((uint64_t)target < zs->m_iPos)
+    {
+        zs->Stop();
+
+        if (!zs->Start())
+        {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    while (zs->m_iPos < (uint64_t)target)
+    {
+        size_t len = zs->m_Cur.out.size() - zs->m_iCurPos;
+
+        if (len == 0)
+        {
+            if (!zs->NextJob())
+                break;
+            continue;
+        }
+
+        len = min((uint64_t)len, target - zs->m_iPos);
+        zs->m_iCurPos += len;
+        zs->m_iPos += len;
+    }
+
+    *offset = zs->m_iPos;
+
+    return 0;
+}
+
+/**
+ * @brief stdio close function. A write stream first writes what is left,
+ * and ends a gzip file with the bgzf end block.
+ *
+ * @return 0 if successful, else -1 if error.
+ */
+int ZipStream::Close(void* cookie)
+{
+    ZipStream* zs = (ZipStream*)cookie;
+    bool ok = true;
+
+    if (zs->m_bWrite)
+    {
+        if (!zs->m_Cur.in.empty())
+            ok = zs->Drain(zs->m_iMaxJobs - 1) && zs->Submit(&zs->m_Cur);
+
+        ok = ok && zs->Drain(0);
+
+        if (ok && zs->m_iType == ZIP_GZIP)
+            ok = WriteAll(zs->m_iFd, (const char*)cBgzfEof, sizeof(cBgzfEof));
+    }
+
+    zs->Stop();
+    ok = !close(zs->m_iFd) && ok;
+    zs->m_iFd = -1;
+
+    if (!ok)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Body of the reading thread: splits the compressed file into jobs.
+ *
+ * @return Void.
+ */
+void ZipStream::Produce(void)
+{
+    unsigned char hdr[64];
+    bool ok;
+
+    if (m_iType == ZIP_GZIP)
+    {
+        ssize_t n = pread(m_iFd, hdr, sizeof(hdr), 0);
+
+        m_bBgzf = n > 0 && BgzfSize(hdr, n) > 0;
+        ok = m_bBgzf ? ProduceBgzf() : ProduceGzip();
+    }
+    else
+    {
+        ok = ProduceZstd();
+    }
+
+    lock_guard<mutex> lock(m_Lock);
+    m_bEnd = true;
+    m_bFailed = m_bFailed || (!ok && !m_bStop);
+    m_Cond.notify_all();
+}
+
+/**
+ * @brief Splits a bgzf file into jobs of whole blocks, each holding about
+ * ZIP_JOB_SZ bytes once inflated, for the workers to inflate.
+ *
+ * @return true if successful, else false if error.
+ */
+bool ZipStream::ProduceBgzf(void)
+{
+    JobType job;
+    unsigned char hdr[12];
+    ssize_t n;
+
+    while ((n = ReadSrc(hdr, sizeof(hdr))) > 0)
+    {
+        size_t at = job.in.size();
+        size_t xlen = Get16(hdr + 10);
+        size_t size;
+
+        if (n != sizeof(hdr))
+            return false; // the file ends within a block
+
+        job.in.resize(at + sizeof(hdr) + xlen);
+        memcpy(&job.in[at], hdr, sizeof(hdr));
+
+        if (ReadSrc(&job.in[at + sizeof(hdr)], xlen) != (ssize_t)xlen)
+            return false;
+
+        size = BgzfSize((unsigned char*)&job.in[at], sizeof(hdr) + xlen);
+
+        if (size < sizeof(hdr) + xlen + 8)
+            return false; // not a bgzf block
+
+        job.in.resize(at + size);
+
+        if (ReadSrc(&job.in[at + sizeof(hdr) + xlen], size - sizeof(hdr) - xlen) !=
+            (ssize_t)(size - sizeof(hdr) - xlen))
+            return false;
+
+        job.outLen += Get32(&job.in[at + size - 4]);
+
+        if (job.outLen >= ZIP_JOB_SZ)
+        {
+            job.srcLen = job.in.size();
+
+            if (!Submit(&job))
+                return false;
+        }
+    }
+
+    if (n < 0)
+        return false;
+
+    job.srcLen = job.in.size();
+
+    return job.in.empty() || Submit(&job);
+}
+
+/**
+ * @brief Inflates a gzip file that is not in bgzf blocks, which can only be
+ * done in order, into jobs of ZIP_JOB_SZ bytes that need no more work. The
+ * file may hold several gzip members; anything after the last, such as zero
+ * padding, is ignored as gzip does.
+ *
+ * @return true if successful, else false if error.
+ */
+bool ZipStream::ProduceGzip(void)
+{
+    vector<char> src(ZIP_JOB_SZ / 4);
+    bool inMember = true; // within a gzip member
+    bool ok = true;
+    JobType job;
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+        return false;
+
+    job.out.resize(ZIP_JOB_SZ);
+    zs.next_out = (Bytef*)job.out.data();
+    zs.avail_out = job.out.size();
+
+    while (ok)
+    {
+        if (zs.avail_in == 0)
+        {
+            ssize_t n = ReadSrc(src.data(), src.size());
+
+            if (n <= 0)
+            {
+                ok = n == 0 && !inMember; // else the file is cut short
+                break;
+            }
+
+            zs.next_in = (Bytef*)src.data();
+            zs.avail_in = n;
+        }
+
+        if (!inMember)
+        {
+            if (zs.next_in[0] != 0x1f)
+                break; // not another member
+
+            inflateReset(&zs);
+            inMember = true;
+        }
+
+        uInt avail = zs.avail_in;
+        int ret = inflate(&zs, Z_NO_FLUSH);
+
+        job.srcLen += avail - zs.avail_in;
+
+        if (ret == Z_STREAM_END)
+            inMember = false;
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+            ok = false;
+
+        if (ok && zs.avail_out == 0)
+        {
+            job.state = JOB_DONE;
+            ok = Submit(&job);
+
+            job.out.resize(ZIP_JOB_SZ);
+            zs.next_out = (Bytef*)job.out.data();
+            zs.avail_out = job.out.size();
+        }
+    }
+
+    if (ok && zs.avail_out < ZIP_JOB_SZ)
+    {
+        job.out.resize(ZIP_JOB_SZ - zs.avail_out);
+        job.state = JOB_DONE;
+        ok = Submit(&job);
+    }
+
+    inflateEnd(&zs);
+
+    return ok;
+}
+
+/**
+ * @brief Splits a zstd file into jobs of whole frames for the workers to
+ * decompress, each job holding at least a quarter of ZIP_JOB_SZ. Once a
+ * frame is found that is larger than ZIP_FRAME_MAX, such as a file made of
+ * one frame, the rest of the file is decompressed in order by StreamZstd.
+ *
+ * @return true if successful, else false if error.
+ */
+bool ZipStream::ProduceZstd(void)
+{
+#ifdef USE_ZSTD
+    vector<char> buf; // compressed data not yet in a job
+    size_t off = 0;   // start of the next frame in buf
+    bool eof = false;
+    JobType job;
+
+    while (true)
+    {
+        size_t size = ZSTD_findFrameCompressedSize(buf.data() + off, buf.size() - off);
+
+        if (off < buf.size() && !ZSTD_isError(size))
+        {
+            unsigned long long len = ZSTD_getFrameContentSize(buf.data() + off, size);
+
+            if (len < ZSTD_CONTENTSIZE_ERROR)
+                job.outLen += len;
+
+            job.in.insert(job.in.end(), buf.begin() + off, buf.begin() + off + size);
+            off += size;
+
+            if (job.in.size() >= ZIP_JOB_SZ / 4)
+            {
+                job.srcLen = job.in.size();
+
+                if (!Submit(&job))
+                    return false;
+            }
+            continue;
+        }
+
+        if (eof)
+            break;
+
+        buf.erase(buf.begin(), buf.begin() + off);
+        off = 0;
+
+        if (buf.size() >= ZIP_FRAME_MAX)
+        {
+            job.srcLen = job.in.size();
+
+            return (job.in.empty() || Submit(&job)) && StreamZstd(&buf);
+        }
+
+        size_t at = buf.size();
+        buf.resize(at + ZIP_JOB_SZ / 4);
+
+        ssize_t n = ReadSrc(&buf[at], ZIP_JOB_SZ / 4);
+
+        if (n < 0)
+            return false;
+
+        buf.resize(at + n);
+        eof = n == 0;
+    }
+
+    job.srcLen = job.in.size();
+
+    return off == buf.size() && (job.in.empty() || Submit(&job));
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Decompresses the rest of a zstd file in order, into jobs of
+ * ZIP_JOB_SZ bytes that need no more work.
+ *
+ * @param buf Compressed data already read from the file, then used to read
+ * the rest.
+ *
+ * @return true if successful, else false if error.
+ */
+bool ZipStream::StreamZstd(vector<char>* buf)
+{
+#ifdef USE_ZSTD
+    ZSTD_DStream* ds = ZSTD_createDStream();
+    ZSTD_inBuffer in = {buf->data(), buf->size(), 0};
+    ZSTD_outBuffer out;
+    size_t ret = 0;
+    bool ok = ds != NULL;
+    JobType job;
+
+    job.out.resize(ZIP_JOB_SZ);
+    out = {job.out.data(), job.out.size(), 0};
+
+    while (ok)
+    {
+        if (in.pos == in.size)
+        {
+            ssize_t n = ReadSrc(buf->data(), buf->size());
+
+            if (n <= 0)
+            {
+                ok = n == 0 && ret == 0; // else the file is cut short
+                break;
+            }
+
+            in = {buf->data(), (size_t)n, 0};
+        }
+
+        size_t pos = in.pos;
+
+        ret = ZSTD_decompressStream(ds, &out, &in);
+        job.srcLen += in.pos - pos;
+
+        if (ZSTD_isError(ret))
+        {
+            ok = false;
+        }
+        else if (out.pos == out.size)
+        {
+            job.state = JOB_DONE;
+            ok = Submit(&job);
+
+            job.out.resize(ZIP_JOB_SZ);
+            out = {job.out.data(), job.out.size(), 0};
+        }
+    }
+
+    if (ok && out.pos > 0)
+    {
+        job.out.resize(out.pos);
+        job.state = JOB_DONE;
+        ok = Submit(&job);
+    }
+
+    ZSTD_freeDStream(ds);
+
+    return ok;
+#else
+    (void)buf;
+    return false;
+#endif
+}
+
+/**
+ * @brief Body of a worker thread: (de)compresses the first job of m_aJobs
+ * that is waiting, until the threads are stopped.
+ *
+ * @return Void.
+ */
+void ZipStream::Work(void)
+{
+    CtxType ctx;
+    unique_lock<mutex> lock(m_Lock);
+
+    while (!m_bStop)
+    {
+        auto job = find_if(m_aJobs.begin(), m_aJobs.end(),
+                           [](const JobType& j) { return j.state == JOB_WAIT; });
+
+        if (job == m_aJobs.end())
+        {
+            m_Cond.wait(lock);
+            continue;
+        }
+
+        job->state = JOB_BUSY;
+        lock.unlock();
+
+        bool ok = m_bWrite ? Encode(&ctx, &*job) : Decode(&ctx, &*job);
+
+        lock.lock();
+        job->state = ok ? JOB_DONE : JOB_FAIL;
+        m_Cond.notify_all();
+    }
+}
+
+/**
+ * @brief Decompresses a job of bgzf blocks or zstd frames. Each bgzf block
+ * is checked against the length and crc32 in its trailer.
+ *
+ * @param ctx State of the worker.
+ * @param job The job.
+ *
+ * @return true if successful, else false if the data is corrupt.
+ */
+bool ZipStream::Decode(CtxType* ctx, JobType* job)
+{
+    if (m_iType == ZIP_GZIP)
+    {
+        const unsigned char* blk = (const unsigned char*)job->in.data();
+        const unsigned char* end = blk + job->in.size();
+        unsigned char* out;
+
+        if (!ctx->infInit)
+        {
+            memset(&ctx->inf, 0, sizeof(ctx->inf));
+
+            if (inflateInit2(&ctx->inf, -MAX_WBITS) != Z_OK)
+                return false;
+
+            ctx->infInit = true;
+        }
+
+        job->out.resize(job->outLen);
+        out = (unsigned char*)job->out.data();
+
+        for (size_t size; blk < end; blk += size)
+        {
+            size_t data = 12 + Get16(blk + 10);
+            uint32_t len;
+
+            size = BgzfSize(blk, end - blk);
+            len = Get32(blk + size - 4);
+
+            if (len == 0)
+                continue; // an empty block, such as the end block
+
+            inflateReset(&ctx->inf);
+            ctx->inf.next_in = (Bytef*)blk + data;
+            ctx->inf.avail_in = size - data - 8;
+            ctx->inf.next_out = out;
+            ctx->inf.avail_out = len;
+
+            if (inflate(&ctx->inf, Z_FINISH) != Z_STREAM_END ||
+                ctx->inf.avail_out != 0 || crc32(0, out, len) != Get32(blk + size - 8))
+                return false;
+
+            out += len;
+        }
+
+        job->in = vector<char>();
+
+        return true;
+    }
+
+#ifdef USE_ZSTD
+    ZSTD_inBuffer in = {job->in.data(), job->in.size(), 0};
+    size_t pos = 0;
+    size_t ret = 0;
+
+    if (!ctx->dctx && !(ctx->dctx = ZSTD_createDCtx()))
+        return false;
+
+    ZSTD_DCtx_reset(ctx->dctx, ZSTD_reset_session_only);
+    job->out.resize(max(job->outLen, (uint64_t)ZIP_JOB_SZ));
+
+    while (in.pos < in.size || ret != 0)
+    {
+        if (pos == job->out.size())
+            job->out.resize(2 * pos);
+
+        ZSTD_outBuffer out = {job->out.data(), job->out.size(), pos};
+
+        ret = ZSTD_decompressStream(ctx->dctx, &out, &in);
+
+        if (ZSTD_isError(ret) || (ret != 0 && in.pos == in.size && out.pos < out.size))
+            return false; // corrupt, or a frame cut short
+
+        pos = out.pos;
+    }
+
+    job->out.resize(pos);
+    job->in = vector<char>();
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Compresses a job, as bgzf blocks of at most BGZF_BLOCK_SZ bytes
+ * each or as one zstd frame.
+ *
+ * @param ctx State of the worker.
+ * @param job The job.
+ *
+ * @return true if successful, else false if error.
+ */
+bool ZipStream::Encode(CtxType* ctx, JobType* job)
+{
+    if (m_iType == ZIP_GZIP)
+    {
+        if (!ctx->defInit)
+        {
+            memset(&ctx->def, 0, sizeof(ctx->def));
+
+            if (deflateInit2(&ctx->def, ZIP_GZIP_LEVEL, Z_DEFLATED, -MAX_WBITS, 8,
+                             Z_DEFAULT_STRATEGY) != Z_OK)
+                return false;
+
+            ctx->defInit = true;
+        }
+
+        for (size_t x = 0; x < job->in.size(); x += BGZF_BLOCK_SZ)
+        {
+            size_t len = min(job->in.size() - x, (size_t)BGZF_BLOCK_SZ);
+            size_t at = job->out.size();
+            unsigned char* blk;
+            size_t size;
+
+            deflateReset(&ctx->def);
+            job->out.resize(at + 26 + deflateBound(&ctx->def, len));
+            blk = (unsigned char*)&job->out[at];
+
+            ctx->def.next_in = (Bytef*)&job->in[x];
+            ctx->def.avail_in = len;
+            ctx->def.next_out = blk + 18;
+            ctx->def.avail_out = job->out.size() - at - 26;
+
+            if (deflate(&ctx->def, Z_FINISH) != Z_STREAM_END)
+                return false;
+
+            size = 18 + ctx->def.total_out + 8;
+
+            if (size > 0x10000)
+                return false; // cannot happen, as deflate stores data it cannot shrink
+
+            memcpy(blk, cBgzfEof, 16); // the header, up to the block size
+            blk[16] = (size - 1) & 0xff;
+            blk[17] = (size - 1) >> 8;
+            Put32(blk + size - 8, crc32(0, (Bytef*)&job->in[x], len));
+            Put32(blk + size - 4, len);
+
+            job->out.resize(at + size);
+        }
+
+        job->in = vector<char>();
+
+        return true;
+    }
+
+#ifdef USE_ZSTD
+    size_t size;
+
+    if (!ctx->cctx && !(ctx->cctx = ZSTD_createCCtx()))
+        return false;
+
+    job->out.resize(ZSTD_compressBound(job->in.size()));
+    size = ZSTD_compressCCtx(ctx->cctx, job->out.data(), job->out.size(),
+                             job->in.data(), job->in.size(), ZIP_ZSTD_LEVEL);
+
+    if (ZSTD_isError(size))
+        return false;
+
+    job->out.resize(size);
+    job->in = vector<char>();
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Reads from the compressed file until len bytes or its end.
+ *
+ * @return Bytes read, or -1 if error.
+ */
+ssize_t ZipStream::ReadSrc(void* buf, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len)
+    {
+        ssize_t n = read(m_iFd, (char*)buf + got, len - got);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+
+        got += n;
+    }
+
+    return got;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file compress.h
+ * @author Daniel Rencricca
+ * @brief  Header file for compress.cpp, the streams that read and write
+ * gzip and zstd files.
+ * @version 1.1
+ * @date 2015-12-22
+ *
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define ZIP_NONE        0         // not compressed
+#define ZIP_GZIP        1         // gzip, or bgzf (gzip in blocks)
+#define ZIP_ZSTD        2         // zstd, in one or more frames (needs USE_ZSTD)
+
+#define ZIP_JOB_SZ      0x100000  // uncompressed bytes in each piece of work
+#define ZIP_FRAME_MAX   0x1000000 // largest zstd frame decompressed in parallel
+#define ZIP_MAX_THREADS 8         // most threads to (de)compress a file with
+#define ZIP_GZIP_LEVEL  6         // compression level of gzip output
+#define ZIP_ZSTD_LEVEL  3         // compression level of zstd output
+#define BGZF_BLOCK_SZ   0xff00    // most input bytes in one bgzf block
+
+int       ZipType(const char* name);
+bool      ZipSupported(int type);
+
+/**
+ * A stdio stream on a compressed file, made with fopencookie, so the file
+ * can be read and written like any other. A thread reads the compressed
+ * file and splits it into pieces of work that worker threads decompress at
+ * the same time: runs of bgzf blocks, or whole zstd frames. Other gzip
+ * files can only be decompressed in order, which the reading thread does
+ * itself while the caller parses what it has already decompressed. Output
+ * is cut into pieces that the workers compress at the same time, as bgzf
+ * blocks or zstd frames, so it can be read back in parallel too.
+ *
+ * Reading can seek: back to an earlier position by starting over, or on
+ * by decompressing up to it.
+ */
+class ZipStream
+{
+public:
+    ZipStream();
+    ~ZipStream();
+
+    ZipStream(const ZipStream&) = delete;
+    ZipStream& operator=(const ZipStream&) = delete;
+
+    FILE*     OpenRead(const char* name, int type);
+    FILE*     OpenWrite(const char* name, int type);
+    uint64_t  SrcPos(void) const;
+
+protected:
+    enum { JOB_WAIT, JOB_BUSY, JOB_DONE, JOB_FAIL };
+
+    struct JobType // a piece of the file, (de)compressed by one worker
+    {
+        std::vector<char> in;     // data to (de)compress
+        std::vector<char> out;    // the data once (de)compressed
+        uint64_t     srcLen = 0;  // compressed bytes behind out (reading)
+        uint64_t     outLen = 0;  // bytes out will hold, if known
+        int          state = JOB_WAIT;
+    };
+
+    struct CtxType; // (de)compression state of a worker thread
+
+    static ssize_t Read(void* cookie, char* buf, size_t size);
+    static ssize_t Write(void* cookie, const char* buf, size_t size);
+    static int     Seek(void* cookie, off64_t* offset, int whence);
+    static int     Close(void* cookie);
+
+    bool      Start(void);
+    void      Stop(void);
+    bool      Submit(JobType* job);
+    bool      NextJob(void);
+    bool      Drain(size_t keep);
+    void      Produce(void);
+    bool      ProduceBgzf(void);
+    bool      ProduceGzip(void);
+    bool      ProduceZstd(void);
+    bool      StreamZstd(std::vector<char>* buf);
+    void      Work(void);
+    bool      Decode(CtxType* ctx, JobType* job);
+    bool      Encode(CtxType* ctx, JobType* job);
+    ssize_t   ReadSrc(void* buf, size_t len);
+
+    int       m_iFd;          // the compressed file, or -1 if not open
+    int       m_iType;        // ZIP_GZIP or ZIP_ZSTD
+    bool      m_bWrite;       // opened by OpenWrite
+    bool      m_bBgzf;        // the gzip input is in bgzf blocks
+    uint64_t  m_iPos;         // uncompressed bytes read or written
+    uint64_t  m_iSrcDone;     // compressed bytes behind the jobs read
+    JobType   m_Cur;          // job being read from, or filled for writing
+    size_t    m_iCurPos;      // bytes of m_Cur.out read
+    std::list<JobType> m_aJobs; // jobs in file order, until read or written
+    size_t    m_iMaxJobs;     // most jobs in m_aJobs at once
+    bool      m_bEnd;         // the reading thread has split the whole file
+    bool      m_bFailed;      // the file could not be read or written
+    bool      m_bStop;        // the threads should stop
+    std::mutex m_Lock;        // guards m_aJobs and the flags above
+    std::condition_variable m_Cond; // signals a change to m_aJobs
+    std::thread m_Producer;   // splits the input into jobs
+    std::vector<std::thread> m_aWorkers; // (de)compress the jobs
+};
+
+#endif // _COMPRESS_H_
@@ -25,6 +25,8 @@
 
 #define	CHR_TAB			 L'\t'	    // tab character (0x0009)
 #define	CHR_COM			 L','	    // comma (0x002C)
+#define	CHR_QUO			 L'"'	    // double quote (0x0022)
+#define	CHR_CR			 L'\r'	    // carriage return (0x000D)
 #define	CHR_LF			 L'\n'	    // newline character (0x000A)
 
 #define	BUFFER_SZ		0xffff	// should be plenty big enough
@@ -0,0 +1,257 @@
+/**
+ * @file logger.cpp
+ * @author Daniel Rencricca
+ * @brief The log shared by all sorts in a program. Messages are queued in a
+ * ring buffer without taking a lock or making a system call, and written to
+ * the log file by a background thread through one open handle.
+ *
+ * @version 1.1
+ * @date 2015-12-22
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include <chrono>
+
+#include "logger.h"
+
+/**
+ * @brief Returns the program's log, starting it on first use.
+ */
+Logger& Logger::Get(void)
+{
+    static Logger log(LOGFILE);
+
+    return log;
+}
+
+/**
+ * @brief Construct a new Logger object and start its writer thread. The log
+ * file is not opened until there is something to write.
+ *
+ * @param path Log file name.
+ */
+Logger::Logger(const string& path) : m_sPath(path)
+{
+    m_fpLog = NULL;
+    m_iLogSz = 0;
+    m_iHead = 0;
+    m_iTail = 0;
+    m_iDropped = 0;
+    m_iFlushReq = 0;
+    m_iFlushed = 0;
+    m_bStop = false;
+
+    // Slot x is ready to be written at ring position x.
+    for (uint64_t x = 0; x < LOG_RING_SZ; x++)
+        m_aRing[x].seq.store(x, memory_order_relaxed);
+
+    m_Thread = thread(&Logger::WriterLoop, this);
+}
+
+/**
+ * @brief Destroy the Logger object, after writing any messages still in the
+ * ring.
+ */
+Logger::~Logger()
+{
+    {
+        lock_guard<mutex> lock(m_Mutex);
+        m_bStop = true;
+    }
+    m_Cond.notify_one();
+    m_Thread.join();
+
+    if (m_fpLog)
+        fclose(m_fpLog);
+}
+
+/**
+ * @brief Queues a message for the log file. It never waits: if the ring is
+ * full the message is dropped, and the writer thread notes how many were.
+ *
+ * @param level LOG_ERROR, LOG_INFO or LOG_DEBUG.
+ * @param fmt   printf format of the message, which may end with a newline.
+ *
+ * @return true if the message was queued, else false if it was dropped.
+ */
+bool Logger::Write(int level, const char* fmt, ...)
+{
+    uint64_t pos = m_iHead.load(memory_order_relaxed);
+    LogSlotType* slot;
+    va_list args;
+
+    // Claim the slot at the head of the ring (a bounded multi-producer queue:
+    // a slot is free when its seq is the position being claimed).
+    for (;;)
+    {
+        slot = &m_aRing[pos & (LOG_RING_SZ - 1)];
+        int64_t diff = (int64_t)(slot->seq.load(memory_order_acquire) - pos);
+
+        if (diff == 0)
+        {
+            if (m_iHead.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) // the writer has not yet emptied this slot
+        {
+            m_iDropped.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        else
+            pos = m_iHead.load(memory_order_relaxed);
+    }
+
+    slot->when = time(NULL);
+    slot->level = level;
+
+    va_start(args, fmt);
+    vsnprintf(slot->text, LOG_MSG_SZ, fmt, args);
+    va_end(args);
+
+    slot->seq.store(pos + 1, memory_order_release); // ready to be read
+
+    // Wake the writer early each time another half of the ring fills up.
+    if ((pos & (LOG_RING_SZ / 2 - 1)) == LOG_RING_SZ / 2 - 1)
+        m_Cond.notify_one();
+
+    return true;
+}
+
+/**
+ * @brief Waits until every message queued so far is in the log file. Used
+ * for errors, which may be followed by the program stopping.
+ *
+ * @return Void.
+ */
+void Logger::Flush(void)
+{
+    uint64_t target = m_iHead.load(memory_order_relaxed);
+    unique_lock<mutex> lock(m_Mutex);
+
+    m_iFlushReq = max(m_iFlushReq, target);
+    m_Cond.notify_one();
+    m_FlushCond.wait(lock, [&] { return m_iFlushed >= target || m_bStop; });
+}
+
+/**
+ * @brief Runs on the writer thread: every LOG_FLUSH_MS milliseconds, or
+ * sooner if Flush asks or the ring is half full, writes the ring to the log
+ * file.
+ *
+ * @return Void.
+ */
+void Logger::WriterLoop(void)
+{
+    unique_lock<mutex> lock(m_Mutex);
+
+    while (!m_bStop)
+    {
+        m_Cond.wait_for(lock, chrono::milliseconds(LOG_FLUSH_MS), [&] {
+            return m_bStop || m_iFlushReq > m_iFlushed ||
+                   m_iHead.load(memory_order_relaxed) - m_iTail >= LOG_RING_SZ / 2;
+        });
+
+        lock.unlock();
+        Drain();
+        lock.lock();
+
+        m_iFlushed = m_iTail;
+        m_FlushCond.notify_all();
+    }
+
+    lock.unlock();
+    Drain(); // messages queued while stopping
+}
+
+/**
+ * @brief Writes each message that is ready, oldest first, then flushes the
+ * log file. Only the writer thread calls this.
+ *
+ * @return true if anything was written, else false.
+ */
+bool Logger::Drain(void)
+{
+    static const char* levelName[] = {"ERROR", "INFO", "DEBUG"};
+    char line[LOG_MSG_SZ + 64];
+    uint64_t dropped;
+    bool wrote = false;
+
+    for (;;)
+    {
+        LogSlotType& slot = m_aRing[m_iTail & (LOG_RING_SZ - 1)];
+        struct tm tmv;
+        size_t len;
+
+        if (slot.seq.load(memory_order_acquire) != m_iTail + 1)
+            break; // empty, or still being written
+
+        localtime_r(&slot.when, &tmv);
+        len = strftime(line, sizeof(line), "%Y-%m-%d %H:%M:%S ", &tmv);
+        len += snprintf(line + len, sizeof(line) - len, "%-5s %s",
+                        levelName[min(max(slot.level, 0), LOG_DEBUG)],
+                        slot.text);
+        len = min(len, sizeof(line) - 2);
+
+        // Error messages end with a newline of their own.
+        while (len > 0 && line[len - 1] == '\n')
+            len--;
+        line[len++] = '\n';
+
+        // Give the slot back to the writers for its next turn around the ring.
+        slot.seq.store(m_iTail + LOG_RING_SZ, memory_order_release);
+        m_iTail++;
+
+        wrote = WriteLine(line, len) || wrote;
+    }
+
+    if ((dropped = m_iDropped.exchange(0, memory_order_relaxed)) > 0)
+    {
+        size_t len = snprintf(line, sizeof(line),
+                              "%llu log messages dropped (log ring full)\n",
+                              (unsigned long long)dropped);
+        wrote = WriteLine(line, len) || wrote;
+    }
+
+    if (wrote)
+        fflush(m_fpLog);
+
+    return wrote;
+}
+
+/**
+ * @brief Appends a line to the log file, opening it if need be. If the line
+ * would take the file past MAX_LOGFILE_SZ, the file is first renamed with
+ * an ".old" suffix, replacing any earlier one, and a new file started.
+ *
+ * @param line Text to write, ending with a newline.
+ * @param len  Length of the line.
+ *
+ * @return true if the line was written, else false.
+ */
+bool Logger::WriteLine(const char* line, size_t len)
+{
+    if (m_fpLog && m_iLogSz > 0 && m_iLogSz + (long)len > MAX_LOGFILE_SZ)
+    {
+        fclose(m_fpLog);
+        m_fpLog = NULL;
+        rename(m_sPath.c_str(), (m_sPath + ".old").c_str());
+    }
+
+    if (!m_fpLog)
+    {
+        if (!(m_fpLog = fopen(m_sPath.c_str(), "a")))
+            return false;
+
+        fseek(m_fpLog, 0, SEEK_END);
+        m_iLogSz = ftell(m_fpLog);
+    }
+
+    if (fwrite(line, 1, len, m_fpLog) != len)
+        return false;
+
+    m_iLogSz += len;
+    return true;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file logger.h
+ * @author Daniel Rencricca
+ * @brief  Header file for logger.cpp, the log shared by all sorts in a
+ * program.
+ * @version 1.1
+ * @date 2015-12-22
+ *
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include "defines.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+using namespace std;
+
+#define LOG_RING_SZ   256   // messages the ring holds (a power of 2)
+#define LOG_MSG_SZ    512   // longest message, including the terminating null
+#define LOG_FLUSH_MS  200   // milliseconds between writes to the log file
+
+// Log levels. Messages above LOG_LEVEL are compiled out.
+#define LOG_ERROR       0
+#define LOG_INFO        1
+#define LOG_DEBUG       2
+
+#ifndef LOG_LEVEL
+#ifdef _DEBUG
+#define LOG_LEVEL       LOG_DEBUG
+#else
+#define LOG_LEVEL       LOG_ERROR
+#endif
+#endif
+
+#define LOGMSG(level, fmt, ...) \
+    do { if ((level) <= LOG_LEVEL) Logger::Get().Write((level), fmt, __VA_ARGS__); } while (0)
+
+/**
+ * Writes messages to LOGFILE without blocking the caller. Write formats a
+ * message into a slot of a lock-free ring buffer, and a background thread
+ * appends the ring to the log file every LOG_FLUSH_MS milliseconds through
+ * a single open handle. If the file would grow past MAX_LOGFILE_SZ it is
+ * renamed with an ".old" suffix and a new one started. If the ring is full the
+ * message is dropped and counted rather than waited for.
+ */
+class Logger
+{
+public:
+    static Logger& Get(void);
+
+    ~Logger();
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    bool      Write(int level, const char* fmt, ...)
+                  __attribute__((format(printf, 3, 4)));
+    void      Flush(void);
+
+protected:
+    struct LogSlotType // one message in the ring
+    {
+        atomic<uint64_t> seq;           // ring position the slot is ready for
+        time_t           when;          // time the message was written
+        int              level;         // LOG_ERROR, LOG_INFO or LOG_DEBUG
+        char             text[LOG_MSG_SZ]; // the message
+    };
+
+    Logger(const string& path);
+
+    bool      Drain(void);
+    void      WriterLoop(void);
+    bool      WriteLine(const char* line, size_t len);
+
+    string               m_sPath;      // log file name
+    FILE*                m_fpLog;      // log file, opened on the first message
+    long                 m_iLogSz;     // bytes in the log file
+    LogSlotType          m_aRing[LOG_RING_SZ]; // messages not yet written
+    atomic<uint64_t>     m_iHead;      // next ring position to write to
+    uint64_t             m_iTail;      // next ring position to read (writer only)
+    atomic<uint64_t>     m_iDropped;   // messages dropped as the ring was full
+    uint64_t             m_iFlushReq;  // ring position Flush is waiting for
+    uint64_t             m_iFlushed;   // ring position written and flushed
+    thread               m_Thread;     // writes the ring to the log file
+    mutex                m_Mutex;      // guards m_bStop, m_iFlushReq, m_iFlushed
+    condition_variable   m_Cond;       // wakes the writer thread
+    condition_variable   m_FlushCond;  // wakes callers of Flush
+    bool                 m_bStop;      // tells the writer thread to finish
+};
+
+#endif // _LOGGER_H_
@@ -9,12 +9,16 @@
  * 
  */
 
-#include "sortroutines.cpp"
+#include "sortroutines.h"
 #include <string>
+#include <cstring>
+#include <clocale>
 #include <unistd.h> // for getcwd function
+#include <glob.h>
 
 /**
  * Example to run on mac: ./sorter -i ./data/us-500.csv -o ./data/us-500.out -c1 1 -c2 2
+ * (bench/gendata makes test files, eg ./gendata -n 500 -o ./data/us-500.csv)
  * 
  * Note that it must have the path "./" in front of the name when run in 
  * the terminal, or else it will complain command not found.
@@ -26,24 +30,178 @@ int main(int argc, const char * argv[]) {
     if (argc < 1) { // Check the value of argc. If not enough parameters have been passed, inform user and exit.
         
         // inform the user of how to use the program
-        std::cout << "Usage is -i <infile> -o <outfile> -c1 <sort column 1> -c2 <sort column 2> -c3 <sort column 3>\n";
+        std::cout << "Usage is -i <infile> ... -o <outfile> -c1 <sort column 1> -c2 <sort column 2> -c3 <sort column 3> [-d <delimiter>] [-q <quote>] [-e <escape>] [--collate case|locale] [--limit <max records>] [--temp-dir <dir>] [--mem <MB>] [--stats <json file>|-] [--progress=bar|json|none] [--shards <N> | --shard-keys <key> ...] [--index <N>] [--stable] [--keys-only] [--no-cache] [--max-temp <MB>] [--compress gzip|zstd] [--resume] [--check] [--merge <sorted file> ...] [--base <sorted file>] [--lookup <from key> [<to key>]]\n";
         std::cin.get();
         exit(0);
     }
     else // we got enough parameters...
     {
-        string  inFile, filePath, outFile;
+        string  filePath, outFile;
+        vector<string> inFiles;         // files to sort as one input
         int     col1=0, col2=0, col3=0; // columns in file to sort in correct order
+        int     limit=0;                // max records to output (0 = all)
+        wchar_t delim=0, quote=CHR_QUO, escape=CHR_QUO; // csv format
+        int     collate=COLLATE_BINARY; // how keys are ordered
+        string  tempDir=WORK_DIR;       // where temporary files are kept
+        long    memMB=SORT_MEM_SZ >> 20; // memory budget of the sort
+        long    maxTempMB=0;            // temp space limit (0 = none)
+        int     compress=ZIP_NONE;      // how to compress the output
+        string  statsFile;              // where to write --stats ("-" = stdout)
+        bool    check=false;            // only check that inFile is sorted
+        bool    stable=false;           // keep input order of equal keys
+        bool    resume=false;           // checkpoint and resume the sort
+        bool    keysOnly=false;         // sort keys and offsets, then gather
+        bool    noCache=false;          // keep sort files out of the page cache
+        vector<string> mergeFiles;      // sorted files to merge into outFile
+        string  baseFile;               // sorted file to merge inFile into
+        int     shards=0;               // output shards (0 = one file)
+        vector<string> shardKeys;       // boundary keys of the shards
+        int     index=0;                // records per key index entry (0 = none)
+        vector<string> lookupKeys;      // key range to find in sorted inFile
+        int     progress=PROGRESS_AUTO; // how progress is shown
+
+        // Read a single character option, allowing "tab" or "\t" for a tab.
+        auto optChar = [](const char *arg) -> wchar_t {
+            if (strcmp(arg, "tab") == 0 || strcmp(arg, "\\t") == 0)
+                return CHR_TAB;
+            return (unsigned char)arg[0];
+        };
+
+        // Add the input files named by an -i argument, which may be a
+        // pattern such as "part-*.csv.gz". A pattern that matches nothing is
+        // kept as it is, so it is reported as a file that cannot be opened.
+        auto addInputs = [&inFiles](const char *arg) {
+            glob_t found;
+
+            if (strpbrk(arg, "*?[") && glob(arg, 0, NULL, &found) == 0)
+            {
+                inFiles.insert(inFiles.end(), found.gl_pathv,
+                               found.gl_pathv + found.gl_pathc);
+                globfree(&found);
+            }
+            else
+                inFiles.push_back(arg);
+        };
 
         for (int i = 1; i < argc; i++) // Iterate over argv[] to get the parameters.
         {                              // Start at 1 because we don't need to know the
                                        // path of the program, stored in argv[0]
-            if (i + 1 != argc) // check that we haven't finished parsing already
+            if (strcmp(argv[i], "--check") == 0) // options without a value
+            {
+                check = true;
+            }
+            else if (strcmp(argv[i], "--stable") == 0)
+            {
+                stable = true;
+            }
+            else if (strcmp(argv[i], "--resume") == 0)
+            {
+                resume = true;
+            }
+            else if (strcmp(argv[i], "--keys-only") == 0)
+            {
+                keysOnly = true;
+            }
+            else if (strcmp(argv[i], "--no-cache") == 0)
+            {
+                noCache = true;
+            }
+            else if (strncmp(argv[i], "--progress=", 11) == 0)
+            {
+                if (strcmp(argv[i] + 11, "bar") == 0)
+                    progress = PROGRESS_BAR;
+                else if (strcmp(argv[i] + 11, "json") == 0)
+                    progress = PROGRESS_JSON;
+                else if (strcmp(argv[i] + 11, "none") == 0)
+                    progress = PROGRESS_NONE;
+                else
+                    progress = -1;
+            }
+            else if (strcmp(argv[i], "--merge") == 0) // list of files
             {
-                if (strncmp(argv[i], "-i", 2) == 0) // then next argument is the input filename
+                while (i + 1 < argc && argv[i + 1][0] != '-')
+                    mergeFiles.push_back(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--shard-keys") == 0) // list of keys
+            {
+                while (i + 1 < argc && argv[i + 1][0] != '-')
+                    shardKeys.push_back(argv[++i]);
+            }
+            else if (strcmp(argv[i], "--lookup") == 0) // one or two keys
+            {
+                while (i + 1 < argc && argv[i + 1][0] != '-' && lookupKeys.size() < 2)
+                    lookupKeys.push_back(argv[++i]);
+                if (lookupKeys.empty())
+                    index = -1;
+            }
+            else if (i + 1 != argc) // check that we haven't finished parsing already
+            {
+                if (strcmp(argv[i], "--limit") == 0)
+                {
+                    i++;
+                    limit = stoi(argv[i]);
+                }
+                else if (strcmp(argv[i], "--shards") == 0)
+                {
+                    i++;
+                    shards = stoi(argv[i]);
+                }
+                else if (strcmp(argv[i], "--base") == 0)
+                {
+                    i++;
+                    baseFile = argv[i];
+                }
+                else if (strcmp(argv[i], "--index") == 0)
+                {
+                    i++;
+                    index = stoi(argv[i]);
+                }
+                else if (strcmp(argv[i], "--stats") == 0)
+                {
+                    i++;
+                    statsFile = argv[i];
+                }
+                else if (strcmp(argv[i], "--mem") == 0)
+                {
+                    i++;
+                    memMB = stol(argv[i]);
+                }
+                else if (strcmp(argv[i], "--max-temp") == 0)
+                {
+                    i++;
+                    maxTempMB = stol(argv[i]);
+                }
+                else if (strcmp(argv[i], "--compress") == 0)
                 {
                     i++;
-                    inFile = argv[i];
+                    if (strcmp(argv[i], "gzip") == 0)
+                        compress = ZIP_GZIP;
+                    else if (strcmp(argv[i], "zstd") == 0)
+                        compress = ZIP_ZSTD;
+                    else
+                        compress = -1;
+                }
+                else if (strcmp(argv[i], "--temp-dir") == 0)
+                {
+                    i++;
+                    tempDir = argv[i];
+                }
+                else if (strcmp(argv[i], "--collate") == 0)
+                {
+                    i++;
+                    if (strcmp(argv[i], "case") == 0)
+                        collate = COLLATE_CASE;
+                    else if (strcmp(argv[i], "locale") == 0)
+                        collate = COLLATE_LOCALE;
+                    else
+                        collate = -1;
+                }
+                else if (strncmp(argv[i], "-i", 2) == 0) // then the next arguments are input files
+                {
+                    i++;
+                    addInputs(argv[i]);
+                    while (i + 1 < argc && argv[i + 1][0] != '-')
+                        addInputs(argv[++i]);
                 }
                 else if (strncmp(argv[i], "-p", 2) == 0)
                 {
@@ -70,6 +228,21 @@ int main(int argc, const char * argv[]) {
                     i++;
                     col3 = stoi(argv[i]);
                 }
+                else if (strncmp(argv[i], "-d", 2) == 0)
+                {
+                    i++;
+                    delim = optChar(argv[i]);
+                }
+                else if (strncmp(argv[i], "-q", 2) == 0)
+                {
+                    i++;
+                    quote = optChar(argv[i]);
+                }
+                else if (strncmp(argv[i], "-e", 2) == 0)
+                {
+                    i++;
+                    escape = optChar(argv[i]);
+                }
                 else
                 {
                     std::cout << "Not enough or invalid arguments, please try again.\n";
@@ -77,24 +250,64 @@ int main(int argc, const char * argv[]) {
                 }
             }
             
-            #ifdef _DEBUG
-            std::cout << argv[i] << "  ";
+            #ifdef _DEBUG // on stderr, as a lookup may write records to stdout
+            std::cerr << argv[i] << "  ";
             #endif
             
         } // for loop
         
-        if ((col1 ==0 and col2 == 0 and col3 == 0) or (col1 <0 or col2 < 0 or col3<0))
+        if ((col1 ==0 and col2 == 0 and col3 == 0) or (col1 <0 or col2 < 0 or col3<0) or limit < 0 or collate < 0 or memMB <= 0 or maxTempMB < 0 or !ZipSupported(compress) or progress < 0 or shards < 0 or index < 0 or (compress != ZIP_NONE and (index > 0 or !mergeFiles.empty() or !baseFile.empty())) or (!baseFile.empty() and (shards > 1 or !shardKeys.empty() or index > 0)) or (!mergeFiles.empty() and (shards > 0 or !shardKeys.empty() or index > 0)) or (inFiles.size() > 1 and (check or !lookupKeys.empty() or !mergeFiles.empty())))
         {
             std::cout << "Invalid arguments, please try again.\n";
             exit(0);
         }
         
-        cout << "Running program...\n";
-        char * dir = getcwd(NULL, 0); // Platform-dependent, see reference link below
-        printf("Current dir: %s\n", dir);
+        // Read and order text using the user's locale (eg LANG=en_US.UTF-8).
+        if (collate != COLLATE_BINARY)
+            setlocale(LC_ALL, "");
+
+        // A lookup writes its records to stdout unless given -o.
+        if (lookupKeys.empty())
+        {
+            cout << "Running program...\n";
+            char * dir = getcwd(NULL, 0); // Platform-dependent, see reference link below
+            printf("Current dir: %s\n", dir);
+        }
         
-        SortRoutines sorter(inFile, outFile, col1, col2, col3);
-        sorter.SortFile();
+        SortRoutines sorter(inFiles.empty() ? "" : inFiles[0], outFile, col1, col2, col3);
+        sorter.SetInputs(inFiles);
+        sorter.SetLimit(limit);
+        sorter.SetStable(stable);
+        sorter.SetKeysOnly(keysOnly);
+        sorter.SetNoCache(noCache);
+        sorter.SetShards(shards);
+        sorter.SetShardKeys(shardKeys);
+        sorter.SetIndex(index);
+        sorter.SetBaseFile(baseFile);
+        sorter.SetCsvFormat(delim, quote, escape);
+        sorter.SetCollation(collate);
+        sorter.SetResume(resume);
+        sorter.SetTempDir(tempDir);
+        sorter.SetMemory((size_t)memMB << 20);
+        sorter.SetMaxTemp((uint64_t)maxTempMB << 20);
+        sorter.SetCompress(compress);
+        sorter.SetProgress(progress);
+
+        bool ok;
+
+        if (check)
+            ok = sorter.CheckFile();
+        else if (!lookupKeys.empty())
+            ok = sorter.LookupFile(lookupKeys[0], lookupKeys.size() > 1 ? lookupKeys[1] : "");
+        else if (!mergeFiles.empty())
+            ok = sorter.MergeFiles(mergeFiles);
+        else
+            ok = sorter.SortFile();
+
+        if (!statsFile.empty())
+            sorter.WriteStats(statsFile);
+
+        return ok ? 0 : 1;
     }
     return 0;
 }
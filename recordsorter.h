@@ -0,0 +1,350 @@
+/**
+ * @file recordsorter.h
+ * @author Daniel Rencricca
+ * @brief  Header-only sorter for use inside other programs. It sorts records
+ * of any trivially copyable type by a key taken from each record, without
+ * text files at either end: records are added one at a time or from an
+ * iterator range, and come back in order through a callback.
+ *
+ * Records are held in memory until memSz bytes are used. The buffer is then
+ * sorted and written to an unnamed temp file as a run, and the runs are
+ * merged when Sort is called. As in SortRoutines, equal keys keep the order
+ * in which they were added.
+ *
+ * The key function and comparator are template parameters, so comparisons
+ * are inlined rather than made through function pointers. For example:
+ *
+ *     struct Trade { unsigned id; double price; };
+ *     auto byPrice = [](const Trade &t) { return t.price; };
+ *
+ *     RecordSorter<Trade, decltype(byPrice)> sorter(byPrice);
+ *     sorter.Add(trades.begin(), trades.end());
+ *     sorter.Sort([&](const Trade &t) { Send(t); });
+ *
+ * @version 1.1
+ * @date 2015-12-22
+ *
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#ifndef _RECORD_SORTER_H_
+#define _RECORD_SORTER_H_
+
+#include <stdio.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <type_traits>
+#include <vector>
+
+#define REC_MEM_SZ   0x4000000 // default bytes of records kept in memory (64MB)
+#define REC_READ_SZ    0x10000 // bytes read at a time from each run (64KB)
+#define REC_FAN_IN          64 // max runs merged at once
+
+template <class Rec, class KeyFn, class Cmp = std::less<>>
+class RecordSorter
+{
+    static_assert(std::is_trivially_copyable<Rec>::value,
+                  "records are written to the temp files byte for byte");
+
+public:
+    /**
+     * @brief Construct a new Record Sorter object.
+     *
+     * @param keyFn Returns the sort key of a record.
+     * @param cmp   Returns true if the first key sorts before the second.
+     * @param memSz Bytes of records to hold in memory before writing a run.
+     */
+    RecordSorter(KeyFn keyFn = KeyFn(), Cmp cmp = Cmp(),
+                 size_t memSz = REC_MEM_SZ)
+        : m_KeyFn(keyFn), m_Cmp(cmp),
+          m_iMaxRecs(std::max<size_t>(1, memSz / sizeof(Rec)))
+    {
+        m_iCount = 0;
+    }
+
+    ~RecordSorter()
+    {
+        for (RunType &run : m_aRuns)
+            if (run.fp)
+                fclose(run.fp);
+    }
+
+    RecordSorter(const RecordSorter &) = delete;
+    RecordSorter &operator=(const RecordSorter &) = delete;
+
+    /**
+     * @brief Adds a record to be sorted.
+     *
+     * @param rec Record to add.
+     * @return true if successful, else false if a run could not be written.
+     */
+    bool Add(const Rec &rec)
+    {
+        if (m_aBuf.size() >= m_iMaxRecs && !WriteRun())
+            return false;
+
+        if (m_aBuf.empty())
+            m_aBuf.reserve(std::min<size_t>(m_iMaxRecs, REC_READ_SZ));
+
+        m_aBuf.push_back(rec);
+        m_iCount++;
+        return true;
+    }
+
+    /**
+     * @brief Adds each record in the range [first, last).
+     *
+     * @return true if successful, else false if a run could not be written.
+     */
+    template <class Iter>
+    bool Add(Iter first, Iter last)
+    {
+        for (; first != last; ++first)
+            if (!Add(*first))
+                return false;
+
+        return true;
+    }
+
+    /**
+     * @brief Number of records added since the last Sort.
+     */
+    size_t Count(void) const
+    {
+        return m_iCount;
+    }
+
+    /**
+     * @brief Passes every record added so far to out(const Rec&) in sorted
+     * order, then empties the sorter so it can be used again.
+     *
+     * @param out Called once per record, lowest key first.
+     * @return true if successful, else false if a temp file failed.
+     */
+    template <class OutFn>
+    bool Sort(OutFn out)
+    {
+        bool ok = true;
+
+        SortBuffer();
+
+        // The last records need not go to disk: merge them from memory.
+        if (!m_aBuf.empty())
+        {
+            m_aRuns.emplace_back();
+            m_aRuns.back().buf.swap(m_aBuf);
+        }
+
+        // Merge the oldest runs into one until the rest can be merged at
+        // once.
+        while (ok && m_aRuns.size() > REC_FAN_IN)
+            ok = MergeRuns(0, REC_FAN_IN);
+
+        if (ok)
+            ok = Merge(0, m_aRuns.size(), [&](const Rec &rec) {
+                out(rec);
+                return true;
+            });
+
+        Clear();
+        return ok;
+    }
+
+    /**
+     * @brief Discards all records added so far.
+     */
+    void Clear(void)
+    {
+        for (RunType &run : m_aRuns)
+            if (run.fp)
+                fclose(run.fp);
+
+        m_aRuns.clear();
+        m_aBuf.clear();
+        m_iCount = 0;
+    }
+
+protected:
+
+    struct RunType
+    {
+        FILE             *fp = NULL; // temp file, or NULL if held in memory
+        std::vector<Rec> buf;        // records read from the run
+        size_t           pos = 0;    // next record in buf
+        int              level = 0;  // merges the run has been through
+    };
+
+    /**
+     * @brief Returns true if rec1 sorts before rec2.
+     */
+    bool Less(const Rec &rec1, const Rec &rec2)
+    {
+        return m_Cmp(m_KeyFn(rec1), m_KeyFn(rec2));
+    }
+
+    /**
+     * @brief Sorts the buffer, keeping records with equal keys in order.
+     */
+    void SortBuffer(void)
+    {
+        std::stable_sort(m_aBuf.begin(), m_aBuf.end(),
+                         [this](const Rec &rec1, const Rec &rec2) {
+                             return Less(rec1, rec2);
+                         });
+    }
+
+    /**
+     * @brief Sorts the buffer and writes it to a new temp file as a run.
+     *
+     * @return true if successful, else false if error.
+     */
+    bool WriteRun(void)
+    {
+        RunType run;
+
+        SortBuffer();
+
+        if (!(run.fp = tmpfile()))
+            return false;
+
+        m_aRuns.push_back(std::move(run));
+
+        if (fwrite(m_aBuf.data(), sizeof(Rec), m_aBuf.size(),
+                   m_aRuns.back().fp) != m_aBuf.size() ||
+            fflush(m_aRuns.back().fp) || !RewindRun(&m_aRuns.back()))
+            return false;
+
+        m_aBuf.clear();
+
+        // When the newest REC_FAN_IN runs have been through as many merges,
+        // merge them into one, so few temp files are open at a time and each
+        // record is merged about once per REC_FAN_IN-fold growth.
+        for (size_t n = m_aRuns.size(); n >= REC_FAN_IN &&
+             m_aRuns[n - REC_FAN_IN].level == m_aRuns[n - 1].level;
+             n = m_aRuns.size())
+        {
+            if (!MergeRuns(n - REC_FAN_IN, n))
+                return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Merges runs [first, last) into a single run in their place.
+     * Merging neighbours keeps equal keys in the order added.
+     *
+     * @return true if successful, else false if error.
+     */
+    bool MergeRuns(size_t first, size_t last)
+    {
+        RunType run;
+        bool ok;
+
+        if (!(run.fp = tmpfile()))
+            return false;
+
+        run.level = m_aRuns[first].level + 1;
+        ok = Merge(first, last, [&](const Rec &rec) {
+            return fwrite(&rec, sizeof(Rec), 1, run.fp) == 1;
+        });
+        ok = ok && !fflush(run.fp) && RewindRun(&run);
+
+        for (size_t x = first; x < last; x++)
+            if (m_aRuns[x].fp)
+                fclose(m_aRuns[x].fp);
+
+        m_aRuns.erase(m_aRuns.begin() + first, m_aRuns.begin() + last);
+        m_aRuns.insert(m_aRuns.begin() + first, std::move(run));
+        return ok;
+    }
+
+    /**
+     * @brief Goes back to the start of a run's temp file, ready to merge.
+     */
+    bool RewindRun(RunType *run)
+    {
+        run->buf.clear();
+        run->pos = 0;
+        return !fseek(run->fp, 0, SEEK_SET) && FillRun(run);
+    }
+
+    /**
+     * @brief Reads the next block of records from a run's temp file. A run
+     * held in memory has nothing more to read.
+     *
+     * @return false if the read failed.
+     */
+    bool FillRun(RunType *run)
+    {
+        size_t n;
+
+        if (!run->fp)
+            return true;
+
+        run->buf.resize(std::max<size_t>(1, REC_READ_SZ / sizeof(Rec)));
+        n = fread(run->buf.data(), sizeof(Rec), run->buf.size(), run->fp);
+        run->buf.resize(n);
+        run->pos = 0;
+
+        return n > 0 || !ferror(run->fp);
+    }
+
+    /**
+     * @brief Merges runs [first, last) and passes each record to
+     * put(const Rec&), which returns false to stop with an error.
+     *
+     * @return true if successful, else false if error.
+     */
+    template <class PutFn>
+    bool Merge(size_t first, size_t last, PutFn put)
+    {
+        // The heap holds the index of each run that has records left. On equal
+        // keys the lower index, which was added first, comes out first.
+        auto after = [this](size_t x, size_t y) {
+            const Rec &rec1 = m_aRuns[x].buf[m_aRuns[x].pos];
+            const Rec &rec2 = m_aRuns[y].buf[m_aRuns[y].pos];
+            return Less(rec2, rec1) || (!Less(rec1, rec2) && y < x);
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(after)>
+            heap(after);
+
+        for (size_t x = first; x < last; x++)
+            if (!m_aRuns[x].buf.empty())
+                heap.push(x);
+
+        while (!heap.empty())
+        {
+            size_t x = heap.top();
+            RunType &run = m_aRuns[x];
+
+            heap.pop();
+
+            if (!put(run.buf[run.pos]))
+                return false;
+
+            if (++run.pos == run.buf.size())
+            {
+                run.buf.clear();
+                if (!FillRun(&run))
+                    return false;
+            }
+
+            if (run.pos < run.buf.size())
+                heap.push(x);
+        }
+
+        return true;
+    }
+
+    KeyFn                m_KeyFn;    // returns the sort key of a record
+    Cmp                  m_Cmp;      // orders two sort keys
+    size_t               m_iMaxRecs; // records held in memory before a run
+    size_t               m_iCount;   // records added since the last Sort
+    std::vector<Rec>     m_aBuf;     // records not yet written to a run
+    std::vector<RunType> m_aRuns;    // sorted runs, oldest first
+};
+
+#endif // _RECORD_SORTER_H_
@@ -0,0 +1,294 @@
+/**
+ * @file simd.cpp
+ * @author Daniel Rencricca
+ * @brief The scanning kernels used to find fields and records, with a version
+ * for each x86-64 vector instruction set and a scalar fallback. The version
+ * is picked at run time from the instruction sets the cpu supports.
+ *
+ * @version 1.1
+ * @date 2015-12-22
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#include <stdint.h>
+
+#include "simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(NO_SIMD)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// SCALAR KERNELS                                                              //
+////////////////////////////////////////////////////////////////////////////////
+
+static const wchar_t* FindAnyWScalar(const wchar_t* pos, const wchar_t* end,
+                                     wchar_t c1, wchar_t c2, wchar_t c3)
+{
+    for (; pos < end; pos++)
+        if (*pos == c1 || *pos == c2 || *pos == c3)
+            break;
+
+    return pos;
+}
+
+static const char* FindAnyScalar(const char* pos, const char* end, char c1,
+                                 char c2, char c3)
+{
+    for (; pos < end; pos++)
+        if (*pos == c1 || *pos == c2 || *pos == c3)
+            break;
+
+    return pos;
+}
+
+#ifdef SIMD_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE4.2 KERNELS (16 bytes at a time)                                         //
+////////////////////////////////////////////////////////////////////////////////
+
+__attribute__((target("sse4.2")))
+static const wchar_t* FindAnyWSse(const wchar_t* pos, const wchar_t* end,
+                                  wchar_t c1, wchar_t c2, wchar_t c3)
+{
+    const __m128i v1 = _mm_set1_epi32(c1);
+    const __m128i v2 = _mm_set1_epi32(c2);
+    const __m128i v3 = _mm_set1_epi32(c3);
+
+    for (; end - pos >= 4; pos += 4)
+    {
+        __m128i data = _mm_loadu_si128((const __m128i*)pos);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(data, v1),
+                                                _mm_cmpeq_epi32(data, v2)),
+                                   _mm_cmpeq_epi32(data, v3));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(hit));
+
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+
+    return FindAnyWScalar(pos, end, c1, c2, c3);
+}
+
+__attribute__((target("sse4.2")))
+static const char* FindAnySse(const char* pos, const char* end, char c1,
+                              char c2, char c3)
+{
+    const __m128i v1 = _mm_set1_epi8(c1);
+    const __m128i v2 = _mm_set1_epi8(c2);
+    const __m128i v3 = _mm_set1_epi8(c3);
+
+    for (; end - pos >= 16; pos += 16)
+    {
+        __m128i data = _mm_loadu_si128((const __m128i*)pos);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(data, v1),
+                                                _mm_cmpeq_epi8(data, v2)),
+                                   _mm_cmpeq_epi8(data, v3));
+        int mask = _mm_movemask_epi8(hit);
+
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+
+    return FindAnyScalar(pos, end, c1, c2, c3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX2 KERNELS (32 bytes at a time)                                           //
+////////////////////////////////////////////////////////////////////////////////
+
+__attribute__((target("avx2")))
+static const wchar_t* FindAnyWAvx2(const wchar_t* pos, const wchar_t* end,
+                                   wchar_t c1, wchar_t c2, wchar_t c3)
+{
+    const __m256i v1 = _mm256_set1_epi32(c1);
+    const __m256i v2 = _mm256_set1_epi32(c2);
+    const __m256i v3 = _mm256_set1_epi32(c3);
+
+    for (; end - pos >= 8; pos += 8)
+    {
+        __m256i data = _mm256_loadu_si256((const __m256i*)pos);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi32(data, v1),
+                                                      _mm256_cmpeq_epi32(data, v2)),
+                                      _mm256_cmpeq_epi32(data, v3));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+
+    return FindAnyWScalar(pos, end, c1, c2, c3);
+}
+
+__attribute__((target("avx2")))
+static const char* FindAnyAvx2(const char* pos, const char* end, char c1,
+                               char c2, char c3)
+{
+    const __m256i v1 = _mm256_set1_epi8(c1);
+    const __m256i v2 = _mm256_set1_epi8(c2);
+    const __m256i v3 = _mm256_set1_epi8(c3);
+
+    for (; end - pos >= 32; pos += 32)
+    {
+        __m256i data = _mm256_loadu_si256((const __m256i*)pos);
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(data, v1),
+                                                      _mm256_cmpeq_epi8(data, v2)),
+                                      _mm256_cmpeq_epi8(data, v3));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit);
+
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+
+    return FindAnyScalar(pos, end, c1, c2, c3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// AVX-512 KERNELS (64 bytes at a time)                                        //
+////////////////////////////////////////////////////////////////////////////////
+
+__attribute__((target("avx512f,avx512bw")))
+static const wchar_t* FindAnyWAvx512(const wchar_t* pos, const wchar_t* end,
+                                     wchar_t c1, wchar_t c2, wchar_t c3)
+{
+    const __m512i v1 = _mm512_set1_epi32(c1);
+    const __m512i v2 = _mm512_set1_epi32(c2);
+    const __m512i v3 = _mm512_set1_epi32(c3);
+
+    // The last, partial, block is read with a masked load, which does not
+    // touch the memory past end.
+    for (; pos < end; pos += 16)
+    {
+        __mmask16 load = end - pos >= 16 ? 0xffff : (1u << (end - pos)) - 1;
+        __m512i data = _mm512_maskz_loadu_epi32(load, pos);
+        __mmask16 mask = (_mm512_cmpeq_epi32_mask(data, v1) |
+                          _mm512_cmpeq_epi32_mask(data, v2) |
+                          _mm512_cmpeq_epi32_mask(data, v3)) & load;
+
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+
+    return end;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const char* FindAnyAvx512(const char* pos, const char* end, char c1,
+                                 char c2, char c3)
+{
+    const __m512i v1 = _mm512_set1_epi8(c1);
+    const __m512i v2 = _mm512_set1_epi8(c2);
+    const __m512i v3 = _mm512_set1_epi8(c3);
+
+    for (; pos < end; pos += 64)
+    {
+        __mmask64 load = end - pos >= 64 ? ~0ull : (1ull << (end - pos)) - 1;
+        __m512i data = _mm512_maskz_loadu_epi8(load, pos);
+        __mmask64 mask = (_mm512_cmpeq_epi8_mask(data, v1) |
+                          _mm512_cmpeq_epi8_mask(data, v2) |
+                          _mm512_cmpeq_epi8_mask(data, v3)) & load;
+
+        if (mask)
+            return pos + __builtin_ctzll(mask);
+    }
+
+    return end;
+}
+
+#endif // SIMD_X86
+
+////////////////////////////////////////////////////////////////////////////////
+// DISPATCH                                                                    //
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The kernels picked for this cpu.
+ */
+struct SimdKernels
+{
+    const char*    level;
+    const wchar_t* (*findAnyW)(const wchar_t*, const wchar_t*, wchar_t,
+                               wchar_t, wchar_t);
+    const char*    (*findAny)(const char*, const char*, char, char, char);
+
+    SimdKernels()
+    {
+        level = "scalar";
+        findAnyW = FindAnyWScalar;
+        findAny = FindAnyScalar;
+
+#ifdef SIMD_X86
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        {
+            level = "avx512";
+            findAnyW = FindAnyWAvx512;
+            findAny = FindAnyAvx512;
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            level = "avx2";
+            findAnyW = FindAnyWAvx2;
+            findAny = FindAnyAvx2;
+        }
+        else if (__builtin_cpu_supports("sse4.2"))
+        {
+            level = "sse4.2";
+            findAnyW = FindAnyWSse;
+            findAny = FindAnySse;
+        }
+#endif
+    }
+};
+
+static const SimdKernels& Kernels(void)
+{
+    static const SimdKernels kernels;
+
+    return kernels;
+}
+
+/**
+ * @brief Finds the first of up to three wide characters (they may repeat).
+ *
+ * @param pos First character to search.
+ * @param end One past the last character to search.
+ * @param c1  A character to find.
+ * @param c2  A character to find.
+ * @param c3  A character to find.
+ *
+ * @return The first character found, or end if none.
+ */
+const wchar_t* FindAnyW(const wchar_t* pos, const wchar_t* end, wchar_t c1,
+                        wchar_t c2, wchar_t c3)
+{
+    return Kernels().findAnyW(pos, end, c1, c2, c3);
+}
+
+/**
+ * @brief Finds the first of up to three bytes (they may repeat).
+ *
+ * @param pos First byte to search.
+ * @param end One past the last byte to search.
+ * @param c1  A byte to find.
+ * @param c2  A byte to find.
+ * @param c3  A byte to find.
+ *
+ * @return The first byte found, or end if none.
+ */
+const char* FindAny(const char* pos, const char* end, char c1, char c2, char c3)
+{
+    return Kernels().findAny(pos, end, c1, c2, c3);
+}
+
+/**
+ * @brief Names the kernels in use: "avx512", "avx2", "sse4.2" or "scalar".
+ */
+const char* SimdLevel(void)
+{
+    return Kernels().level;
+}
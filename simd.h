@@ -0,0 +1,29 @@
+/**
+ * @file simd.h
+ * @author Daniel Rencricca
+ * @brief  Header file for simd.cpp, the scanning kernels used to find fields
+ * and records.
+ * @version 1.1
+ * @date 2015-12-22
+ *
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+#include <stddef.h>
+#include <wchar.h>
+
+// Each kernel has a scalar version and, on x86-64, SSE4.2, AVX2 and AVX-512
+// versions. The first call picks the widest the cpu supports, unless the
+// program was built with NO_SIMD.
+
+const wchar_t* FindAnyW(const wchar_t* pos, const wchar_t* end, wchar_t c1,
+                        wchar_t c2, wchar_t c3);
+const char*    FindAny(const char* pos, const char* end, char c1, char c2,
+                       char c3);
+const char*    SimdLevel(void);
+
+#endif // _SIMD_H_
@@ -39,18 +39,93 @@
 #include <iostream>
 #include <stdio.h>
 #include <string>
+#include <algorithm>
+#include <new>
+#include <queue>
+#include <thread>
 #include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <wctype.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
 
 #include "sortroutines.h"
+#include "logger.h"
+#include "simd.h"
 
 using namespace std;
 
 #define _THIS_FILE L"SortRoutines"
 
 #ifdef _DEBUG
-uint OrgLineCnt;
+uint64_t OrgRecCnt;
 #endif
 
+// Key comparisons made by RecCmp and BufCmp on this thread. Each thread
+// keeps its own count, so a comparison costs no locked instruction (see
+// CmpCount).
+static thread_local uint64_t t_iCmpCnt = 0;
+
+// Elapsed and cpu time in seconds, for --stats.
+static double WallSec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double CpuSec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The modification time of a file in ns, for KEYIDX.
+static uint64_t FileTimeNs(const struct stat &st)
+{
+    return st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+}
+
+// A command line argument as wide text, in the user's locale. Bytes that are
+// not a character of the locale are kept as their value, as WidenLine does
+// for records, so a key still matches the records it was copied from.
+static wstring WidenArg(const string &arg)
+{
+    const char *beg = arg.c_str(), *end = beg + arg.length();
+    mbstate_t state = mbstate_t();
+    wstring warg;
+    wchar_t wc;
+    size_t n;
+
+    for (; beg < end; beg += n)
+    {
+        n = MB_CUR_MAX == 1 ? 0 : mbrtowc(&wc, beg, end - beg, &state);
+
+        if (n == 0 || n > (size_t)(end - beg)) // invalid, or a single byte locale
+        {
+            wc = (unsigned char)*beg;
+            state = mbstate_t();
+            n = 1;
+        }
+
+        warg += wc;
+    }
+
+    return warg;
+}
+
 /**
  * @brief Construct a new Sort Routines:: Sort Routines object
  * 
@@ -65,25 +140,74 @@ SortRoutines::SortRoutines(string inFile, string outFile, uint col1, uint col2,
 {
 
 #ifdef _DEBUG
-    OrgLineCnt = 0;
+    OrgRecCnt = 0;
 #endif
 
     // initialize variables
     m_iBufArrSz = 0;
     m_iSrtFlArrSz = 0;
-    m_fProgress = 0;
+    m_iProgress = PROGRESS_AUTO;
+    m_bProgBar = false;
+    m_iProgBytes = 0;
+    m_iProgRecs = 0;
+    m_iProgTotal = 0;
+    m_fProgStart = 0;
+    m_bProgStop = false;
     m_aBufArr = NULL;
     m_aSrtFlArr = NULL;
     m_fpInfile = NULL;
-    m_sHoldFile = HLDFILE;
+    m_pZipIn.reset(new ZipStream());
+    m_iInZip = ZIP_NONE;
+    m_iInSize = 0;
+    m_iInFile = 0;
+    m_iInBase = 0;
+    m_iInSrcBase = 0;
+    m_fpNextIn = NULL;
+    m_pZipNext.reset(new ZipStream());
+    m_iNextZip = ZIP_NONE;
+    m_iOutZip = ZIP_NONE;
+    m_fpHold = NULL;
+    m_sTempDir = WORK_DIR;
+    m_bTmpFile = false;
+    m_bHoles = true;
+    m_iMaxTemp = 0;
+    m_iTempPeak = 0;
+    m_iTmpFileN = 0;
+    m_iMemSz = SORT_MEM_SZ;
+    m_iIoBufSz = IO_BUF_SSD;
+    m_iStatPhase = -1;
+    m_iCmpCnt = 0;
+    m_iCmpBase = t_iCmpCnt;
+    m_fStartWall = WallSec();
     m_sUserFile = inFile;
-    m_bUsingQuotes = false;
+    m_aInFiles.push_back(inFile);
+    m_cDelim = 0;
+    m_cQuote = CHR_QUO;
+    m_cEscape = CHR_QUO;
     m_sOutfile = outFile;
     m_bSkipFirstLn = true;
     m_iSortCol1 = col1;
     m_iSortCol2 = col2;
     m_iSortCol3 = col3;
-    m_LogFileP = NULL;
+    m_iLimit = 0;
+    m_bStable = false;
+    m_bKeysOnly = false;
+    m_iShards = 0;
+    m_iShard = 0;
+    m_bShardWide = true;
+    m_bMergedOut = false;
+    m_iIndexEvery = 0;
+    m_bNoCache = false;
+    m_iCollate = COLLATE_BINARY;
+    m_bResume = false;
+    m_bResumed = false;
+    m_iCkptGen = 0;
+    m_iCkptOffset = 0;
+    m_iCkptFile = 0;
+    m_iCkptBase = 0;
+    m_iCkptRecs = 0;
+    m_iCkptPending = 0;
+    m_iRunRecs = 0;
 
     // make space on heap for m_aBufArr and m_aSrtFlArr arrays
     AllocateBufArr(BUF_ARR_SZ);
@@ -91,10 +215,10 @@ SortRoutines::SortRoutines(string inFile, string outFile, uint col1, uint col2,
 
     // initialize m_aSrtFlArr array file pointers
     for (int x = 0; x < m_iSrtFlArrSz; x++)
+    {
         m_aSrtFlArr[x]->fp = NULL;
-
-    // remove the file in case prior failed processing
-    remove(m_sHoldFile.c_str());
+        m_aSrtFlArr[x]->hdr = false;
+    }
 }
 
 /**
@@ -103,26 +227,287 @@ SortRoutines::SortRoutines(string inFile, string outFile, uint col1, uint col2,
  */
 SortRoutines::~SortRoutines()
 {
+    StopProgress();
+
     DeleteSortFiles();
 
     if (m_fpInfile)
         fclose(m_fpInfile);
+    if (m_fpNextIn)
+        fclose(m_fpNextIn);
+
+    for (ShardType &out : m_aShardOut) // left open by an error
+    {
+        if (out.fp)
+            fclose(out.fp);
+        if (out.idxFp)
+            fclose(out.idxFp);
+    }
+
+    CloseHoldFile();
+
+    // Empty and remove the temp directory, which only this sort used.
+    if (!m_sWorkDir.empty())
+    {
+        DIR *dir = opendir(m_sWorkDir.c_str());
+        struct dirent *ent;
+
+        while (dir && (ent = readdir(dir)))
+            if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+                remove((m_sWorkDir + "/" + ent->d_name).c_str());
 
-    remove(m_sHoldFile.c_str());
+        if (dir)
+            closedir(dir);
+
+        rmdir(m_sWorkDir.c_str());
+    }
 
     DeallocateBufArr(m_iBufArrSz);
 
     DeallocateSrtFlArr(m_iSrtFlArrSz);
 }
 
+/**
+ * @brief Limits the output to the first 'limit' records by sort key. A limit
+ * of 0 outputs every record.
+ * 
+ * @param limit Maximum number of records to write to the output file.
+ */
+void SortRoutines::SetLimit(uint limit)
+{
+    m_iLimit = limit;
+}
+
+/**
+ * @brief Sets how the fields of a record are delimited and quoted. By
+ * default fields are delimited by commas or tabs (whichever the first line
+ * of the file uses) and a quote within a quoted field is escaped by doubling
+ * it, as in RFC 4180.
+ * 
+ * @param delim  Field delimiter, or 0 to detect it from the first line.
+ * @param quote  Character that may enclose a field.
+ * @param escape Character that escapes a quote within a quoted field.
+ */
+void SortRoutines::SetCsvFormat(wchar_t delim, wchar_t quote, wchar_t escape)
+{
+    m_cDelim = delim;
+    m_cQuote = quote;
+    m_cEscape = escape;
+}
+
+/**
+ * @brief Sets how sort keys are ordered. Keys are transformed once, when
+ * they are read, into a binary key whose byte order is the collation order,
+ * so comparisons cost the same whatever the collation. COLLATE_CASE folds
+ * keys to lower case with towlower (using LC_CTYPE). COLLATE_LOCALE
+ * transforms keys with wcsxfrm (using LC_COLLATE), which is the same as
+ * comparing them with wcscoll. The caller is expected to have called
+ * setlocale.
+ * 
+ * @param collate COLLATE_BINARY, COLLATE_CASE or COLLATE_LOCALE.
+ */
+void SortRoutines::SetCollation(int collate)
+{
+    m_iCollate = collate;
+}
+
+/**
+ * @brief Makes SortFile checkpoint its progress after each merge, and resume
+ * from the last checkpoint of an earlier sort of the same file that did not
+ * finish. See WriteCheckpoint.
+ * 
+ * @param resume true to checkpoint and resume the sort.
+ */
+void SortRoutines::SetResume(bool resume)
+{
+    m_bResume = resume;
+}
+
+/**
+ * @brief Sets the directory in which the private temp directory of the sort
+ * is created. It defaults to the current directory.
+ * 
+ * @param tempDir Directory to hold the temporary files.
+ * @return Void.
+ */
+void SortRoutines::SetTempDir(string tempDir)
+{
+    m_sTempDir = tempDir;
+}
+
+/**
+ * @brief Sets how the progress of the sort is shown: PROGRESS_AUTO (a bar if
+ * standard output is a terminal), PROGRESS_BAR, PROGRESS_JSON or
+ * PROGRESS_NONE.
+ * 
+ * @param progress One of the PROGRESS_ modes.
+ * @return Void.
+ */
+void SortRoutines::SetProgress(int progress)
+{
+    m_iProgress = progress;
+}
+
+/**
+ * @brief Sets the memory the sort may use for its buffer array and sort
+ * files (see PlanSort), or for the --limit heap (see TopKSort).
+ * 
+ * @param memSz Memory budget in bytes.
+ * @return Void.
+ */
+void SortRoutines::SetMemory(size_t memSz)
+{
+    m_iMemSz = memSz;
+}
+
+/**
+ * @brief Keeps records with equal keys in the same order as the input file.
+ * 
+ * @param stable true for a stable sort.
+ */
+void SortRoutines::SetStable(bool stable)
+{
+    m_bStable = stable;
+}
+
+/**
+ * @brief Makes SortFile sort only the key and input offset of each record,
+ * then gather the records from the input file in key order (see
+ * KeySortFile). The temporary files then hold keys, not whole records, so
+ * wide records cost no more temp I/O than narrow ones.
+ * 
+ * @param keysOnly true to sort keys and offsets.
+ */
+void SortRoutines::SetKeysOnly(bool keysOnly)
+{
+    m_bKeysOnly = keysOnly;
+}
+
+/**
+ * @brief Splits the output of SortFile into shards by key range instead of
+ * writing one output file. The boundaries are picked from a sample of the
+ * records read so the shards are about the same size. Shard n is written to
+ * SHARDFILE (eg "out.csv.002"), and the boundary keys and size of each shard
+ * to SHARDIDX. Equal keys always go to the same shard.
+ * 
+ * @param shards Number of shards, or 0 or 1 for a single output file.
+ */
+void SortRoutines::SetShards(uint shards)
+{
+    m_iShards = shards;
+}
+
+/**
+ * @brief Splits the output of SortFile into shards at the given keys rather
+ * than sampled ones. Each key is the values of the sort columns in order,
+ * separated by the field delimiter (it may give just the first ones), and
+ * is the lowest key of its shard.
+ * 
+ * @param keys Boundary keys, one fewer than the number of shards.
+ */
+void SortRoutines::SetShardKeys(const vector<string> &keys)
+{
+    m_aShardKeys.clear();
+
+    for (const string &key : keys)
+        m_aShardKeys.push_back(WidenArg(key));
+}
+
+/**
+ * @brief Makes SortFile write a sparse key index (KEYIDX) beside each output
+ * file, with the key and byte offset of every Nth record, for LookupFile.
+ * 
+ * @param every Records per index entry (0 = no index).
+ */
+void SortRoutines::SetIndex(uint every)
+{
+    m_iIndexEvery = every;
+}
+
+/**
+ * @brief Makes SortFile merge the sorted input into a file that is already
+ * sorted on the same columns, eg rows added since that file was sorted, so
+ * only the new rows are sorted. The result is a single file: it is not
+ * split into shards or indexed.
+ * 
+ * @param baseFile Name of the sorted file (empty = none).
+ */
+void SortRoutines::SetBaseFile(const string &baseFile)
+{
+    m_sBaseFile = baseFile;
+}
+
+/**
+ * @brief Keeps the temporary sort files out of the page cache, so that a
+ * big sort does not evict the cached data of other programs on the host or
+ * leave a backlog of dirty pages to be written. The files are read and
+ * written as before, but their pages are sent to disk as they are written
+ * and dropped from the cache once written or read (see DropWritten and
+ * DropRead). This costs the sort some speed, as its own files are then
+ * always read from disk.
+ * 
+ * @param noCache true to keep the sort files out of the page cache.
+ */
+void SortRoutines::SetNoCache(bool noCache)
+{
+    m_bNoCache = noCache;
+}
+
+/**
+ * @brief Limits the disk space taken by the temporary sort files. The sort
+ * fails, before it starts if the size of the input shows it will not fit or
+ * else as soon as it finds the limit would be passed (see CheckTempSpace),
+ * rather than filling the disk.
+ * 
+ * @param maxTemp Most bytes of temp space to use, or 0 for no limit.
+ */
+void SortRoutines::SetMaxTemp(uint64_t maxTemp)
+{
+    m_iMaxTemp = maxTemp;
+}
+
+/**
+ * @brief Compresses the output of the sort (and each shard) as it is
+ * written, so the sorted data never reaches the disk uncompressed. gzip is
+ * written as bgzf blocks and zstd as a series of frames, so that either can
+ * be read back in parallel (see ZipStream).
+ * 
+ * @param type ZIP_NONE, ZIP_GZIP or ZIP_ZSTD.
+ */
+void SortRoutines::SetCompress(int type)
+{
+    m_iOutZip = type;
+}
+
+/**
+ * @brief Sorts several files as if they were one, in the order given, so
+ * there is no need to join them first. Each file may start with its own copy
+ * of the header, which is skipped like the first file's (see OpenInput).
+ * 
+ * @param inFiles Files to sort; the first replaces the one given when the
+ * sorter was created.
+ */
+void SortRoutines::SetInputs(const vector<string>& inFiles)
+{
+    if (inFiles.empty())
+        return;
+
+    m_aInFiles = inFiles;
+    m_sUserFile = inFiles[0];
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // MEMORY ALLOCATION SUBROUTINES                                              //
 ////////////////////////////////////////////////////////////////////////////////
 
 /**
- * @brief Allocates room on the heap for the m_aBufArr array. If there is
- *  insufficient memory, it attempts to obtain 80% of amount reached on first
- *  attempt.
+ * @brief Allocates the m_aBufArr array. It is a contiguous array of key
+ *  prefixes and record pointers, at the start of m_Arena, followed by the
+ *  records themselves; the arena is backed by huge pages where possible and
+ *  is kept from one buffer array to the next. If there is insufficient
+ *  memory, it attempts to obtain 80% of the amount, and if the arena still
+ *  cannot be had the array and records are allocated on the heap, stopping
+ *  at the records it could get (SortFile checks there are enough).
  * 
  * @param maxSz The size of array we want to allocate.
  * 
@@ -130,27 +515,45 @@ SortRoutines::~SortRoutines()
  */
 void SortRoutines::AllocateBufArr(int maxSz)
 {
+    void *mem;
+
+    while (!m_Arena.Reserve((size_t)maxSz * (sizeof(BufKeyType) +
+                                             sizeof(BufRecType)) + CACHE_LINE_SZ) &&
+           maxSz > MIN_ARR_SZ)
+        maxSz = max(MIN_ARR_SZ, (int)(maxSz * .80)); // try smaller size
+
+    mem = m_Arena.Alloc(maxSz * sizeof(BufKeyType), CACHE_LINE_SZ);
+
     try
     {
-        m_aBufArr = new BufRecType *[maxSz];
-        for (m_iBufArrSz = 0; m_iBufArrSz < maxSz; m_iBufArrSz++)
-        {
-            m_aBufArr[m_iBufArrSz] = new BufRecType;
-        }
+        m_aBufArr = mem ? (BufKeyType *)mem : new BufKeyType[maxSz];
     }
 
     catch (...)
     {
-        DeallocateBufArr(m_iBufArrSz);
-        maxSz = (int)(m_iBufArrSz * .80); // try smaller size
-        m_aBufArr = new BufRecType *[maxSz];
-        for (m_iBufArrSz = 0; m_iBufArrSz < maxSz; m_iBufArrSz++)
+        maxSz = (int)(maxSz * .80); // try smaller size
+        m_aBufArr = new BufKeyType[maxSz];
+    }
+
+    for (m_iBufArrSz = 0; m_iBufArrSz < maxSz; m_iBufArrSz++)
+    {
+        mem = m_Arena.Alloc(sizeof(BufRecType), alignof(BufRecType));
+
+        try
         {
-            m_aBufArr[m_iBufArrSz] = new BufRecType;
+            m_aBufArr[m_iBufArrSz].rec = mem ? new (mem) BufRecType : new BufRecType;
         }
+
+        catch (...)
+        {
+            break; // keep the records allocated so far
+        }
+
+        m_aBufArr[m_iBufArrSz].prefix = 0;
     }
 
-    assert(maxSz == m_iBufArrSz);
+    LOGMSG(LOG_DEBUG, "Buffer array: %d records, %zuMB arena%s", m_iBufArrSz,
+           m_Arena.Size() >> 20, m_Arena.IsHuge() ? " (huge pages)" : "");
 }
 
 /**
@@ -200,14 +603,19 @@ void SortRoutines::DeallocateBufArr(uint bufArrSz)
 
     if (m_aBufArr)
     {
-        for (uint i = 1; i < bufArrSz; i++)
+        for (uint i = 0; i < bufArrSz; i++)
         {
-            delete m_aBufArr[i];
+            if (m_Arena.Owns(m_aBufArr[i].rec))
+                m_aBufArr[i].rec->~BufRecType(); // its memory is the arena's
+            else
+                delete m_aBufArr[i].rec;
         }
 
-        delete[] m_aBufArr;
+        if (!m_Arena.Owns(m_aBufArr))
+            delete[] m_aBufArr;
 
         m_aBufArr = NULL;
+        m_Arena.Reset();
     }
 }
 
@@ -252,921 +660,4548 @@ void SortRoutines::FileIOError(string msg)
 {
     printf("%s", msg.c_str());
 
-    if ((m_LogFileP = fopen (LOGFILE, "a")) != NULL)
-    {
-        fprintf(m_LogFileP, "%s\n", msg.c_str());
-        fclose(m_LogFileP);
-    }
+    // Wait for the log file, as the program may stop after an error.
+    LOGMSG(LOG_ERROR, "%s", msg.c_str());
+    Logger::Get().Flush();
 }
 
 /**
- * @brief Adds a message to the log file and displays a message if there is an
- * error writing to the file.
+ * @brief If no field delimiter was given, looks at a line of data to see if
+ * the file delimits its fields with tabs or commas. This is done once per
+ * file, before any keys are read, so that GetKey does not modify the object
+ * and may be called from several threads.
  * 
- * @param logMessage Message to add to the log file.
+ * @param dataLn A line of data (normally the header line) from the file.
  * 
-*/
-void SortRoutines::AddLogEntry(const string msg)
+ * @return Void.
+ */
+void SortRoutines::DetectDelimiter(const wchar_t *dataLn)
 {
-    #ifdef _DEBUG
-    if ((m_LogFileP = fopen (LOGFILE, "a")) != NULL)
-    {
-        fprintf(m_LogFileP, "%s\n", msg.c_str());
-        fclose(m_LogFileP);
-    }
-    #endif
+    if (m_cDelim == 0)
+        m_cDelim = (wcschr(dataLn, CHR_TAB) && !wcschr(dataLn, CHR_COM))
+                       ? CHR_TAB : CHR_COM;
 }
 
 /**
- * @brief Initialize merge files by creating up to m_iSrtFlArrSz temporary sort
- * files to be used to hold the runs of data read from the input file.
+ * @brief Reads one record from a file. This is the same as fgetws, except
+ * that a quoted field may contain newlines, in which case more lines are
+ * read until the closing quote is found. Lines without any quotes (the
+ * common case) are only scanned by wcschr, which the C library vectorizes.
  * 
- * @param startFileN Starting sort file number to create.
+ * @param dataLn Buffer of BUFFER_SZ characters to read the record into.
+ * @param fp     File to read from.
  * 
- * @return true if it successfully created the sort files, else false if error.
-  */
-bool SortRoutines::InitTempFiles(int startFileN)
+ * @return dataLn, or NULL at end of file or if an error occurred.
+ */
+wchar_t *SortRoutines::ReadRecord(wchar_t *dataLn, FILE *fp)
 {
-    string filePathName;
+    size_t len = 0;
+    bool inQuote = false;
+    wchar_t *pos;
 
-    // create names for temporary merge sort files.
-    for (int x = startFileN; x < m_iSrtFlArrSz; x++)
-    {
-        sprintf(m_aSrtFlArr[x]->name, SRTFILE, x);
+    if (!GetLine(dataLn, BUFFER_SZ, fp))
+        return NULL;
 
-        filePathName = m_aSrtFlArr[x]->name;
+    while (true)
+    {
+        pos = dataLn + len;
 
-        if (!(m_aSrtFlArr[x]->fp = fopen(filePathName.c_str(), "w+b")))
+        if (inQuote || wcschr(pos, m_cQuote))
         {
-            sprintf(msg_buf, cErrFileOpen, "SR01", filePathName.c_str());   
-            FileIOError(msg_buf);
-            return false;
+            for (; *pos; pos++)
+            {
+                if (*pos == m_cEscape && m_cEscape != m_cQuote && pos[1])
+                    pos++; // skip escaped character
+                else if (*pos == m_cQuote)
+                    inQuote = !inQuote;
+            }
+        }
+        else
+        {
+            pos += wcslen(pos);
         }
-    }
 
-    return true;
+        len = pos - dataLn;
+
+        // Done unless a quoted field continues on the next line.
+        if (!inQuote || dataLn[len - 1] != CHR_LF || len >= BUFFER_SZ - 1)
+            return dataLn;
+
+        if (!GetLine(dataLn + len, BUFFER_SZ - len, fp))
+            return dataLn; // file ended within quotes
+    }
 }
 
 /**
- * @brief Delete temporary merge files that were created.
- * @return Void.
+ * @brief Reads a line as fgetws does. The stream of a compressed input (see
+ * ZipStream) cannot be read as wide characters, so its lines are read as
+ * bytes and converted here.
+ * 
+ * @param buf Where to put the line.
+ * @param n   Size of buf, in characters.
+ * @param fp  File to read from.
+ * 
+ * @return buf, or NULL at the end of the file or if error.
  */
-void SortRoutines::DeleteSortFiles(void)
+wchar_t *SortRoutines::GetLine(wchar_t *buf, int n, FILE *fp)
 {
-    int x;
-    string filePathName;
+    mbstate_t state;
+    bool partial = false; // within a multibyte character
+    int len = 0;
+    int c;
 
+    if (fp != m_fpInfile || m_iInZip == ZIP_NONE)
+        return fgetws(buf, n, fp);
 
-    for (x = 0; x < m_iSrtFlArrSz; x++)
+    memset(&state, 0, sizeof(state));
+
+    while (len < n - 1 && (c = getc_unlocked(fp)) != EOF)
     {
-        if (m_aSrtFlArr[x]->fp)
+        char ch = c;
+
+        if (c < 0x80 && !partial)
         {
-            fclose(m_aSrtFlArr[x]->fp); // close stream
-            m_aSrtFlArr[x]->fp = NULL;
+            buf[len] = c;
+        }
+        else
+        {
+            size_t r = mbrtowc(&buf[len], &ch, 1, &state);
 
-            filePathName = m_aSrtFlArr[x]->name;
-            remove(filePathName.c_str()); // erase file
+            if (r == (size_t)-1)
+                return NULL; // not a character of the locale
+            if ((partial = (r == (size_t)-2)))
+                continue;
         }
+
+        if (buf[len++] == CHR_LF)
+            break;
     }
 
-    return;
+    if (len == 0)
+        return NULL;
+
+    buf[len] = L'\0';
+
+    return buf;
 }
 
 /**
- * @brief Clean up temporary merge sort files. Create a temporary. Holder file
- *  to hold sorted data.
+ * @brief Writes text to an output file as fwprintf(fp, L"%S", text) would,
+ * but through the byte functions of stdio, which the stream of a compressed
+ * output (see ZipStream) needs.
  * 
- * @return true if the sort files were successfully removed, else false if error.
+ * @param fp   File to write to.
+ * @param text The text.
+ * 
+ * @return true if successful, else false if error.
  */
-bool SortRoutines::TermTmpFiles(void)
+bool SortRoutines::PutText(FILE *fp, const wchar_t *text)
 {
-    string filePathName;
-    int lastPos = m_iSrtFlArrSz - 1; // do not erase last array item
-    uint i = 0;
+    char buf[0x1000];
+    size_t len = 0;
+    mbstate_t state;
+
+    memset(&state, 0, sizeof(state));
 
-    // Close the last sort file (as it will be renamed)
-    if (m_aSrtFlArr[lastPos]->fp)
+    for (; *text; text++)
     {
-        if (fclose(m_aSrtFlArr[lastPos]->fp))
+        if (len > sizeof(buf) - MB_LEN_MAX)
         {
-            sprintf(msg_buf, cErrFileClose, "SR02a", m_aSrtFlArr[lastPos]->name);
-            AddLogEntry(msg_buf);
-            assert(false);
-            // this should never happen, but don't make it fatal error for now
+            if (fwrite(buf, 1, len, fp) != len)
+                return false;
+            len = 0;
         }
 
-        m_aSrtFlArr[lastPos]->fp = NULL;
-    }
-
-    // Rename the m_aSrtFlArr[lastPos] file to _holder.dat file.
-    // Allow 6 attempts to rename file, as some RAID systems cannot keep up
-    // with file I/O.
-    filePathName = m_aSrtFlArr[lastPos]->name;
-
-    while (rename(filePathName.c_str(), m_sHoldFile.c_str()))
-    {
-        sprintf(msg_buf, cTryRename, "SR02b");
-        AddLogEntry(msg_buf);
-
-        if (i > 5)
+        if ((unsigned)*text < 0x80)
         {
-            sprintf(msg_buf, cErrFileRen, "SR02c", filePathName.c_str());
-            FileIOError(msg_buf);
-            return false;
+            buf[len++] = *text;
         }
-        i++;
-    }
+        else
+        {
+            size_t r = wcrtomb(buf + len, *text, &state);
 
-    DeleteSortFiles(); // delete all merge sort files
+            if (r == (size_t)-1)
+                return false; // not a character of the locale
+            len += r;
+        }
+    }
 
-    return true;
+    return fwrite(buf, 1, len, fp) == len;
 }
 
 /**
- * @brief Set pointer for m_aSrtFlArr[pos] to first record and read first 
- * record key into m_aSrtFlArr[pos]. Also initializes the eof field for 
- * m_aSrtFlArr[pos].
+ * @brief Opens an input file, through a ZipStream if it is compressed.
  * 
- * @param pos The position within m_aSrtFlArr to read.
- * @return true if the record was read successfully, else false if error.
+ * @param name    File to open.
+ * @param zip     Decompresses the file, if compressed.
+ * @param zipType Set to the ZIP_ type of the file.
+ * @param report  Report an error if the file cannot be opened.
+ * 
+ * @return The open file, else NULL if error.
  */
-bool SortRoutines::RewindF(const int pos)
+FILE *SortRoutines::OpenInFile(const char *name, ZipStream *zip, int *zipType,
+                               bool report)
 {
-    m_aSrtFlArr[pos]->eof = false;
+    FILE *fP;
 
-    rewind(m_aSrtFlArr[pos]->fp);
+    // A compressed file is decompressed by other threads as it is read.
+    *zipType = ZipType(name);
 
-    // Read next data element from the merge file m_aSrtFlArr[x].rec.dataLn
-    if (!fgetws(m_aSrtFlArr[pos]->rec.dataLn, BUFFER_SZ, m_aSrtFlArr[pos]->fp))
+    if (!ZipSupported(*zipType))
     {
-        if (feof(m_aSrtFlArr[pos]->fp)) // if at end of this m_aSrtFlArr
-        {
-            m_aSrtFlArr[pos]->eof = true; // if yes, then mark file as done
-        }
-        else
+        if (report)
         {
-            sprintf(msg_buf, cErrFileRead, "SR05a", m_aSrtFlArr[pos]->name);
+            snprintf(msg_buf, sizeof(msg_buf), cErrNoZstd, "SR08c", name);
             FileIOError(msg_buf);
-            return false;
         }
+        return NULL;
     }
-    else
+
+    if (!(fP = *zipType != ZIP_NONE ? zip->OpenRead(name, *zipType) :
+                                      fopen(name, "r+b")) && report)
     {
-        GetKey(&m_aSrtFlArr[pos]->rec);
+        sprintf(msg_buf, cErrFileOpen, "SR08b", name);
+        FileIOError(msg_buf);
     }
 
-    return true;
+    return fP;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// FILE SORTING SUBROUTINES                                                    //
-////////////////////////////////////////////////////////////////////////////////
-
 /**
- * @brief Performs a case-insensitve comparison of two records. 
- * The sort key is assumed to be located at position 0 in each dataLn.
- * The key ends at the first tab encountered in the dataLn.
+ * @brief Makes m_aInFiles[idx] the file that the input is read from. The
+ * file after it is opened at the same time, so that the system reads it
+ * ahead (or other threads start decompressing it) while this one is sorted.
+ * If m_bSkipFirstLn is set the header of each file after the first is
+ * skipped; it is expected to be the same as the first file's. If the files
+ * before it were all empty, its header is the header of the output.
  * 
- * @param rec1 The first record to compare.
- * @param rec2 The second record to compare.
+ * @param idx Item of m_aInFiles to read.
  * 
- * @return int This will be < 0 if rec1 less than rec2, = 0 rec1 if identical
- * to rec2, or > 0 if rec1 greater than rec2
+ * @return true if successful, else false if error.
  */
-int SortRoutines::RecCmp(BufRecType *rec1, BufRecType *rec2)
+bool SortRoutines::OpenInput(size_t idx)
 {
-    int result = 0;
+    const char *name = m_aInFiles[idx].c_str();
+    bool next = m_fpInfile && idx == m_iInFile + 1;
+
+    if (m_fpInfile)
+    {
+        if (next)
+        {
+            m_iInBase += ftell(m_fpInfile);
+            m_iInSrcBase += m_aInBytes[m_iInFile];
+        }
+
+        fclose(m_fpInfile);
+        m_fpInfile = NULL;
+    }
 
-    result = wcscmp(rec1->key1.c_str(), rec2->key1.c_str());
+    if (idx == 0)
+        m_iInBase = m_iInSrcBase = 0;
 
-    if (result == 0)
+    if (next && m_fpNextIn) // it was opened ahead
+    {
+        m_fpInfile = m_fpNextIn;
+        m_iInZip = m_iNextZip;
+        swap(m_pZipIn, m_pZipNext);
+    }
+    else if (m_fpNextIn)
     {
-        result = wcscmp(rec1->key2.c_str(), rec2->key2.c_str());
+        fclose(m_fpNextIn);
     }
 
-    if (result == 0)
+    m_fpNextIn = NULL;
+    m_iInFile = idx;
+
+    if (!m_fpInfile &&
+        !(m_fpInfile = OpenInFile(name, m_pZipIn.get(), &m_iInZip, true)))
+        return false;
+
+    // An error opening the next file is reported once it is reached.
+    if (idx + 1 < m_aInFiles.size() &&
+        (m_fpNextIn = OpenInFile(m_aInFiles[idx + 1].c_str(), m_pZipNext.get(),
+                                 &m_iNextZip, false)) &&
+        m_iNextZip == ZIP_NONE)
+        posix_fadvise(fileno(m_fpNextIn), 0, IN_AHEAD_SZ, POSIX_FADV_WILLNEED);
+
+    if (idx > 0 && m_bSkipFirstLn)
     {
-        result = wcscmp(rec1->key3.c_str(), rec2->key3.c_str());
+        vector<wchar_t> dataLn(BUFFER_SZ + 1);
+
+        if (!ReadRecord(dataLn.data(), m_fpInfile))
+            return true; // an empty file
+
+        if (!m_bFirstLn[0])
+        {
+            wcscpy(m_bFirstLn, dataLn.data());
+            DetectDelimiter(m_bFirstLn);
+        }
+        else if (wcscmp(dataLn.data(), m_bFirstLn))
+        {
+            LOGMSG(LOG_INFO, "Header of %s differs from %s", name,
+                   m_aInFiles[0].c_str());
+        }
     }
 
-    return result;
+    return true;
 }
+
 /**
- * @brief Parses a line of text to retreive the sort key for that line. The
- *  sort key is assumed to be located at position 0 in each string of text.
+ * @brief Reads the next record of the input, going on to the next input file
+ * at the end of each one.
  * 
- * @param rec The record for which we want to get keys.
+ * @param dataLn Buffer of BUFFER_SZ characters to read the record into.
  * 
- * @return Void.
+ * @return dataLn, or NULL at the end of the input or if error (see
+ * InputDone).
  */
-void SortRoutines::GetKey(BufRecType *rec)
+wchar_t *SortRoutines::ReadInput(wchar_t *dataLn)
 {
+    bool next = false; // went on to another file
 
-    assert(m_iSortCol1 > 0);
+    while (!ReadRecord(dataLn, m_fpInfile))
+    {
+        if (!feof(m_fpInfile) || m_iInFile + 1 >= m_aInFiles.size() ||
+            !OpenInput(m_iInFile + 1))
+            return NULL;
 
-    wstring data = rec->dataLn; //convert line of data to wstring so we can use find
+        next = true;
+    }
 
-    assert(data.length() > 0);
+    // If the files before were empty, the first record tells how fields are
+    // delimited.
+    if (next)
+        DetectDelimiter(dataLn);
 
-    //wchar_t findChar[] = L","; // FIX THIS
-    wchar_t findChar[] = L"\",\""; // FIX THIS
+    return dataLn;
+}
 
-    if (data.find(L"\",\"", 0) > 0)
-    { // does file enclose data fields with quotes?...
-        m_bUsingQuotes = true;
-    }
+/**
+ * @brief Tells whether ReadInput stopped at the end of the last input file,
+ * rather than because of an error.
+ * 
+ * @return true if the whole input has been read.
+ */
+bool SortRoutines::InputDone(void)
+{
+    return m_fpInfile && feof(m_fpInfile) && m_iInFile + 1 >= m_aInFiles.size();
+}
 
-    wstring::size_type eLoc = 0;
-    wstring::size_type sLoc = eLoc;
+/**
+ * @brief Gives the bytes of input read so far, over all the input files. A
+ * compressed file counts its bytes once decompressed.
+ * 
+ * @return Bytes read.
+ */
+uint64_t SortRoutines::InputTell(void)
+{
+    return m_iInBase + (m_fpInfile ? ftell(m_fpInfile) : 0);
+}
 
-    for (int i = 0; i < m_iSortCol1 - 1; i++)
-    {
-        sLoc = data.find(findChar, sLoc);
-        sLoc += wcslen(findChar); // skip find character
-    }
+/**
+ * @brief Goes back to the first record of the input, after the header.
+ * 
+ * @return true if successful, else false if error.
+ */
+bool SortRoutines::RewindInput(void)
+{
+    if (m_iInFile != 0 && !OpenInput(0))
+        return false;
 
-    if (m_bUsingQuotes and sLoc == 0) // skip quote at position 0
-    {
-        sLoc += 1;
-    }
+    rewind(m_fpInfile);
+    if (m_bSkipFirstLn && !ReadRecord(m_bFirstLn, m_fpInfile))
+        m_bFirstLn[0] = L'\0'; // OpenInput takes the next file's header
 
-    eLoc = data.find(findChar, sLoc);
-    rec->key1 = data.substr(sLoc, eLoc - sLoc);
+    return true;
+}
 
-    if (m_iSortCol2 > 0)
-    {
-        sLoc = eLoc = 0;
+/**
+ * @brief Creates the private temp directory that holds the temporary files of
+ * this sort, so that several sorts can run in the same directory at once.
+ * Does nothing if it already exists.
+ * 
+ * @return true if the directory exists, else false if error.
+ */
+bool SortRoutines::InitWorkDir(void)
+{
+    char workDir[FNAME_SZ];
+    int fd = -1;
 
-        for (int i = 0; i < m_iSortCol2 - 1; i++)
-        {
-            sLoc = data.find(findChar, sLoc);
-            sLoc += wcslen(findChar); // skip find character
-        }
+    if (!m_sWorkDir.empty())
+        return true;
 
-        if (m_bUsingQuotes and sLoc == 0) // skip quote at position 0
-        {
-            sLoc += 1;
-        }
+    snprintf(workDir, FNAME_SZ, WORKFILE, m_sTempDir.c_str());
 
-        eLoc = data.find(findChar, sLoc);
-        rec->key2 = data.substr(sLoc, eLoc - sLoc);
+    if (!mkdtemp(workDir))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR15a", workDir);
+        FileIOError(msg_buf);
+        return false;
     }
 
-    if (m_iSortCol3 > 0)
-    {
-        sLoc = eLoc = 0;
+    m_sWorkDir = workDir;
 
-        for (int i = 0; i < m_iSortCol3 - 1; i++)
-        {
-            sLoc = data.find(findChar, sLoc);
-            sLoc += wcslen(findChar); // skip find character
-        }
+    // Sort files are unnamed where the system allows it, so they vanish even
+    // if the sort is killed. They are reopened through /proc/self/fd.
+#ifdef O_TMPFILE
+    if (!access("/proc/self/fd", X_OK))
+        fd = open(workDir, O_TMPFILE | O_RDWR, 0600);
+#endif
+    m_bTmpFile = (fd >= 0);
 
-        if (m_bUsingQuotes and sLoc == 0)
-        {
-            sLoc += 1;
-        }
+    // Merged data is freed by punching holes in the sort files (see
+    // FreeRead), where the file system allows it.
+    m_bHoles = (fd < 0 || !fallocate(fd, FALLOC_FL_PUNCH_HOLE |
+                                     FALLOC_FL_KEEP_SIZE, 0, 1) ||
+                errno != EOPNOTSUPP);
 
-        eLoc = data.find(findChar, sLoc);
-        rec->key3 = data.substr(sLoc, eLoc - sLoc);
-    }
+    if (fd >= 0)
+        close(fd);
+
+    DBGPRINT("Temp directory: %s (%s files%s)", workDir,
+             m_bTmpFile ? "unnamed" : "named",
+             m_bNoCache ? ", not cached" : "");
+
+    return true;
 }
 
 /**
- * @brief Sorts the buffer array in descending order (e.g. ZXYWVU...). It bases
- *  the sort on the "key" variable in each array element.
+ * @brief Tells whether the device holding a file is a spinning disk, from
+ * /sys/dev/block/<major>:<minor>/queue/rotational (a partition's queue
+ * belongs to its parent device).
  * 
- * @param totBufItems This holds a count of the number of items in the buffer
- *  array so that we don't needlessly sort the entire buffer if it is not full.
+ * @param path File or directory on the device.
  * 
- * @return Void.
+ * @return 1 if the device is rotational, 0 if not, or -1 if unknown (eg a
+ * tmpfs, network or overlay file system).
  */
-void SortRoutines::SortList(int totBufItems)
+int SortRoutines::IsRotational(const string &path)
 {
-    int x, y;
-    BufRecType *holder;
+    struct stat st;
+    char sysName[FNAME_SZ];
+    FILE *fP;
+    int rotational = -1;
 
-    DBGVAR(totBufItems);
+    if (stat(path.c_str(), &st))
+        return -1;
 
-    for (x = 0; x < totBufItems - 1; x++)
+    snprintf(sysName, FNAME_SZ, "/sys/dev/block/%u:%u/queue/rotational",
+             major(st.st_dev), minor(st.st_dev));
+
+    if (!(fP = fopen(sysName, "r")))
     {
-        assert(totBufItems > 0);
+        snprintf(sysName, FNAME_SZ, "/sys/dev/block/%u:%u/../queue/rotational",
+                 major(st.st_dev), minor(st.st_dev));
+        fP = fopen(sysName, "r");
+    }
 
-        for (y = x + 1; y < totBufItems; y++)
+    if (fP)
+    {
+        if (fscanf(fP, "%d", &rotational) != 1)
+            rotational = -1;
+        fclose(fP);
+    }
+
+    return rotational;
+}
+
+/**
+ * @brief Initialize merge files by creating up to m_iSrtFlArrSz temporary sort
+ * files to be used to hold the runs of data read from the input file.
+ * 
+ * @param startFileN Starting sort file number to create.
+ * 
+ * @return true if it successfully created the sort files, else false if error.
+  */
+bool SortRoutines::InitTempFiles(int startFileN)
+{
+    // create the temporary merge sort files in the temp directory.
+    for (int x = startFileN; x < m_iSrtFlArrSz; x++)
+    {
+        SrtFlRecType *srtFl = m_aSrtFlArr[x];
+
+        if (!(srtFl->fp = OpenTempFile(srtFl->name)))
         {
-            if (RecCmp(m_aBufArr[y], m_aBufArr[x]) > 0)
-            {
-                holder = m_aBufArr[x];
-                m_aBufArr[x] = m_aBufArr[y];
-                m_aBufArr[y] = holder;
-            }
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR01", srtFl->name);
+            FileIOError(msg_buf);
+            return false;
         }
+
+        setvbuf(srtFl->fp, NULL, _IOFBF, m_iIoBufSz);
+        srtFl->syncOff = 0;
+        srtFl->tmp = srtFl->punch = true;
     }
 
-    return;
+    return true;
 }
 
-
 /**
- * @brief Sorts the buffer array in descending order (e.g. ZXYWVU...). It
- *  assumes only one array element (at position 'pos') is out of order.
+ * @brief Creates a temporary file in the private temp directory. It is
+ * unnamed where the system allows it, else it is named SRTFILE. With
+ * --no-cache the kernel is told that the file is read sequentially, so that
+ * it reads ahead further.
  * 
- * @param totBufSz holds the count of the number of items in the 
- * m_aBufArr array so we don't needlessly sort entire m_aBufArr array
- *  if it is not full.
- * @param pos position of new data element added to the m_aBufArr array.
+ * @param name Set to the name of the file (FNAME_SZ characters).
  * 
- * @return Void.
+ * @return The file, open for reading and writing, or NULL if error.
  */
-void SortRoutines::SortListIncr(const int totBufSz, int pos)
+FILE *SortRoutines::OpenTempFile(char *name)
 {
-    BufRecType *holder;
-
-    if (totBufSz <= 0)
-        return;
+    int fd = -1;
+    FILE *fP;
 
-    // check if new array item needs to move up in the array.
-    while (pos > 0 && RecCmp(m_aBufArr[pos], m_aBufArr[pos - 1]) > 0)
+#ifdef O_TMPFILE
+    if (m_bTmpFile)
+        fd = open(m_sWorkDir.c_str(), O_TMPFILE | O_RDWR, 0600);
+#endif
+    if (fd >= 0)
     {
-        holder = m_aBufArr[pos];
-        m_aBufArr[pos] = m_aBufArr[pos - 1];
-        m_aBufArr[pos - 1] = holder;
-        pos--;
-    }
+        snprintf(name, FNAME_SZ, "/proc/self/fd/%d", fd);
 
-    // check if new array item needs to move up in the array.
-    while (pos < totBufSz - 1 && RecCmp(m_aBufArr[pos], m_aBufArr[pos + 1]) < 0)
+        if (!(fP = fdopen(fd, "w+b")))
+            close(fd);
+    }
+    else
     {
-        holder = m_aBufArr[pos];
-        m_aBufArr[pos] = m_aBufArr[pos + 1];
-        m_aBufArr[pos + 1] = holder;
-        pos++;
+        snprintf(name, FNAME_SZ, SRTFILE, m_sWorkDir.c_str(), m_iTmpFileN++);
+        fP = fopen(name, "w+b");
     }
 
-    return;
+    if (fP && m_bNoCache)
+        posix_fadvise(fileno(fP), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    return fP;
 }
 
 /**
- * @brief Add a line(s) of text to buffer array as well as the corresponding
- * integer key for each line. It also sorts the buffer and keeps track of the
- * number of elements in the buffer.
+ * @brief With --no-cache, keeps what has been written to a sort file from
+ * piling up in the page cache. The data written since the last call is
+ * sent to disk without waiting for it. The data sent by earlier calls has
+ * had time to be written; it is waited for and then dropped from the cache
+ * (dirty pages cannot be dropped).
  * 
- * @param pos position in buffer array to add a new number. If position = -1
- * then start new array.
- * @param totBufSz keeps a count of the number of items in the buffer array
- *  so that we don't needlessly sort the entire buffer if its not full.
+ * @param srtFl The sort file being written.
+ * @param done  true if the file is complete, so that all of it is written
+ *              and dropped.
  * 
- * @return true if the operation was successful, else false if an error
- * occurred.
+ * @return Void.
  */
-bool SortRoutines::AddToBuffer(int pos, int *totBufSz)
+void SortRoutines::DropWritten(SrtFlRecType *srtFl, bool done)
 {
-    int x = 0;
+    const int waitFlags = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER;
+    int fd = fileno(srtFl->fp);
+    off_t end;
 
-    if (pos == -1) // start fresh by filling the entire buffer array.
-    {
-        while (x < m_iBufArrSz)
-        {
-            // read next line of data (including the CRLF)
-            if (!fgetws(m_aBufArr[x]->dataLn, BUFFER_SZ, m_fpInfile))
-            {
-                if (feof(m_fpInfile))
-                {
-                    SortList(*totBufSz);
-                    return true;
-                }
-                else
-                {
-                    sprintf(msg_buf, cErrFileRead, "SR03a", "Input");
-                    FileIOError(msg_buf);
-                    return false;
-                }
-            }
+    // A write error is reported by the caller's next write or flush.
+    if (!m_bNoCache || fflush(srtFl->fp) || (end = ftello(srtFl->fp)) < 0)
+        return;
 
-            // Get the key for current record.
-            GetKey(m_aBufArr[x]);
-            //assert(!m_aBufArr[x]->key->empty());
+    if (srtFl->syncOff > 0)
+    {
+        sync_file_range(fd, 0, srtFl->syncOff, waitFlags);
+        posix_fadvise(fd, 0, srtFl->syncOff, POSIX_FADV_DONTNEED);
+    }
 
-            m_iLineTot++; // update line counter for log entry.
+    if (end > srtFl->syncOff)
+        sync_file_range(fd, srtFl->syncOff, end - srtFl->syncOff,
+                        done ? waitFlags : SYNC_FILE_RANGE_WRITE);
 
-            ShowProgress(false, m_iLineTot);
+    if (done)
+        posix_fadvise(fd, srtFl->syncOff, end - srtFl->syncOff,
+                      POSIX_FADV_DONTNEED);
 
-            (*totBufSz)++; // keep count of buffer elements
+    srtFl->syncOff = end;
+}
 
-            x++;
-        } // while (x < m_iBufArrSz)
+/**
+ * @brief With --no-cache, drops the part of a sort file that has been read
+ * from the page cache, as it is not read again.
+ * 
+ * @param fp The sort file being read.
+ * 
+ * @return Void.
+ */
+void SortRoutines::DropRead(FILE *fp)
+{
+    off_t pos;
 
-        SortList(*totBufSz);
-    } // (pos == -1)
+    if (m_bNoCache && (pos = ftello(fp)) > 0)
+        posix_fadvise(fileno(fp), 0, pos, POSIX_FADV_DONTNEED);
+}
 
-    else // just replace one element in array.
+/**
+ * @brief Frees the disk space of the part of a sort file that has been
+ * merged by punching a hole in it. The merged file then grows into the space
+ * given up by its input files, so a merge takes little more temp space than
+ * its input rather than twice as much. Files that must outlive the merge
+ * (the Holder file of a --resume checkpoint, files given to --merge) are
+ * left whole.
+ * 
+ * @param srtFl The sort file being merged.
+ * 
+ * @return Void.
+ */
+void SortRoutines::FreeRead(SrtFlRecType *srtFl)
+{
+    off_t pos;
 
-    {
-        assert(*totBufSz > 0);
+    if (!m_bHoles || !srtFl->punch || (pos = ftello(srtFl->fp)) <= 0)
+        return;
 
-        //wcout << L"\nBuffer Array:\n";
-        //wcout << L"\nRemoving:";
-        //wcout << m_aBufArr[pos]->key1->c_str();
-        //wcout << L"\n";
-        //for (int i=0; i < m_iBufArrSz; i++){
-        //    wstring temp = m_aBufArr[i]->key1->c_str();
-        //    wcout << temp;
-        //    wcout << L"\n";
-        //}
+    if (fallocate(fileno(srtFl->fp), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  0, pos) && errno == EOPNOTSUPP)
+        m_bHoles = false;
+}
 
-        if (!fgetws(m_aBufArr[pos]->dataLn, BUFFER_SZ, m_fpInfile))
-        {
-            if (feof(m_fpInfile))
-            {
-                m_aBufArr[pos]->key1.clear(); // empty so it sorts to bottom
-                m_aBufArr[pos]->key2.clear(); // empty so it sorts to bottom
-                m_aBufArr[pos]->key3.clear(); // empty so it sorts to bottom
-                SortListIncr(*totBufSz, pos);
-                (*totBufSz)--; // reduce count of buffer elements
-                return true;
-            }
-            else
-            {
-                sprintf(msg_buf, cErrFileRead, "SR03b", "Input");
-                FileIOError(msg_buf);
-                return false;
-            }
-        }
+/**
+ * @brief Measures the disk space taken by the open temporary sort files and
+ * the Holder file, which is less than their size once holes are punched in
+ * them. Data still in their stdio buffers is not counted.
+ * 
+ * @return Bytes of disk space taken.
+ */
+uint64_t SortRoutines::TempSpace(void)
+{
+    uint64_t space = 0;
+    struct stat st;
 
-#ifdef _DEBUG
-//if ((m_iLineTot & PROG_DIV) == 0)
-//    UpdateCnt++;
-#endif
+    for (int x = 0; x < m_iSrtFlArrSz; x++)
+    {
+        SrtFlRecType *srtFl = m_aSrtFlArr[x];
 
-        // Get the key for current record.
-        GetKey(m_aBufArr[pos]);
-        //assert(!m_aBufArr[pos]->key->empty());
+        if (srtFl->fp && srtFl->tmp && !fstat(fileno(srtFl->fp), &st))
+            space += (uint64_t)st.st_blocks * 512;
+    }
 
-        m_iLineTot++; // update line counter
-        ShowProgress(false, m_iLineTot);
+    if (m_fpHold && !fstat(fileno(m_fpHold), &st))
+        space += (uint64_t)st.st_blocks * 512;
 
-        SortListIncr(*totBufSz, pos);
-    } // else
+    m_iTempPeak = max(m_iTempPeak, space);
 
-    return true; // if we reached here then we are not at end of input file.
+    return space;
 }
 
 /**
- * @brief Find the lowest key in the BufferStr that is greater than lowStr.
- * It uses the stricmp function to properly handle strings with international
- * characters.
- * 
- * @param pos the position in the m_aBufArr array where lowStr was found.
- * @param lowRec the lowest number in m_aBufArr that is >= the highest number
- * in the current run.
- * @param totBufSz total current items in m_aBufArr.
+ * @brief Checks that the sort can finish within m_iMaxTemp bytes of temp
+ * space. Every record ends up in the sort files, so the space they take now
+ * plus the rest of the input must fit, with room for the merged file to run
+ * ahead of the holes punched in its input (up to TMP_CHECK_RECS records and
+ * a stdio buffer). Where holes cannot be punched, a merge needs room for a
+ * second copy of its input.
  * 
- * @return true if the lowest key was found, else false.
+ * @return true if the sort fits, else false if error.
  */
-bool SortRoutines::FindLowest(int *pos, BufRecType *lowRec, uint totBufSz)
+bool SortRoutines::CheckTempSpace(void)
 {
-    int x = totBufSz - 1; // adj. for first array item at position 0
+    uint64_t need, rest = 0, recSz = 1;
 
-    assert(totBufSz > 0);
+    if (m_iMaxTemp == 0)
+        return true;
 
-    while (x >= 0)
+    if (m_fpInfile)
+    {
+        uint64_t pos = InputTell();
+
+        rest = m_iInSize > pos ? m_iInSize - pos : 0;
+        recSz = pos / max(m_iRecTot, (uint64_t)1) + 1;
+    }
+
+    need = TempSpace() + rest;
+    need += m_bHoles ? 2 * m_iIoBufSz + (TMP_CHECK_RECS + 1) * recSz : need;
+
+    if (need <= m_iMaxTemp)
+        return true;
+
+    snprintf(msg_buf, sizeof(msg_buf), cErrTempFull, "SR20a",
+             (unsigned long long)(m_iMaxTemp >> 20));
+    FileIOError(msg_buf);
+    return false;
+}
+
+/**
+ * @brief Delete temporary merge files that were created.
+ * @return Void.
+ */
+void SortRoutines::DeleteSortFiles(void)
+{
+    int x;
+
+    for (x = 0; x < m_iSrtFlArrSz; x++)
     {
-        if (RecCmp(m_aBufArr[x], lowRec) >= 0)
+        if (m_aSrtFlArr[x]->fp)
         {
-            lowRec->key1 = m_aBufArr[x]->key1;
-            lowRec->key2 = m_aBufArr[x]->key2;
-            lowRec->key3 = m_aBufArr[x]->key3;
-            *pos = x;
-            return true;
+            fclose(m_aSrtFlArr[x]->fp); // close stream
+            m_aSrtFlArr[x]->fp = NULL;
+
+            // erase file (unnamed files are gone once closed)
+            if (!m_bTmpFile)
+                remove(m_aSrtFlArr[x]->name);
         }
-        x--;
-    } // while
+    }
 
-    // Lowest was not found.
-    lowRec->key1.clear(); // reset the low number for the next sort file
-    lowRec->key2.clear(); // reset the low number for the next sort file
-    lowRec->key3.clear(); // reset the low number for the next sort file
+    return;
+}
 
-    //cout << "Starting new sort file...";
+/**
+ * @brief Clean up temporary merge sort files. The last sort file, which holds
+ * the merged data, becomes the Holder file. It is not renamed: its stream is
+ * simply kept open, which works for unnamed files too.
+ * 
+ * @return true if the sort files were successfully removed, else false if error.
+ */
+bool SortRoutines::TermTmpFiles(void)
+{
+    SrtFlRecType *last = m_aSrtFlArr[m_iSrtFlArrSz - 1];
 
-    return false; // we have to start filling a new sort file
+    CloseHoldFile();
+
+    if (fflush(last->fp))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR02a", last->name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    m_fpHold = last->fp;
+    m_sHoldFile = last->name;
+    last->fp = NULL;
+
+    DeleteSortFiles(); // delete all merge sort files
+
+    return true;
 }
 
 /**
- * @brief MergeSort performs the following tasks: (1) read the first text
- * string from each of the sort files into a m_aSrtFlArr array and get the 
- * integer key from each line of text; (2) Find the lowest key in the
- * m_aSrtFlArr array and write the associated text string into a temporary 
- * holder file; (3) read a new text string from the sort file which previously
- * had the lowest key and get the key from that string; (4) repeat from step 
- * 1 until all sort files have been fully read.
+ * @brief Closes and erases the Holder file, if it is open.
+ * @return Void.
+ */
+void SortRoutines::CloseHoldFile(void)
+{
+    if (!m_fpHold)
+        return;
+
+    fclose(m_fpHold);
+    m_fpHold = NULL;
+
+    if (!m_bTmpFile)
+        remove(m_sHoldFile.c_str());
+}
+
+/**
+ * @brief Set pointer for m_aSrtFlArr[pos] to first record and read first 
+ * record key into m_aSrtFlArr[pos]. Also initializes the eof field for 
+ * m_aSrtFlArr[pos].
  * 
- * @return true if function was successful else false if error occurred.
+ * @param pos The position within m_aSrtFlArr to read.
+ * @return true if the record was read successfully, else false if error.
  */
-bool SortRoutines::MergeSort(void)
+bool SortRoutines::RewindF(const int pos)
 {
-    int k;
-    int x;
+    m_aSrtFlArr[pos]->eof = false;
 
-    // Prime the files and get first data line & key into m_aSrtFlArr array.
-    for (x = 0; x < m_iSrtFileN; x++)
-        RewindF(x);
+    rewind(m_aSrtFlArr[pos]->fp);
 
-    while (true)
+    // Skip the header line of a file given to MergeFiles.
+    if (m_aSrtFlArr[pos]->hdr)
+        ReadRecord(m_aSrtFlArr[pos]->rec.dataLn, m_aSrtFlArr[pos]->fp);
+
+    // Read next data element from the merge file m_aSrtFlArr[x].rec.dataLn
+    if (!ReadRecord(m_aSrtFlArr[pos]->rec.dataLn, m_aSrtFlArr[pos]->fp))
     {
-        // First, find the smallest key.
-        k = -1;
-        for (x = 0; x < m_iSrtFileN; x++)
+        if (feof(m_aSrtFlArr[pos]->fp)) // if at end of this m_aSrtFlArr
         {
-            if (m_aSrtFlArr[x]->eof)
-                continue;
-            if (k < 0 || (k != x && (RecCmp(&m_aSrtFlArr[k]->rec,
-                                            &m_aSrtFlArr[x]->rec) > 0)))
-                k = x;
+            m_aSrtFlArr[pos]->eof = true; // if yes, then mark file as done
         }
-
-        if (k < 0)
-            break; // break while loop if finished with all m_aSrtFlArr
-
-        // Write m_aSrtFlArr[k].rec.dataLn to m_aSrtFlArr[m_iSrtFlArrSz-1].
-        if (fwprintf(m_aSrtFlArr[m_iSrtFlArrSz - 1]->fp, L"%S",
-                     m_aSrtFlArr[k]->rec.dataLn) < 0)
+        else
         {
-            sprintf(msg_buf, cErrFileWrite, "SR06a", m_aSrtFlArr[m_iSrtFlArrSz - 1]->name);
+            sprintf(msg_buf, cErrFileRead, "SR05a", m_aSrtFlArr[pos]->name);
             FileIOError(msg_buf);
             return false;
         }
+    }
+    else
+    {
+        GetKey(&m_aSrtFlArr[pos]->rec);
+    }
 
-        // Replace m_aSrtFlArr[k].rec->key with next item from sort file.
-        if (!fgetws(m_aSrtFlArr[k]->rec.dataLn, BUFFER_SZ,
-                    m_aSrtFlArr[k]->fp))
-        {
-            if (feof(m_aSrtFlArr[k]->fp)) // test for end of file
-            {
-                m_aSrtFlArr[k]->eof = true;
-            }
-            else
-            {
-                sprintf(msg_buf, cErrFileRead, "#SR06b", m_aSrtFlArr[k]->name);
-                FileIOError(msg_buf);
-                return false;
-            }
-        }
-        else
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// FILE SORTING SUBROUTINES                                                    //
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Compares the normalized keys of two records. As GetKey builds the
+ * keys so that their byte order is the order of the sort columns, this is a
+ * single memcmp however many sort columns there are.
+ * 
+ * @param rec1 The first record to compare.
+ * @param rec2 The second record to compare.
+ * 
+ * @return int This will be < 0 if rec1 less than rec2, = 0 rec1 if identical
+ * to rec2, or > 0 if rec1 greater than rec2
+ */
+int SortRoutines::RecCmp(const KeyRecType *rec1, const KeyRecType *rec2)
+{
+    t_iCmpCnt++;
+    return rec1->nkey.compare(rec2->nkey);
+}
+
+/**
+ * @brief Compares two items of the buffer array. Their key prefixes, which
+ * are next to each other in the array, decide most comparisons; only if
+ * they are equal are the records' whole keys compared.
+ * 
+ * @param item1 The first item.
+ * @param item2 The second item.
+ * 
+ * @return As RecCmp.
+ */
+int SortRoutines::BufCmp(const BufKeyType *item1, const BufKeyType *item2)
+{
+    if (item1->prefix != item2->prefix)
+    {
+        t_iCmpCnt++;
+        return item1->prefix < item2->prefix ? -1 : 1;
+    }
+
+    return RecCmp(item1->rec, item2->rec);
+}
+
+/**
+ * @brief Returns the first 8 bytes of a key (padded with zeros) as a big
+ * endian number, so that comparing two prefixes as numbers orders them as
+ * memcmp would.
+ * 
+ * @param nkey The key.
+ * 
+ * @return The prefix.
+ */
+uint64_t SortRoutines::KeyPrefix(const string &nkey)
+{
+    uint64_t prefix = 0;
+
+    memcpy(&prefix, nkey.data(), min(nkey.length(), sizeof(prefix)));
+    return be64toh(prefix);
+}
+
+/**
+ * @brief Gets the key of a record in the buffer array, and its prefix.
+ * 
+ * @param item The buffer array item.
+ * 
+ * @return Void.
+ */
+void SortRoutines::GetBufKey(BufKeyType *item)
+{
+    GetKey(item->rec);
+    item->prefix = KeyPrefix(item->rec->nkey);
+}
+
+/**
+ * @brief Appends one sort column to a normalized key. A quoted column is
+ * added without its quotes and with any escaped quotes unescaped; the
+ * characters between quote and escape characters are copied in whole runs.
+ * It is then transformed for the collation set by SetCollation and encoded
+ * by EncodeKey.
+ * 
+ * @param nkey The normalized key to append to.
+ * @param beg  First character of the column.
+ * @param end  One past the last character of the column.
+ * 
+ * @return Void.
+ */
+void SortRoutines::AppendKey(string *nkey, const wchar_t *beg, const wchar_t *end)
+{
+    thread_local wstring field; // column without quotes, for wcsxfrm
+    thread_local wstring xfrm;  // column transformed by wcsxfrm
+    bool quoted = (beg < end && *beg == m_cQuote);
+
+    if (!quoted && m_iCollate == COLLATE_BINARY)
+    {
+        EncodeKey(nkey, beg, end);
+        return;
+    }
+
+    field.clear();
+
+    if (!quoted)
+        field.assign(beg, end);
+
+    // Skip the opening quote, then copy up to each quote or escape character.
+    for (beg += quoted; quoted && beg < end; beg++)
+    {
+        const wchar_t *run = FindAnyW(beg, end, m_cQuote, m_cEscape, m_cEscape);
+
+        field.append(beg, run);
+
+        if ((beg = run) == end)
+            break;
+
+        if (*beg == m_cEscape && beg + 1 < end &&
+            (m_cEscape != m_cQuote || beg[1] == m_cQuote))
+            beg++; // add the escaped character instead
+        else if (*beg == m_cQuote)
+            break; // closing quote
+
+        field.push_back(*beg);
+    }
+
+    if (m_iCollate == COLLATE_CASE)
+    {
+        for (wchar_t &c : field)
+            c = towlower(c);
+    }
+
+    if (m_iCollate == COLLATE_LOCALE)
+    {
+        size_t len = wcsxfrm(NULL, field.c_str(), 0);
+
+        xfrm.resize(len + 1);
+        wcsxfrm(&xfrm[0], field.c_str(), len + 1);
+        EncodeKey(nkey, xfrm.data(), xfrm.data() + len);
+    }
+    else
+    {
+        EncodeKey(nkey, field.data(), field.data() + field.length());
+    }
+}
+
+/**
+ * @brief Encodes one sort column onto the end of a normalized key. Each
+ * character is written in the UTF-8 style encoding (extended to 31 bits),
+ * whose byte order is the same as the order of the characters, and the
+ * column ends with a 0 byte so that a shorter column sorts before a longer
+ * one it is a prefix of. Comparing two keys with memcmp therefore gives the
+ * same result as calling wcscmp on each column in turn.
+ * 
+ * @param nkey The normalized key to append to.
+ * @param beg  First character of the column.
+ * @param end  One past the last character of the column.
+ * 
+ * @return Void.
+ */
+void SortRoutines::EncodeKey(string *nkey, const wchar_t *beg, const wchar_t *end)
+{
+    for (; beg < end; beg++)
+    {
+        uint32_t ch = min((uint32_t)*beg, (uint32_t)0x7fffffff);
+
+        if (ch < 0x80)
         {
-            GetKey(&m_aSrtFlArr[k]->rec);
+            nkey->push_back((char)ch);
+            continue;
         }
 
-    } // while (true)
+        int extra = ch < 0x800 ? 1 : ch < 0x10000 ? 2 : ch < 0x200000 ? 3
+                                 : ch < 0x4000000 ? 4 : 5;
+        static const unsigned char lead[] = {0, 0xc0, 0xe0, 0xf0, 0xf8, 0xfc};
 
-    return true;
+        nkey->push_back((char)(lead[extra] | (ch >> (6 * extra))));
+
+        while (extra-- > 0)
+            nkey->push_back((char)(0x80 | ((ch >> (6 * extra)) & 0x3f)));
+    }
+
+    nkey->push_back('\0');
 }
 
 /**
- * @brief Make runs using replacement selection.
- * Methodology: Read up to MAX_ARR_SZ lines of a text file into a
- * buffer array, where each element of the array consists of the
- * text string and an integer key that is copied from the text string;
- * (3) sort the array by the key; (4) find the lowest key in
- *  the buffer that is greater than the last key read, and copy the text
- * string associated with that key from the buffer to a temporary sort file; 
- * (5) read in one new line of text into the buffer and resort the buffer;
- * (7) repeat from step 3 until there are no more keys left that are greater
- * than the last key read; (8) repeat from step 2 until he last sort file
- * has been filled.
+ * @brief Finds the end of the field that starts at pos. Delimiters within
+ * quotes are skipped. FindAnyW jumps from one delimiter, quote or escape
+ * character to the next, so the characters between are not looked at one by
+ * one. As these characters often come in pairs (a closing quote then a
+ * delimiter), the character at pos is checked before starting a search.
  * 
- * @return true if successful, else false if an error occurred.
+ * @param pos Start of the field.
+ * @param end End of the record.
+ * 
+ * @return Position of the delimiter after the field, or end.
  */
-bool SortRoutines::MakeRuns(void)
+const wchar_t *SortRoutines::FindFieldEnd(const wchar_t *pos, const wchar_t *end)
 {
-    int totBufItems = 0; // number of elements in the buffer array
-    int pos = 0;         // position of lowest item in buffer array
-    uint i;
-    BufRecType lowRec;   // lowest item >= highest item in current run
-    bool notEndRun;      // signals the end of a run
-    string filePathName; // file path and name
+    bool inQuote = false;
+
+    for (; pos < end; pos++)
+    {
+        if (*pos != m_cDelim && *pos != m_cQuote && *pos != m_cEscape &&
+            (pos = FindAnyW(pos + 1, end, m_cDelim, m_cQuote, m_cEscape)) == end)
+            break;
+
+        if (*pos == m_cEscape && m_cEscape != m_cQuote && pos + 1 < end)
+            pos++; // skip escaped character
+        else if (*pos == m_cQuote)
+            inQuote = !inQuote;
+        else if (*pos == m_cDelim && !inQuote)
+            break;
+    }
+
+    return pos;
+}
+
+/**
+ * @brief Parses a record to retreive the sort key for that record. Fields
+ *  are separated by m_cDelim and may be enclosed in m_cQuote, in which case
+ *  they may contain delimiters and newlines. When the record contains no
+ *  quotes at all the fields are found by searching for the delimiter
+ *  alone. The sort columns are joined into one normalized key by
+ *  AppendKey. For a stable sort the input line number is added as a fixed
+ *  width big-endian tiebreak, so equal keys keep their input order without
+ *  any extra string comparisons. Records read back from sort files have a
+ *  line number of 0: they tie on the key alone and MergeSort then takes the
+ *  lowest numbered sort file, which always holds the earliest input.
+ * 
+ * @param rec The record for which we want to get keys.
+ * 
+ * @return Void.
+ */
+void SortRoutines::GetKey(BufRecType *rec)
+{
+    const uint sortCols[] = {m_iSortCol1, m_iSortCol2, m_iSortCol3};
+    const wchar_t *data = rec->dataLn;
+    const wchar_t *dataEnd = data + wcslen(data);
+    bool noQuotes = (wcschr(data, m_cQuote) == NULL);
+
+    assert(m_iSortCol1 > 0);
+
+    // The record's newline is not part of the last field.
+    while (dataEnd > data && (dataEnd[-1] == CHR_LF || dataEnd[-1] == CHR_CR))
+        dataEnd--;
+
+    rec->nkey.clear();
+
+    for (int k = 0; k < 3; k++)
+    {
+        const wchar_t *sLoc, *eLoc;
+
+        if (sortCols[k] == 0)
+            continue;
+
+        sLoc = FindField(data, dataEnd, sortCols[k], noQuotes, &eLoc);
+        AppendKey(&rec->nkey, sLoc, eLoc);
+    }
+
+    if (m_bStable)
+    {
+        for (int i = sizeof(rec->seq) - 1; i >= 0; i--)
+            rec->nkey.push_back((char)(rec->seq >> (8 * i)));
+    }
+}
+
+/**
+ * @brief Finds a column of a record.
+ * 
+ * @param data     The record.
+ * @param dataEnd  End of the record, before its newline.
+ * @param col      Column number (1 = first column).
+ * @param noQuotes true if the record has no quotes, so fields can be found
+ *  by searching for the delimiter alone.
+ * @param fieldEnd Set to one past the last character of the column.
+ * 
+ * @return First character of the column (dataEnd if the record has fewer
+ *  columns).
+ */
+const wchar_t *SortRoutines::FindField(const wchar_t *data, const wchar_t *dataEnd,
+                                       uint col, bool noQuotes,
+                                       const wchar_t **fieldEnd)
+{
+    const wchar_t *sLoc = data;
+    const wchar_t *eLoc;
+
+    for (uint i = 0; i < col - 1 && sLoc < dataEnd; i++)
+    {
+        if (noQuotes)
+            eLoc = FindAnyW(sLoc, dataEnd, m_cDelim, m_cDelim, m_cDelim);
+        else
+            eLoc = FindFieldEnd(sLoc, dataEnd);
+
+        sLoc = (eLoc < dataEnd) ? eLoc + 1 : dataEnd;
+    }
+
+    if (noQuotes)
+        eLoc = FindAnyW(sLoc, dataEnd, m_cDelim, m_cDelim, m_cDelim);
+    else
+        eLoc = FindFieldEnd(sLoc, dataEnd);
+
+    *fieldEnd = eLoc;
+
+    return sLoc;
+}
+
+/**
+ * @brief Sorts the buffer array in descending order (e.g. ZXYWVU...). It bases
+ *  the sort on the "key" variable in each array element.
+ * 
+ * @param totBufItems This holds a count of the number of items in the buffer
+ *  array so that we don't needlessly sort the entire buffer if it is not full.
+ * 
+ * @return Void.
+ */
+void SortRoutines::SortList(int totBufItems)
+{
+    int x, y;
+    BufKeyType holder;
+
+    DBGVAR(totBufItems);
+
+    for (x = 0; x < totBufItems - 1; x++)
+    {
+        assert(totBufItems > 0);
+
+        for (y = x + 1; y < totBufItems; y++)
+        {
+            if (BufCmp(&m_aBufArr[y], &m_aBufArr[x]) > 0)
+            {
+                holder = m_aBufArr[x];
+                m_aBufArr[x] = m_aBufArr[y];
+                m_aBufArr[y] = holder;
+            }
+        }
+    }
+
+    return;
+}
+
+
+/**
+ * @brief Sorts the buffer array in descending order (e.g. ZXYWVU...). It
+ *  assumes only one array element (at position 'pos') is out of order.
+ * 
+ * @param totBufSz holds the count of the number of items in the 
+ * m_aBufArr array so we don't needlessly sort entire m_aBufArr array
+ *  if it is not full.
+ * @param pos position of new data element added to the m_aBufArr array.
+ * 
+ * @return Void.
+ */
+void SortRoutines::SortListIncr(const int totBufSz, int pos)
+{
+    BufKeyType holder;
+
+    if (totBufSz <= 0)
+        return;
+
+    // check if new array item needs to move up in the array.
+    while (pos > 0 && BufCmp(&m_aBufArr[pos], &m_aBufArr[pos - 1]) > 0)
+    {
+        holder = m_aBufArr[pos];
+        m_aBufArr[pos] = m_aBufArr[pos - 1];
+        m_aBufArr[pos - 1] = holder;
+        pos--;
+    }
+
+    // check if new array item needs to move up in the array.
+    while (pos < totBufSz - 1 && BufCmp(&m_aBufArr[pos], &m_aBufArr[pos + 1]) < 0)
+    {
+        holder = m_aBufArr[pos];
+        m_aBufArr[pos] = m_aBufArr[pos + 1];
+        m_aBufArr[pos + 1] = holder;
+        pos++;
+    }
+
+    return;
+}
+
+/**
+ * @brief Add a line(s) of text to buffer array as well as the corresponding
+ * integer key for each line. It also sorts the buffer and keeps track of the
+ * number of elements in the buffer.
+ * 
+ * @param pos position in buffer array to add a new number. If position = -1
+ * then start new array.
+ * @param totBufSz keeps a count of the number of items in the buffer array
+ *  so that we don't needlessly sort the entire buffer if its not full.
+ * 
+ * @return true if the operation was successful, else false if an error
+ * occurred.
+ */
+bool SortRoutines::AddToBuffer(int pos, int *totBufSz)
+{
+    int x = *totBufSz; // after any records already in the buffer
+
+    if (pos == -1) // start fresh by filling the entire buffer array.
+    {
+        while (x < m_iBufArrSz)
+        {
+            // read next line of data (including the CRLF)
+            if (!ReadInput(m_aBufArr[x].rec->dataLn))
+            {
+                if (InputDone())
+                {
+                    SortList(*totBufSz);
+                    return true;
+                }
+                else
+                {
+                    sprintf(msg_buf, cErrFileRead, "SR03a", "Input");
+                    FileIOError(msg_buf);
+                    return false;
+                }
+            }
+
+            // Get the key for current record.
+            m_aBufArr[x].rec->seq = m_iRecTot;
+            GetBufKey(&m_aBufArr[x]);
+            SampleRecord(m_aBufArr[x].rec);
+            //assert(!m_aBufArr[x].rec->key->empty());
+
+            m_iRecTot++; // update record counter for log entry.
+
+            UpdateProgress();
+
+            (*totBufSz)++; // keep count of buffer elements
+
+            x++;
+        } // while (x < m_iBufArrSz)
+
+        SortList(*totBufSz);
+    } // (pos == -1)
+
+    else // just replace one element in array.
+
+    {
+        assert(*totBufSz > 0);
+
+        //wcout << L"\nBuffer Array:\n";
+        //wcout << L"\nRemoving:";
+        //wcout << m_aBufArr[pos].rec->key1->c_str();
+        //wcout << L"\n";
+        //for (int i=0; i < m_iBufArrSz; i++){
+        //    wstring temp = m_aBufArr[i].rec->key1->c_str();
+        //    wcout << temp;
+        //    wcout << L"\n";
+        //}
+
+        if (!ReadInput(m_aBufArr[pos].rec->dataLn))
+        {
+            if (InputDone())
+            {
+                m_aBufArr[pos].rec->nkey.clear(); // empty so it sorts to bottom
+                m_aBufArr[pos].prefix = 0;
+                SortListIncr(*totBufSz, pos);
+                (*totBufSz)--; // reduce count of buffer elements
+                return true;
+            }
+            else
+            {
+                sprintf(msg_buf, cErrFileRead, "SR03b", "Input");
+                FileIOError(msg_buf);
+                return false;
+            }
+        }
+
+#ifdef _DEBUG
+//if ((m_iRecTot & PROG_DIV) == 0)
+//    UpdateCnt++;
+#endif
+
+        // Get the key for current record.
+        m_aBufArr[pos].rec->seq = m_iRecTot;
+        GetBufKey(&m_aBufArr[pos]);
+        SampleRecord(m_aBufArr[pos].rec);
+        //assert(!m_aBufArr[pos].rec->key->empty());
+
+        m_iRecTot++; // update record counter
+        UpdateProgress();
+
+        SortListIncr(*totBufSz, pos);
+    } // else
+
+    return true; // if we reached here then we are not at end of input file.
+}
+
+/**
+ * @brief Find the lowest key in the BufferStr that is greater than lowStr.
+ * It uses the stricmp function to properly handle strings with international
+ * characters.
+ * 
+ * @param pos the position in the m_aBufArr array where lowStr was found.
+ * @param lowRec the lowest number in m_aBufArr that is >= the highest number
+ * in the current run.
+ * @param totBufSz total current items in m_aBufArr.
+ * 
+ * @return true if the lowest key was found, else false.
+ */
+bool SortRoutines::FindLowest(int *pos, BufRecType *lowRec, uint totBufSz)
+{
+    int x = totBufSz - 1; // adj. for first array item at position 0
+    BufKeyType low = {KeyPrefix(lowRec->nkey), lowRec};
+
+    assert(totBufSz > 0);
+
+    while (x >= 0)
+    {
+        if (BufCmp(&m_aBufArr[x], &low) >= 0)
+        {
+            lowRec->nkey = m_aBufArr[x].rec->nkey;
+            *pos = x;
+            return true;
+        }
+        x--;
+    } // while
+
+    // Lowest was not found.
+    lowRec->nkey.clear(); // reset the low number for the next sort file
+
+    //cout << "Starting new sort file...";
+
+    return false; // we have to start filling a new sort file
+}
+
+/**
+ * @brief MergeSort performs the following tasks: (1) read the first text
+ * string from each of the sort files into a m_aSrtFlArr array and get the 
+ * integer key from each line of text; (2) Find the lowest key in the
+ * m_aSrtFlArr array and write the associated text string into a temporary 
+ * holder file; (3) read a new text string from the sort file which previously
+ * had the lowest key and get the key from that string; (4) repeat from step 
+ * 1 until all sort files have been fully read.
+ * 
+ * @param toShards true to write the records to the output files through
+ *                 ShardFile, using the keys already read, rather than to the
+ *                 holder file. The shards must be open (see OpenShards).
+ * 
+ * @return true if function was successful else false if error occurred.
+ */
+bool SortRoutines::MergeSort(bool toShards)
+{
+    int k;
+    int x;
+    uint outCnt = 0; // records written so far
+    StatPhaseType &phase = BeginPhase("merge", false);
+
+    m_iRunRecs = 0;
+
+    // Prime the files and get first data line & key into m_aSrtFlArr array.
+    for (x = 0; x < m_iSrtFileN; x++)
+        RewindF(x);
+
+    while (true)
+    {
+        // First, find the smallest key.
+        k = -1;
+        for (x = 0; x < m_iSrtFileN; x++)
+        {
+            if (m_aSrtFlArr[x]->eof)
+                continue;
+            if (k < 0 || (k != x && (RecCmp(&m_aSrtFlArr[k]->rec,
+                                            &m_aSrtFlArr[x]->rec) > 0)))
+                k = x;
+        }
+
+        if (k < 0)
+            break; // break while loop if finished with all m_aSrtFlArr
+
+        // Write m_aSrtFlArr[k].rec.dataLn to m_aSrtFlArr[m_iSrtFlArrSz-1].
+        if (toShards)
+        {
+            FILE *fPOut = ShardFile(m_aSrtFlArr[k]->rec.nkey);
+
+            if (!fPOut)
+                return false;
+
+            if (!PutText(fPOut, m_aSrtFlArr[k]->rec.dataLn))
+            {
+                sprintf(msg_buf, cErrFileWrite, "SR06c",
+                        m_aShardOut[m_iShard].name.c_str());
+                FileIOError(msg_buf);
+                return false;
+            }
+        }
+        else if (fwprintf(m_aSrtFlArr[m_iSrtFlArrSz - 1]->fp, L"%S",
+                          m_aSrtFlArr[k]->rec.dataLn) < 0)
+        {
+            sprintf(msg_buf, cErrFileWrite, "SR06a", m_aSrtFlArr[m_iSrtFlArrSz - 1]->name);
+            FileIOError(msg_buf);
+            return false;
+        }
+
+        // Keep the key range of the merged data for the checkpoint.
+        if (m_bResume)
+        {
+            if (outCnt == 0)
+                m_sRunMinKey = m_aSrtFlArr[k]->rec.nkey;
+            m_sRunMaxKey.swap(m_aSrtFlArr[k]->rec.nkey);
+        }
+
+        m_iRunRecs = ++outCnt;
+
+        if ((outCnt & TMP_CHECK_RECS) == 0)
+        {
+            DropWritten(m_aSrtFlArr[m_iSrtFlArrSz - 1], false);
+            for (x = 0; x < m_iSrtFileN; x++)
+            {
+                DropRead(m_aSrtFlArr[x]->fp);
+                FreeRead(m_aSrtFlArr[x]);
+            }
+
+            if (!CheckTempSpace())
+                return false;
+        }
+
+        // Records past the limit can never reach the output file.
+        if (m_iLimit > 0 && outCnt >= m_iLimit)
+            break;
+
+        // Replace m_aSrtFlArr[k].rec->key with next item from sort file.
+        if (!ReadRecord(m_aSrtFlArr[k]->rec.dataLn, m_aSrtFlArr[k]->fp))
+        {
+            if (feof(m_aSrtFlArr[k]->fp)) // test for end of file
+            {
+                m_aSrtFlArr[k]->eof = true;
+                DropRead(m_aSrtFlArr[k]->fp);
+                FreeRead(m_aSrtFlArr[k]);
+            }
+            else
+            {
+                sprintf(msg_buf, cErrFileRead, "#SR06b", m_aSrtFlArr[k]->name);
+                FileIOError(msg_buf);
+                return false;
+            }
+        }
+        else
+        {
+            GetKey(&m_aSrtFlArr[k]->rec);
+        }
+
+    } // while (true)
+
+    // The merged file is read next, from disk.
+    DropWritten(m_aSrtFlArr[m_iSrtFlArrSz - 1], true);
+    TempSpace();
+
+    phase.recs = outCnt;
+    phase.tmpWrite = ftell(m_aSrtFlArr[m_iSrtFlArrSz - 1]->fp);
+    for (x = 0; x < m_iSrtFileN; x++)
+        phase.tmpRead += ftell(m_aSrtFlArr[x]->fp);
+    EndPhase();
+
+    return true;
+}
+
+/**
+ * @brief Saves a checkpoint of the sort so far. It is called after each
+ * merge, when the Holder file holds every record written so far and the
+ * buffer array holds the records read from the input but not yet written.
+ * The Holder file is hard linked (so not copied) to a run file, the buffer
+ * records are written to a pending file and a manifest records both along
+ * with the input offset reached. The manifest is replaced atomically and the
+ * files of the previous checkpoint are then removed, so there is always one
+ * complete checkpoint.
+ * 
+ * @param totBufItems Number of records in the buffer array.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::WriteCheckpoint(int totBufItems)
+{
+    char runName[FNAME_SZ], pendName[FNAME_SZ], ckptName[FNAME_SZ];
+    string tmpName;
+    vector<BufRecType *> pending;
+    struct stat st;
+    FILE *fP;
+    uint gen = m_iCkptGen + 1;
+    bool ok;
+
+    snprintf(runName, FNAME_SZ, CKPTRUN, m_sOutfile.c_str(), gen);
+    snprintf(pendName, FNAME_SZ, CKPTPEND, m_sOutfile.c_str(), gen);
+    snprintf(ckptName, FNAME_SZ, CKPTFILE, m_sOutfile.c_str());
+    tmpName = string(ckptName) + ".tmp";
+
+    remove(runName);
+
+    if (!LinkOrCopy(m_sHoldFile, runName))
+        return false;
+
+    for (int i = 0; i < totBufItems; i++)
+        pending.push_back(m_aBufArr[i].rec);
+
+    // Write the buffer records in input order, which keeps --stable stable.
+    sort(pending.begin(), pending.end(),
+         [](const BufRecType *a, const BufRecType *b) { return a->seq < b->seq; });
+
+    if (!(fP = fopen(pendName, "w+b")))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR13a", pendName);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    ok = true;
+    for (size_t i = 0; i < pending.size() && ok; i++)
+        ok = (fwprintf(fP, L"%S", pending[i]->dataLn) >= 0);
+
+    ok = ok && !fflush(fP) && !fsync(fileno(fP));
+    ok = !fclose(fP) && ok;
+
+    if (ok && (fP = fopen(runName, "rb")))
+    {
+        ok = !fsync(fileno(fP)); // make sure the data survives a crash
+        fclose(fP);
+    }
+
+    if (!ok)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR13b", pendName);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    // Write the manifest.
+    if (!(fP = fopen(tmpName.c_str(), "w")))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR13c", tmpName.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    fprintf(fP, "file-sort checkpoint %d\n", CKPT_VERSION);
+    fprintf(fP, "inputs %zu\n", m_aInFiles.size());
+    for (const string &name : m_aInFiles)
+    {
+        if (stat(name.c_str(), &st))
+            st.st_size = st.st_mtime = -1; // will not match on resume
+        fprintf(fP, "input %lld %lld %s\n", (long long)st.st_size,
+                (long long)st.st_mtime, name.c_str());
+    }
+    fprintf(fP, "keys %u %u %u %d %d %d %d %d %d\n", m_iSortCol1, m_iSortCol2,
+            m_iSortCol3, (int)m_cDelim, (int)m_cQuote, (int)m_cEscape,
+            m_iCollate, (int)m_bStable, (int)m_bSkipFirstLn);
+    fprintf(fP, "offset %ld %llu %zu %llu\n", ftell(m_fpInfile),
+            (unsigned long long)m_iRecTot, m_iInFile,
+            (unsigned long long)m_iInBase);
+    fprintf(fP, "run %zu x", m_iRunRecs);
+    for (size_t i = 0; i < m_sRunMinKey.length(); i++)
+        fprintf(fP, "%02x", (unsigned char)m_sRunMinKey[i]);
+    fprintf(fP, " x");
+    for (size_t i = 0; i < m_sRunMaxKey.length(); i++)
+        fprintf(fP, "%02x", (unsigned char)m_sRunMaxKey[i]);
+    fprintf(fP, " %s\n", runName);
+    fprintf(fP, "pending %d %s\n", totBufItems, pendName);
+    fprintf(fP, "generation %u\n", gen);
+
+    ok = !ferror(fP) && !fflush(fP) && !fsync(fileno(fP));
+    ok = !fclose(fP) && ok;
+
+    if (!ok || rename(tmpName.c_str(), ckptName))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR13d", ckptName);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    swap(gen, m_iCkptGen);
+    RemoveCheckpoint(gen); // the previous checkpoint
+
+    LOGMSG(LOG_INFO, "Checkpoint %u: %llu records, %d pending", m_iCkptGen,
+           (unsigned long long)m_iRecTot, totBufItems);
+
+    return true;
+}
+
+/**
+ * @brief Reads the checkpoint manifest left by an earlier sort of the same
+ * input files. The checkpoint is only used if the input files and the sort
+ * options are unchanged, and its run still starts with the lowest key that
+ * the manifest recorded for it.
+ * 
+ * @return true if there is a checkpoint to resume from, else false.
+ */
+bool SortRoutines::ReadCheckpoint(void)
+{
+    char ckptName[FNAME_SZ], runName[FNAME_SZ], pendName[FNAME_SZ];
+    char inName[FNAME_SZ];
+    unsigned int col1, col2, col3, gen;
+    int version, delim, quote, escape, collate, stable, skipHdr, pending;
+    long long size, mtime;
+    unsigned long long recCnt, base;
+    long offset;
+    size_t recs, inputs, file;
+    string minKey, maxKey;
+    struct stat st;
+    FILE *fP;
+    bool match;
+
+    // Read a key written by WriteCheckpoint as "x" and its bytes in hex.
+    auto readKey = [&fP](string *key) -> bool {
+        auto hexVal = [](int c) { return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10; };
+        int hi, lo;
+
+        key->clear();
+        if (getc(fP) != 'x')
+            return false;
+        while (isxdigit(hi = getc(fP)) && isxdigit(lo = getc(fP)))
+            key->push_back((char)(hexVal(hi) << 4 | hexVal(lo)));
+        return hi == ' ';
+    };
+
+    snprintf(ckptName, FNAME_SZ, CKPTFILE, m_sOutfile.c_str());
+
+    if (!(fP = fopen(ckptName, "r")))
+        return false; // nothing to resume
+
+    match = fscanf(fP, "file-sort checkpoint %d\n", &version) == 1 &&
+            version == CKPT_VERSION &&
+            fscanf(fP, "inputs %zu\n", &inputs) == 1 &&
+            inputs == m_aInFiles.size();
+
+    // Each input file must be the same one, unchanged.
+    for (size_t i = 0; match && i < inputs; i++)
+    {
+        match = fscanf(fP, "input %lld %lld %255[^\n]\n", &size, &mtime, inName) == 3 &&
+                !stat(m_aInFiles[i].c_str(), &st) && size == (long long)st.st_size &&
+                mtime == (long long)st.st_mtime && m_aInFiles[i] == inName;
+    }
+
+    match = match &&
+            fscanf(fP, "keys %u %u %u %d %d %d %d %d %d\n", &col1, &col2, &col3,
+                   &delim, &quote, &escape, &collate, &stable, &skipHdr) == 9 &&
+            fscanf(fP, "offset %ld %llu %zu %llu\n", &offset, &recCnt, &file, &base) == 4 &&
+            fscanf(fP, "run %zu ", &recs) == 1 && readKey(&minKey) &&
+            readKey(&maxKey) && fscanf(fP, "%255[^\n]\n", runName) == 1 &&
+            fscanf(fP, "pending %d %255[^\n]\n", &pending, pendName) == 2 &&
+            fscanf(fP, "generation %u", &gen) == 1;
+
+    fclose(fP);
+
+    match = match && file < inputs && col1 == m_iSortCol1 && col2 == m_iSortCol2 &&
+            col3 == m_iSortCol3 && delim == (int)m_cDelim &&
+            quote == (int)m_cQuote && escape == (int)m_cEscape &&
+            collate == m_iCollate && stable == (int)m_bStable &&
+            skipHdr == (int)m_bSkipFirstLn && pending <= m_iBufArrSz &&
+            !access(runName, R_OK) && !access(pendName, R_OK);
+
+    // Make sure the run is the one the manifest describes.
+    if (match && recs > 0)
+    {
+        BufRecType *rec = m_aBufArr[0].rec;
+
+        match = (fP = fopen(runName, "rb")) && ReadRecord(rec->dataLn, fP);
+        if (match)
+        {
+            rec->seq = 0; // as MergeSort read it
+            GetKey(rec);
+            match = rec->nkey == minKey;
+        }
+        if (fP)
+            fclose(fP);
+    }
+
+    if (!match)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cNoResume, ckptName);
+        LOGMSG(LOG_INFO, "%s", msg_buf);
+        printf("%s", msg_buf);
+        return false;
+    }
+
+    m_iCkptGen = gen;
+    m_iCkptOffset = offset;
+    m_iCkptFile = file;
+    m_iCkptBase = base;
+    m_iCkptRecs = recCnt;
+    m_iCkptPending = pending;
+    m_iRunRecs = recs;
+    m_sRunMinKey.swap(minKey);
+    m_sRunMaxKey.swap(maxKey);
+
+    printf("Resuming from checkpoint %u (%zu records sorted)\n", gen, recs);
+
+    return true;
+}
+
+/**
+ * @brief Restores the state saved by WriteCheckpoint: the checkpointed run
+ * becomes _sort000.dat, the pending records are read back into the buffer
+ * array and the input is positioned where the checkpoint left off.
+ * 
+ * @param totBufItems Set to the number of records in the buffer array.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::ResumeRuns(int *totBufItems)
+{
+    char runName[FNAME_SZ], pendName[FNAME_SZ];
+    FILE *fP;
+    int x;
+
+    snprintf(runName, FNAME_SZ, CKPTRUN, m_sOutfile.c_str(), m_iCkptGen);
+    snprintf(pendName, FNAME_SZ, CKPTPEND, m_sOutfile.c_str(), m_iCkptGen);
+
+    if (!InitTempFiles(1))
+        return false;
+
+    // The checkpoint must survive until the next one, so link, don't move.
+    snprintf(m_aSrtFlArr[0]->name, FNAME_SZ, SRTFILE, m_sWorkDir.c_str(),
+             m_iTmpFileN++);
+
+    if (!LinkOrCopy(runName, m_aSrtFlArr[0]->name))
+        return false;
+
+    if (!(m_aSrtFlArr[0]->fp = fopen(m_aSrtFlArr[0]->name, "r+b")))
+    {
+        sprintf(msg_buf, cErrFileOpen, "SR13e", m_aSrtFlArr[0]->name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    setvbuf(m_aSrtFlArr[0]->fp, NULL, _IOFBF, m_iIoBufSz);
+
+    // Like the other sort files, it goes away once closed. It is also the
+    // checkpoint's data, so no holes are punched in it.
+    if (m_bTmpFile)
+        remove(m_aSrtFlArr[0]->name);
+
+    m_aSrtFlArr[0]->tmp = true;
+    m_aSrtFlArr[0]->punch = false;
+
+    if (!(fP = fopen(pendName, "rb")))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR13f", pendName);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    // The pending records were read just before record m_iCkptRecs.
+    for (x = 0; x < (int)m_iCkptPending; x++)
+    {
+        if (!ReadRecord(m_aBufArr[x].rec->dataLn, fP))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileRead, "SR13g", pendName);
+            FileIOError(msg_buf);
+            fclose(fP);
+            return false;
+        }
+
+        m_aBufArr[x].rec->seq = m_iCkptRecs - m_iCkptPending + x;
+        GetBufKey(&m_aBufArr[x]);
+    }
+
+    fclose(fP);
+
+    *totBufItems = m_iCkptPending;
+    m_iRecTot = m_iCkptRecs;
+
+    if (m_iCkptFile != m_iInFile && !OpenInput(m_iCkptFile))
+        return false;
+
+    if (fseek(m_fpInfile, m_iCkptOffset, SEEK_SET))
+    {
+        sprintf(msg_buf, cErrFileRead, "SR13h", "Input");
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    m_iInBase = m_iCkptBase;
+    m_iInSrcBase = 0;
+    for (size_t i = 0; i < m_iCkptFile; i++)
+        m_iInSrcBase += m_aInBytes[i];
+
+    // Fill the rest of the buffer from the input file.
+    return AddToBuffer(-1, totBufItems);
+}
+
+/**
+ * @brief Removes the files of a checkpoint. The manifest is removed as well
+ * if it names this checkpoint.
+ * 
+ * @param gen Generation of the checkpoint to remove (0 = none).
+ * 
+ * @return Void.
+ */
+void SortRoutines::RemoveCheckpoint(uint gen)
+{
+    char name[FNAME_SZ];
+
+    if (gen == 0)
+        return;
+
+    snprintf(name, FNAME_SZ, CKPTRUN, m_sOutfile.c_str(), gen);
+    remove(name);
+    snprintf(name, FNAME_SZ, CKPTPEND, m_sOutfile.c_str(), gen);
+    remove(name);
+
+    if (gen == m_iCkptGen)
+    {
+        snprintf(name, FNAME_SZ, CKPTFILE, m_sOutfile.c_str());
+        remove(name);
+    }
+}
+
+/**
+ * @brief Gives a file a second name with a hard link, or copies it if the
+ * file system does not allow that.
+ * 
+ * @param fromFile Name of the existing file.
+ * @param toFile   New name for the file.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::LinkOrCopy(const string &fromFile, const string &toFile)
+{
+    // Follow the link so that an unnamed file open at /proc/self/fd/N gets
+    // the new name.
+    if (!linkat(AT_FDCWD, fromFile.c_str(), AT_FDCWD, toFile.c_str(),
+                AT_SYMLINK_FOLLOW))
+        return true;
+
+    return CopyFile(fromFile, toFile);
+}
+
+/**
+ * @brief Copies a file.
+ * 
+ * @param fromFile Name of the file to copy.
+ * @param toFile   Name of the copy.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::CopyFile(const string &fromFile, const string &toFile)
+{
+    char buf[BUFSIZ];
+    FILE *fPIn, *fPOut;
+    size_t n;
+    bool ok = true;
+
+    if (!(fPIn = fopen(fromFile.c_str(), "rb")))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR14a", fromFile.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    if (!(fPOut = fopen(toFile.c_str(), "wb")))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR14b", toFile.c_str());
+        FileIOError(msg_buf);
+        fclose(fPIn);
+        return false;
+    }
+
+    while (ok && (n = fread(buf, 1, sizeof(buf), fPIn)) > 0)
+        ok = (fwrite(buf, 1, n, fPOut) == n);
+
+    ok = ok && !ferror(fPIn);
+    fclose(fPIn);
+    ok = !fclose(fPOut) && ok;
+
+    if (!ok)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR14c", toFile.c_str());
+        FileIOError(msg_buf);
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Merges files that are already sorted into the output file, without
+ * making any runs. The header line (if any) of each file is skipped and the
+ * header of the first file is written to the output file. If there are more
+ * files than can be opened at once, groups of files are first merged into
+ * intermediate files until the rest can be merged in a single pass. If the
+ * output file is one of the input files, it is replaced once the merge is
+ * done, as in MergeBase. The output is a single file: it is not split into
+ * shards or indexed.
+ * 
+ * @param inFiles Names of the sorted files to merge.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::MergeFiles(const vector<string> &inFiles)
+{
+    vector<MrgFileType> pending; // files still to be merged
+    wchar_t dataLn[BUFFER_SZ + 1];
+    struct stat inSt, outSt;
+    string outName = m_sOutfile;
+    bool outExists = !stat(m_sOutfile.c_str(), &outSt);
+    bool ok;
+    struct rlimit rl;
+    int fanIn = m_iSrtFlArrSz - 1; // last m_aSrtFlArr item is output file
+    int mrgFileN = 0;
+    FILE *fP;
+
+    if (m_iSrtFlArrSz < MIN_ARR_SZ || inFiles.empty())
+    {
+        sprintf(msg_buf, cNoMemory, "SR12a");
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    // Size the sort files and their buffers to the memory budget.
+    PlanSort(0, inFiles.size());
+    fanIn = m_iSrtFlArrSz - 1;
+
+    // Leave room for the output, log and standard files.
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY)
+        fanIn = min(fanIn, max(2, (int)rl.rlim_cur - MRG_FD_RESERVE));
+
+    m_bFirstLn[0] = L'\0';
+
+    for (size_t i = 0; i < inFiles.size(); i++)
+    {
+        if (!(fP = fopen(inFiles[i].c_str(), "rb")))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR12b", inFiles[i].c_str());
+            FileIOError(msg_buf);
+            return false;
+        }
+
+        // Writing the output over an input would lose its records.
+        if (outExists && !fstat(fileno(fP), &inSt) &&
+            inSt.st_dev == outSt.st_dev && inSt.st_ino == outSt.st_ino)
+            outName = m_sOutfile + ".tmp";
+
+        // The first line of the first file that has one tells how fields
+        // are delimited and is the header for the output file.
+        if (!ReadRecord(dataLn, fP))
+            dataLn[0] = L'\0';
+
+        fclose(fP);
+
+        if (!m_bFirstLn[0] && dataLn[0])
+        {
+            wcscpy(m_bFirstLn, dataLn);
+            DetectDelimiter(m_bFirstLn);
+        }
+        else if (m_bSkipFirstLn && dataLn[0] && wcscmp(dataLn, m_bFirstLn))
+        {
+            LOGMSG(LOG_INFO, "Header of %s differs from %s", inFiles[i].c_str(),
+                   inFiles[0].c_str());
+        }
+
+        MrgFileType mrgFile = {inFiles[i], m_bSkipFirstLn, false, NULL};
+        pending.push_back(mrgFile);
+    }
+
+    // Merge groups of neighbouring files until the rest can be opened at
+    // once. Keeping the files in order keeps equal keys in order too.
+    while ((int)pending.size() > fanIn)
+    {
+        vector<MrgFileType> merged;
+
+        for (size_t i = 0; i < pending.size(); i += fanIn)
+        {
+            vector<MrgFileType> group(pending.begin() + i, pending.begin() +
+                                      min(pending.size(), i + fanIn));
+            char name[FNAME_SZ];
+
+            if (group.size() == 1)
+            {
+                merged.push_back(group[0]);
+                continue;
+            }
+
+            if (!InitWorkDir())
+                return false;
+
+            snprintf(name, FNAME_SZ, MRGFILE, m_sWorkDir.c_str(), mrgFileN++);
+
+            if (!MergeGroup(group, group.size(), name, false))
+                return false;
+
+            MrgFileType mrgFile = {name, false, true, NULL};
+            merged.push_back(mrgFile);
+        }
+
+        pending.swap(merged);
+    }
+
+    ok = MergeGroup(pending, pending.size(), outName, m_bSkipFirstLn);
+
+    if (ok && outName != m_sOutfile)
+    {
+        swap(m_aStats.back().tmpWrite, m_aStats.back().bytesOut);
+
+        if (rename(outName.c_str(), m_sOutfile.c_str()))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileRen, "SR12h", outName.c_str());
+            FileIOError(msg_buf);
+            ok = false;
+        }
+    }
+
+    if (!ok && outName != m_sOutfile)
+        remove(outName.c_str());
+
+    return ok;
+}
+
+/**
+ * @brief Merges the first n files in a list into one file using MergeSort.
+ * Intermediate files are removed once they have been merged.
+ * 
+ * @param files    Files to merge.
+ * @param n        Number of files from the start of the list to merge. This
+ *                 must be less than m_iSrtFlArrSz.
+ * @param outName  Name of the file to write.
+ * @param writeHdr true to write m_bFirstLn to the start of the file.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::MergeGroup(const vector<MrgFileType> &files, int n,
+                              const string &outName, bool writeHdr)
+{
+    SrtFlRecType *outRec = m_aSrtFlArr[m_iSrtFlArrSz - 1];
+    bool ok = true;
+    int x;
+
+    assert(n < m_iSrtFlArrSz);
+
+    for (x = 0; x < n && ok; x++)
+    {
+        snprintf(m_aSrtFlArr[x]->name, FNAME_SZ, "%s", files[x].name.c_str());
+        m_aSrtFlArr[x]->hdr = files[x].hdr;
+        m_aSrtFlArr[x]->tmp = m_aSrtFlArr[x]->punch = files[x].isTmp;
+
+        if (files[x].fp)
+            m_aSrtFlArr[x]->fp = files[x].fp;
+        else if (!(m_aSrtFlArr[x]->fp = fopen(files[x].name.c_str(), "rb")))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR12c", files[x].name.c_str());
+            FileIOError(msg_buf);
+            ok = false;
+        }
+        else
+            setvbuf(m_aSrtFlArr[x]->fp, NULL, _IOFBF, m_iIoBufSz);
+    }
+
+    snprintf(outRec->name, FNAME_SZ, "%s", outName.c_str());
+
+    if (ok && !(outRec->fp = fopen(outName.c_str(), "w+b")))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR12d", outName.c_str());
+        FileIOError(msg_buf);
+        ok = false;
+    }
+
+    outRec->syncOff = 0;
+    outRec->tmp = outRec->punch = false;
+
+    if (ok && writeHdr && fwprintf(outRec->fp, L"%S", m_bFirstLn) < 0)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR12e", outName.c_str());
+        FileIOError(msg_buf);
+        ok = false;
+    }
+
+    if (ok)
+    {
+        m_iSrtFileN = n;
+        ok = MergeSort();
+
+        // MergeSort counts every file as temporary, but only the intermediate
+        // files are.
+        StatPhaseType &phase = m_aStats.back();
+
+        phase.tmpRead = 0;
+        for (x = 0; x < n; x++)
+            (files[x].isTmp ? phase.tmpRead : phase.bytesIn) +=
+                ftell(m_aSrtFlArr[x]->fp);
+
+        if (outName == m_sOutfile)
+            swap(phase.tmpWrite, phase.bytesOut);
+    }
+
+    // Close the files here so that DeleteSortFiles never removes them. Files
+    // that were given open are left for the caller to close.
+    for (x = 0; x < n; x++)
+    {
+        if (m_aSrtFlArr[x]->fp && !files[x].fp)
+            fclose(m_aSrtFlArr[x]->fp);
+
+        m_aSrtFlArr[x]->fp = NULL;
+        m_aSrtFlArr[x]->hdr = false;
+
+        if (ok && files[x].isTmp && !files[x].fp)
+            remove(files[x].name.c_str());
+    }
+
+    if (outRec->fp && fclose(outRec->fp) && ok)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR12f", outName.c_str());
+        FileIOError(msg_buf);
+        ok = false;
+    }
+
+    outRec->fp = NULL;
+
+    return ok;
+}
+
+/**
+ * @brief Merges the Holder file, which holds the sorted input, into
+ * m_sBaseFile, which is already sorted on the same columns, writing the
+ * output file with the header of the input. This costs a single sequential
+ * pass over m_sBaseFile. Records of m_sBaseFile come before records of the
+ * input with equal keys, as if the input had been appended to it. If the
+ * output file is m_sBaseFile itself, it is replaced once the merge is done.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::MergeBase(void)
+{
+    vector<MrgFileType> files;
+    struct stat baseSt, outSt;
+    string outName = m_sOutfile;
+    bool ok;
+
+    files.push_back({m_sBaseFile, m_bSkipFirstLn, false, NULL});
+    files.push_back({m_sHoldFile, false, true, m_fpHold});
+
+    if (!stat(m_sBaseFile.c_str(), &baseSt) && !stat(m_sOutfile.c_str(), &outSt) &&
+        baseSt.st_dev == outSt.st_dev && baseSt.st_ino == outSt.st_ino)
+        outName += ".tmp";
+
+    ok = MergeGroup(files, files.size(), outName, m_bSkipFirstLn);
+
+    if (ok && outName != m_sOutfile)
+    {
+        swap(m_aStats.back().tmpWrite, m_aStats.back().bytesOut);
+
+        if (rename(outName.c_str(), m_sOutfile.c_str()))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileRen, "SR12g", outName.c_str());
+            FileIOError(msg_buf);
+            ok = false;
+        }
+    }
+
+    if (!ok && outName != m_sOutfile)
+        remove(outName.c_str());
+
+    return ok;
+}
+
+/**
+ * @brief Chooses the size of the buffer array and the number of sort files
+ * (the merge fan-in) for the input, and the stdio buffer of each sort file,
+ * then reallocates the arrays to match. The plan is written to the log.
+ * 
+ * Half of the memory budget goes to the buffer array, as replacement
+ * selection makes runs about twice its size, but no more than BUF_ARR_MAX
+ * elements, since each record added costs a scan of the array. The other
+ * half goes to the sort files. Each merge adds the next (files - 2) runs to
+ * everything merged so far, so every extra file saves rewriting the Holder
+ * file, up to one file per run. Against that, each file needs its own read
+ * buffer, and on a spinning disk these must be large (IO_BUF_HDD) so that
+ * switching between files costs few seeks. The read buffers then share out
+ * the files' half of the budget: memory left over widens them, and if even
+ * MIN_ARR_SZ files do not fit they shrink (to IO_BUF_MIN at the least). The
+ * files are also limited by RLIMIT_NOFILE.
+ * 
+ * Files that are already sorted (MergeFiles) need no buffer array, so their
+ * sort files get the whole budget.
+ * 
+ * @param recCnt     Estimated number of records in the input.
+ * @param sortedRuns Number of sorted files to merge, else 0 to make runs.
+ * 
+ * @return Void.
+ */
+void SortRoutines::PlanSort(uint recCnt, uint sortedRuns)
+{
+    struct rlimit rl;
+    size_t memHalf = sortedRuns > 0 ? m_iMemSz : m_iMemSz / 2;
+    size_t fileMem, fileShare;
+    long fdMax = SRT_FL_MAX;
+    long fdLimit = -1; // -1 if unlimited
+    int rotational = IsRotational(m_sWorkDir.empty() ? m_sTempDir : m_sWorkDir);
+    int bufSz, fileN;
+    uint runs;
+
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY)
+        fdLimit = (long)rl.rlim_cur;
+
+    if (fdLimit > 0)
+        fdMax = min(fdMax, fdLimit - MRG_FD_RESERVE);
+
+    bufSz = (int)min((size_t)BUF_ARR_MAX, memHalf / (sizeof(BufRecType) +
+                                                        sizeof(BufKeyType)));
+    bufSz = max(bufSz, MIN_ARR_SZ);
+
+    if (sortedRuns > 0)
+        bufSz = m_iBufArrSz;
+
+    runs = sortedRuns > 0 ? sortedRuns : recCnt / (2 * bufSz) + 1;
+
+    m_iIoBufSz = rotational == 1 ? IO_BUF_HDD : IO_BUF_SSD;
+    fileMem = sizeof(SrtFlRecType) + m_iIoBufSz;
+
+    fileN = (int)min((size_t)fdMax, memHalf / fileMem);
+    fileN = (int)min((long)fileN, (long)runs + 1);
+    fileN = max(fileN, MIN_ARR_SZ);
+
+    fileShare = memHalf / fileN;
+    fileShare = fileShare > sizeof(SrtFlRecType) ? fileShare - sizeof(SrtFlRecType) : 0;
+    m_iIoBufSz = max((size_t)IO_BUF_MIN, min((size_t)IO_BUF_MAX, fileShare));
+
+    snprintf(msg_buf, sizeof(msg_buf), "Sort plan: buffer %d, fan-in %d, "
+             "read buffer %zuKB (%u records, ~%u runs, %s, fd limit %ld, "
+             "memory %zuMB, %s scanning)", bufSz, fileN - 1, m_iIoBufSz >> 10,
+             recCnt, runs, rotational == 1 ? "disk" : rotational == 0 ? "ssd" :
+             "unknown device", fdLimit, m_iMemSz >> 20, SimdLevel());
+    LOGMSG(LOG_DEBUG, "%s", msg_buf);
+    DBGPRINT("%s", msg_buf);
+
+    if (bufSz != m_iBufArrSz)
+    {
+        DeallocateBufArr(m_iBufArrSz);
+        AllocateBufArr(bufSz);
+    }
+
+    if (fileN != m_iSrtFlArrSz)
+    {
+        DeallocateSrtFlArr(m_iSrtFlArrSz);
+        AllocateSrtFlArr(fileN);
+
+        for (int x = 0; x < m_iSrtFlArrSz; x++)
+        {
+            m_aSrtFlArr[x]->fp = NULL;
+            m_aSrtFlArr[x]->hdr = false;
+        }
+    }
+}
+
+/**
+ * @brief Make runs using replacement selection.
+ * Methodology: Read up to MAX_ARR_SZ lines of a text file into a
+ * buffer array, where each element of the array consists of the
+ * text string and an integer key that is copied from the text string;
+ * (3) sort the array by the key; (4) find the lowest key in
+ *  the buffer that is greater than the last key read, and copy the text
+ * string associated with that key from the buffer to a temporary sort file; 
+ * (5) read in one new line of text into the buffer and resort the buffer;
+ * (7) repeat from step 3 until there are no more keys left that are greater
+ * than the last key read; (8) repeat from step 2 until he last sort file
+ * has been filled.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::MakeRuns(void)
+{
+    int totBufItems = 0; // number of elements in the buffer array
+    int pos = 0;         // position of lowest item in buffer array
+    BufRecType lowRec;   // lowest item >= highest item in current run
+    bool notEndRun;      // signals the end of a run
+    uint64_t runRecs;    // records in the current run
+    uint64_t inPos;      // input bytes read at the start of the phase
+
+    if (!InitWorkDir())
+        return false;
+
+    BeginPhase("runs", true);
+    inPos = InputTell();
+
+    if (m_bResumed)
+    {
+        // Carry on from the checkpoint as if its merge had just finished.
+        if (!ResumeRuns(&totBufItems))
+            return false; // error occurred
+
+        m_iSrtFileN = 1;
+    }
+    else
+    {
+        if (!CheckTempSpace()) // fail now if the input will not fit
+            return false;
+
+        if (!InitTempFiles(0)) // initial all sort files
+            return false;      // error occurred
+
+        if (!AddToBuffer(-1, &totBufItems)) // fill entire buffer
+            return false;                   // error occurred
+
+        m_iSrtFileN = 0; // init
+    }
+
+    DBGPRINT("%s", "Starting main loop in MakeRuns...");
+
+    while (totBufItems > 0) // get data from unsorted input file
+    {
+        int firstFileN = m_iSrtFileN; // first sort file of this cycle
+
+        lowRec.nkey.clear();
+
+        notEndRun = true; // init
+        runRecs = 0;
+
+        while (m_iSrtFileN < m_iSrtFlArrSz - 1) // add run of items to m_aSrtFlArr
+        {
+            // Add run of recs from m_aBufArr to m_aSrtFlArr[m_iSrtFileN] file
+            while (notEndRun)
+            {
+                notEndRun = FindLowest(&pos, &lowRec, totBufItems);
+
+                if (notEndRun)
+                {
+                    if (fwprintf(m_aSrtFlArr[m_iSrtFileN]->fp, L"%S",
+                                 m_aBufArr[pos].rec->dataLn) < 0)
+                    {
+                        sprintf(msg_buf, cErrFileWrite, "SR07a", m_aSrtFlArr[m_iSrtFileN]->name);
+                        FileIOError(msg_buf);
+                        return false;
+                    }
+
+                    assert(pos != -1);
+                    runRecs++;
+
+                    if ((runRecs & TMP_CHECK_RECS) == 0)
+                    {
+                        DropWritten(m_aSrtFlArr[m_iSrtFileN], false);
+
+                        if (!CheckTempSpace())
+                            return false;
+                    }
+
+                    if (!AddToBuffer(pos, &totBufItems))
+                        return false; // error occurred
+
+                } // if (notEndRun)
+
+                if (totBufItems <= 0)
+                    break; // there is no more data to sort
+
+            } // while (notEndRun)
+
+            // Note the size of the run just made.
+            StatPhaseType &phase = m_aStats[m_iStatPhase];
+
+            if (phase.runs == 0 || runRecs < phase.runMin)
+                phase.runMin = runRecs;
+            phase.runMax = max(phase.runMax, runRecs);
+            phase.runs++;
+            phase.recs += runRecs;
+            runRecs = 0;
+
+            DropWritten(m_aSrtFlArr[m_iSrtFileN], true);
+
+            notEndRun = true;
+            m_iSrtFileN++; // use next m_aSrtFlArr[srtFileN].fp file
+
+            if (totBufItems <= 0)
+                break; // there is no more data to sort
+
+        } // while (m_iSrtFileN < m_aSrtFlArr-1)
+
+        for (int x = firstFileN; x < m_iSrtFileN; x++)
+            m_aStats[m_iStatPhase].tmpWrite += ftell(m_aSrtFlArr[x]->fp);
+
+        m_aStats[m_iStatPhase].bytesIn += InputTell() - inPos;
+        EndPhase();
+
+        // Merge the sort files into one file. Unless the output is the
+        // Holder file itself, the last merge writes the output files, so
+        // the records are not copied again.
+        m_bMergedOut = totBufItems <= 0 && OutputByShards();
+
+        if (m_bMergedOut && !OpenShards(NULL, 0))
+            return false;
+
+        if (!MergeSort(m_bMergedOut))
+            return false;
+
+        if (m_bMergedOut && !CloseShards(&m_aStats.back().bytesOut))
+            return false;
+
+        // Remove temporary sort files & rename last sort file to Holder file.
+        if (!TermTmpFiles())
+            return false;
+
+        // Save what has been sorted so far in case the sort is interrupted.
+        if (m_bResume && totBufItems > 0)
+        {
+            bool ok;
+
+            BeginPhase("checkpoint", true);
+            ok = WriteCheckpoint(totBufItems);
+            EndPhase();
+
+            if (!ok)
+                return false;
+        }
+
+        // Check if there is still data in the buffer.
+        if (totBufItems > 0)
+        {
+            BeginPhase("runs", true);
+            inPos = InputTell();
+
+            // Create the temporary sort files (except for the first one).
+            if (!InitTempFiles(1))
+                return false;
+
+            // The Holder file becomes the first sort file. A checkpoint
+            // shares its data, so then no holes are punched in it.
+            m_aSrtFlArr[0]->fp = m_fpHold;
+            snprintf(m_aSrtFlArr[0]->name, FNAME_SZ, "%s", m_sHoldFile.c_str());
+            m_aSrtFlArr[0]->tmp = true;
+            m_aSrtFlArr[0]->punch = !m_bResume;
+            m_fpHold = NULL;
+
+        } // if (totBufNums > 0)
+
+        m_iSrtFileN = 1; // skip m_aSrtFlArr[0] as that contains the data from first pass
+
+    } // while (totBufNums > 0)
+
+    // With no records at all the empty last sort file is the Holder file.
+    if (!m_fpHold && !TermTmpFiles())
+        return false;
+
+    EndPhase();
+
+    return true;
+}
+
+/**
+ * @brief Keeps the m_iLimit records with the lowest keys in a max-heap while
+ * reading the input file once, then writes them to the output file. No
+ * temporary sort files are created. If the heap would need more than the
+ * memory budget (m_iMemSz) before it holds m_iLimit records, it gives up so
+ * that the caller can fall back to the external sort.
+ * 
+ * @param fitsMem Set to false if the heap outgrew m_iMemSz.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::TopKSort(bool *fitsMem)
+{
+    vector<TopRecType> heap;
+    BufRecType *rec = m_aBufArr[0].rec; // scratch record for reading input
+    size_t memSz = 0;               // approximate bytes held by heap
+
+    auto lessThan = [this](const TopRecType &a, const TopRecType &b) {
+        return RecCmp(&a, &b) < 0;
+    };
+
+    *fitsMem = true;
+
+    while (ReadInput(rec->dataLn))
+    {
+        rec->seq = m_iRecTot;
+        GetKey(rec);
+
+        m_iRecTot++;
+        UpdateProgress();
+
+        if (heap.size() < m_iLimit)
+        {
+            heap.emplace_back();
+            heap.back().nkey = rec->nkey;
+            heap.back().dataLn = rec->dataLn;
+            push_heap(heap.begin(), heap.end(), lessThan);
+
+            memSz += sizeof(TopRecType) + rec->nkey.length() +
+                     sizeof(wchar_t) * heap.back().dataLn.length();
+        }
+        else if (RecCmp(rec, &heap.front()) < 0)
+        {
+            // Replace the highest record kept so far, reusing its storage.
+            pop_heap(heap.begin(), heap.end(), lessThan);
+            memSz -= heap.back().nkey.length() +
+                     sizeof(wchar_t) * heap.back().dataLn.length();
+            heap.back().nkey = rec->nkey;
+            heap.back().dataLn = rec->dataLn;
+            memSz += heap.back().nkey.length() +
+                     sizeof(wchar_t) * heap.back().dataLn.length();
+            push_heap(heap.begin(), heap.end(), lessThan);
+        }
+        else
+        {
+            continue;
+        }
+
+        if (memSz > m_iMemSz)
+        {
+            *fitsMem = false;
+            return true;
+        }
+    }
+
+    if (!InputDone())
+    {
+        sprintf(msg_buf, cErrFileRead, "SR10a", "Input");
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    sort_heap(heap.begin(), heap.end(), lessThan);
+
+    return WriteTopK(heap);
+}
+
+/**
+ * @brief Writes the header line (if any) and the records kept by TopKSort to
+ * the output file, or to the shards.
+ * 
+ * @param heap Records to write, already in ascending order.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::WriteTopK(vector<TopRecType> &heap)
+{
+    uint64_t bytesOut;
+
+    // Shard the records kept, not those read: sample evenly from the heap.
+    if (m_iShards > 1 && m_aShardKeys.empty())
+    {
+        m_aSample.clear();
+
+        for (size_t i = 0; i < min(heap.size(), (size_t)SHARD_SAMPLE); i++)
+            m_aSample.push_back(heap[i * heap.size() /
+                                     min(heap.size(), (size_t)SHARD_SAMPLE)].dataLn);
+    }
+
+    if (!OpenShards(NULL, 0))
+        return false;
+
+    for (size_t i = 0; i < heap.size(); i++)
+    {
+        FILE *fPOutfile = ShardFile(heap[i].nkey);
+
+        if (!fPOutfile)
+            return false;
+
+        if (!PutText(fPOutfile, heap[i].dataLn.c_str()))
+        {
+            sprintf(msg_buf, cErrFileWrite, "SR10c",
+                    m_aShardOut[m_iShard].name.c_str());
+            FileIOError(msg_buf);
+            return false;
+        }
+    }
+
+    return CloseShards(&bytesOut);
+}
+
+/**
+ * @brief Sorts the input file without moving whole records through the
+ * temporary files (--keys-only). The input is mapped into memory and each
+ * record reduced to its key, byte offset and length. These are sorted in
+ * memory, or if they outgrow half the memory budget, written to temporary
+ * files as sorted runs and merged. The output is then gathered from the
+ * mapped input in key order. Records with equal keys stay in input order,
+ * as the offset breaks the tie.
+ * 
+ * Called by SortFile once the header (if any) has been read.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::KeySortFile(void)
+{
+    vector<KeyOffType> keys;
+    vector<KeyRunType> runs;
+    BufRecType *rec = m_aBufArr[0].rec; // scratch record for reading input
+    const char *data, *end, *pos, *nl;
+    long dataOff = ftell(m_fpInfile); // first record, after any header
+    size_t memSz = 0;                 // approximate bytes held by keys
+    size_t fanIn = max(2, m_iSrtFlArrSz - 1);
+    struct stat st;
+    bool ok = true;
+
+    if (fstat(fileno(m_fpInfile), &st) ||
+        (data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                   fileno(m_fpInfile), 0)) == MAP_FAILED)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileRead, "SR17a",
+                 m_sUserFile.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    end = data + st.st_size;
+
+    StatPhaseType &keyPhase = BeginPhase("keys", false);
+
+    for (pos = data + dataOff; pos < end && ok; pos = nl)
+    {
+        nl = FindRecordEnd(pos, end, false);
+
+        WidenLine(pos, nl, rec);
+        rec->seq = m_iRecTot;
+        GetKey(rec);
+        SampleRecord(rec);
+
+        keys.emplace_back();
+        keys.back().nkey.swap(rec->nkey);
+        keys.back().off = pos - data;
+        keys.back().len = nl - pos;
+        memSz += sizeof(KeyOffType) + keys.back().nkey.length();
+
+        m_iRecTot++;
+        UpdateProgress(nl - data);
+
+        if (memSz > m_iMemSz / 2)
+        {
+            ok = WriteKeyRun(&keys, &runs);
+            memSz = 0;
+        }
+    }
+
+    // The last keys go to a run of their own only if others were written.
+    if (ok && !runs.empty() && !keys.empty())
+        ok = WriteKeyRun(&keys, &runs);
+
+    if (ok && runs.empty())
+        sort(keys.begin(), keys.end(),
+             [this](const KeyOffType &a, const KeyOffType &b) {
+                 int cmp = RecCmp(&a, &b);
+                 return cmp < 0 || (cmp == 0 && a.off < b.off);
+             });
+
+    keyPhase.recs = m_iRecTot;
+    keyPhase.bytesIn = st.st_size - dataOff;
+    keyPhase.runs = runs.size();
+    fseek(m_fpInfile, 0, SEEK_END); // for the final progress
+    EndPhase();
+
+    // Merge groups of runs until the rest can be merged into the output.
+    while (ok && runs.size() > fanIn)
+    {
+        BeginPhase("merge", false);
+        ok = MergeKeyRuns(&runs, fanIn, data, false);
+        EndPhase();
+    }
+
+    if (!ok)
+    {
+        CloseKeyRuns(&runs);
+        munmap((void *)data, st.st_size);
+        return false;
+    }
+
+    StatPhaseType &outPhase = BeginPhase("gather", false);
+
+    // The records are now read in key order, not in file order, so the
+    // kernel should no longer read ahead or drop pages behind the reader.
+    // GatherRecords asks for each batch of pages with MADV_WILLNEED.
+    madvise((void *)data, st.st_size, MADV_RANDOM);
+
+    ok = OpenShards(data, dataOff);
+
+    if (ok && !runs.empty())
+    {
+        ok = MergeKeyRuns(&runs, runs.size(), data, true);
+    }
+    else if (ok)
+    {
+        size_t recN = m_iLimit > 0 ? min(keys.size(), (size_t)m_iLimit)
+                                   : keys.size();
+
+        for (size_t x = 0; ok && x < recN; x += GATHER_RECS)
+            ok = GatherRecords(&keys[x], min((size_t)GATHER_RECS, recN - x),
+                               data);
+
+        outPhase.recs = recN;
+    }
+
+    ok = ok && CloseShards(&outPhase.bytesOut);
+
+    EndPhase();
+    CloseKeyRuns(&runs); // any left by an error
+    munmap((void *)data, st.st_size);
+
+    return ok;
+}
+
+/**
+ * @brief Closes and removes runs written by WriteKeyRun that were not
+ * merged, as happens if an error stops KeySortFile.
+ * 
+ * @param runs Runs to close. Emptied.
+ * 
+ * @return Void.
+ */
+void SortRoutines::CloseKeyRuns(vector<KeyRunType> *runs)
+{
+    for (KeyRunType &run : *runs)
+    {
+        if (!run.fp)
+            continue; // its file could not be opened
+
+        fclose(run.fp);
+
+        if (!m_bTmpFile)
+            remove(run.name);
+    }
+
+    runs->clear();
+}
+
+/**
+ * @brief Writes records from the mapped input file to the output file. The
+ * pages holding the records are first requested in file order, so that a
+ * batch of scattered reads becomes a few sequential ones the kernel can do
+ * ahead of the writes.
+ * 
+ * @param recs  Records to write, in key order.
+ * @param n     Number of records.
+ * @param data  The mapped input file.
+ * 
+ * @return true if successful, else false if a write failed.
+ */
+bool SortRoutines::GatherRecords(const KeyOffType *recs, size_t n,
+                                 const char *data)
+{
+    static const uint64_t pageSz = sysconf(_SC_PAGESIZE);
+    vector<pair<uint64_t, uint64_t>> spans(n); // byte ranges to read
+
+    for (size_t x = 0; x < n; x++)
+        spans[x] = make_pair(recs[x].off & ~(pageSz - 1),
+                             recs[x].off + recs[x].len);
+
+    sort(spans.begin(), spans.end());
+
+    // Join records less than a page apart into one request.
+    for (size_t x = 0; x < n;)
+    {
+        uint64_t beg = spans[x].first;
+        uint64_t end = spans[x].second;
+
+        while (++x < n && spans[x].first <= end + pageSz)
+            end = max(end, spans[x].second);
+
+        madvise((void *)(data + beg), end - beg, MADV_WILLNEED);
+    }
+
+    for (size_t x = 0; x < n; x++)
+    {
+        const char *rec = data + recs[x].off;
+        FILE *fpOut = ShardFile(recs[x].nkey);
+
+        if (!fpOut)
+            return false;
+
+        // The last record of the input may not end with a newline.
+        if (fwrite(rec, 1, recs[x].len, fpOut) != recs[x].len ||
+            (recs[x].len > 0 && rec[recs[x].len - 1] != '\n' &&
+             fputc('\n', fpOut) == EOF))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR17c",
+                     m_aShardOut[m_iShard].name.c_str());
+            FileIOError(msg_buf);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Sorts the keys read so far and writes them to a new temporary file
+ * as a run, then empties keys.
+ * 
+ * @param keys Keys to write.
+ * @param runs The new run is added to these.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::WriteKeyRun(vector<KeyOffType> *keys, vector<KeyRunType> *runs)
+{
+    StatPhaseType &phase = m_aStats[m_iStatPhase];
+
+    sort(keys->begin(), keys->end(),
+         [this](const KeyOffType &a, const KeyOffType &b) {
+             int cmp = RecCmp(&a, &b);
+             return cmp < 0 || (cmp == 0 && a.off < b.off);
+         });
+
+    runs->emplace_back();
+    KeyRunType &run = runs->back();
+
+    if (!(run.fp = OpenTempFile(run.name)))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR17d", run.name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    setvbuf(run.fp, NULL, _IOFBF, m_iIoBufSz);
+
+    for (const KeyOffType &key : *keys)
+        if (!WriteKeyRec(&run, key))
+            return false;
+
+    if (fflush(run.fp))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR17e", run.name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    phase.tmpWrite += ftell(run.fp);
+    phase.runMin = phase.runs == 0 ? keys->size() : min(phase.runMin, (uint64_t)keys->size());
+    phase.runMax = max(phase.runMax, (uint64_t)keys->size());
+    phase.runs++;
+
+    keys->clear();
+
+    return true;
+}
+
+/**
+ * @brief Writes a record to the end of a run: the length of its key, the
+ * key, its offset and its length.
+ * 
+ * @param run The run.
+ * @param key Record to write.
+ * 
+ * @return true if successful, else false if a write failed.
+ */
+bool SortRoutines::WriteKeyRec(KeyRunType *run, const KeyOffType &key)
+{
+    uint keyLen = key.nkey.length();
+
+    if (fwrite(&keyLen, sizeof(keyLen), 1, run->fp) != 1 ||
+        fwrite(key.nkey.data(), 1, keyLen, run->fp) != keyLen ||
+        fwrite(&key.off, sizeof(key.off), 1, run->fp) != 1 ||
+        fwrite(&key.len, sizeof(key.len), 1, run->fp) != 1)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR17g", run->name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Reads the next record of a run written by WriteKeyRun.
+ * 
+ * @param run The run. Its rec is set to the record read, or its eof to true
+ *  at the end of the run.
+ * 
+ * @return true if successful, else false if a read failed.
+ */
+bool SortRoutines::ReadKeyRun(KeyRunType *run)
+{
+    uint keyLen;
+
+    if (fread(&keyLen, sizeof(keyLen), 1, run->fp) != 1)
+    {
+        run->eof = true;
+        return !ferror(run->fp);
+    }
+
+    run->rec.nkey.resize(keyLen);
+
+    if ((keyLen > 0 && fread(&run->rec.nkey[0], 1, keyLen, run->fp) != keyLen) ||
+        fread(&run->rec.off, sizeof(run->rec.off), 1, run->fp) != 1 ||
+        fread(&run->rec.len, sizeof(run->rec.len), 1, run->fp) != 1)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileRead, "SR17f", run->name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Merges the first n runs, either into a new run added after the
+ * others, or by gathering the records from the mapped input into the output
+ * (up to m_iLimit records, if set). The runs merged are closed and removed.
+ * 
+ * @param runs   Runs to merge.
+ * @param n      Number of runs to merge.
+ * @param data   The mapped input file.
+ * @param gather true to write the output, else false to make a new run.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::MergeKeyRuns(vector<KeyRunType> *runs, size_t n,
+                                const char *data, bool gather)
+{
+    vector<KeyOffType> batch; // records waiting to be gathered
+    KeyRunType out;           // the new run, unless gathering
+    uint64_t recN = 0;
+    uint64_t maxRecs = (gather && m_iLimit > 0) ? m_iLimit : UINT64_MAX;
+    StatPhaseType &phase = m_aStats[m_iStatPhase];
+    bool ok = true;
+
+    auto after = [&](size_t x, size_t y) {
+        const KeyOffType &a = (*runs)[x].rec;
+        const KeyOffType &b = (*runs)[y].rec;
+        int cmp = RecCmp(&a, &b);
+        return cmp > 0 || (cmp == 0 && a.off > b.off);
+    };
+    priority_queue<size_t, vector<size_t>, decltype(after)> heap(after);
+
+    if (!gather)
+    {
+        if (!(out.fp = OpenTempFile(out.name)))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR17b", out.name);
+            FileIOError(msg_buf);
+            return false;
+        }
+
+        setvbuf(out.fp, NULL, _IOFBF, m_iIoBufSz);
+    }
+
+    for (size_t x = 0; ok && x < n; x++)
+    {
+        rewind((*runs)[x].fp);
+        (*runs)[x].eof = false;
+
+        if ((ok = ReadKeyRun(&(*runs)[x])) && !(*runs)[x].eof)
+            heap.push(x);
+    }
+
+    while (ok && !heap.empty() && recN < maxRecs)
+    {
+        size_t x = heap.top();
+        KeyRunType &run = (*runs)[x];
+
+        heap.pop();
+
+        if (gather)
+        {
+            batch.push_back(run.rec);
+
+            if (batch.size() == GATHER_RECS)
+            {
+                ok = GatherRecords(batch.data(), batch.size(), data);
+                batch.clear();
+            }
+        }
+        else
+        {
+            ok = WriteKeyRec(&out, run.rec);
+        }
+
+        recN++;
+
+        if (ok && (ok = ReadKeyRun(&run)) && !run.eof)
+            heap.push(x);
+    }
+
+    if (ok && !batch.empty())
+        ok = GatherRecords(batch.data(), batch.size(), data);
+
+    for (size_t x = 0; x < n; x++)
+    {
+        phase.tmpRead += ftell((*runs)[x].fp);
+        fclose((*runs)[x].fp);
+
+        if (!m_bTmpFile)
+            remove((*runs)[x].name);
+    }
+
+    runs->erase(runs->begin(), runs->begin() + n);
+    phase.recs += recN;
+
+    if (!gather)
+    {
+        phase.tmpWrite += ftell(out.fp);
+        runs->push_back(out);
+
+        if (ok && fflush(out.fp))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR17h", out.name);
+            FileIOError(msg_buf);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Keeps a uniform random sample of up to SHARD_SAMPLE records
+ * (reservoir sampling), from which PickSplitters picks the shard boundaries.
+ * Called for each record read, before m_iRecTot counts it.
+ * 
+ * @param rec Record just read.
+ * 
+ * @return Void.
+ */
+void SortRoutines::SampleRecord(const BufRecType *rec)
+{
+    if (m_iShards < 2 || !m_aShardKeys.empty())
+        return;
+
+    if (m_aSample.size() < SHARD_SAMPLE)
+    {
+        m_aSample.push_back(rec->dataLn);
+    }
+    else
+    {
+        uint64_t x = m_Rng() % ((uint64_t)m_iRecTot + 1);
+
+        if (x < SHARD_SAMPLE)
+            m_aSample[x] = rec->dataLn;
+    }
+}
+
+/**
+ * @brief Sets the boundary keys of the shards: those given by SetShardKeys,
+ * else the keys that split the sampled records into m_iShards equal parts.
+ * If the sample has too few distinct keys there are fewer shards.
+ * 
+ * @return Void.
+ */
+void SortRoutines::PickSplitters(void)
+{
+    const uint sortCols[] = {m_iSortCol1, m_iSortCol2, m_iSortCol3};
+    vector<pair<string, wstring>> keys; // key and sort columns of each record
+    BufRecType *rec = new BufRecType;
+
+    m_aSplitKeys.clear();
+    m_aSplitText.clear();
+
+    for (const wstring &text : m_aShardKeys)
+    {
+        keys.emplace_back(string(), text);
+        BoundaryKey(text, &keys.back().first);
+    }
+
+    for (const wstring &line : m_aSample)
+    {
+        const wchar_t *end;
+
+        wcsncpy(rec->dataLn, line.c_str(), BUFFER_SZ);
+        rec->dataLn[BUFFER_SZ] = L'\0';
+        GetKey(rec);
+
+        // Without the --stable sequence number, so equal keys stay together.
+        if (m_bStable)
+            rec->nkey.resize(rec->nkey.length() - sizeof(rec->seq));
+
+        keys.emplace_back(rec->nkey, wstring());
+
+        for (end = rec->dataLn + wcslen(rec->dataLn);
+             end > rec->dataLn && (end[-1] == CHR_LF || end[-1] == CHR_CR);)
+            end--;
+
+        for (int k = 0; k < 3; k++)
+        {
+            const wchar_t *sLoc, *eLoc;
+
+            if (sortCols[k] == 0)
+                continue;
+
+            sLoc = FindField(rec->dataLn, end, sortCols[k], false, &eLoc);
+
+            if (!keys.back().second.empty())
+                keys.back().second.push_back(m_cDelim);
+            keys.back().second.append(sLoc, eLoc);
+        }
+    }
+
+    delete rec;
+    sort(keys.begin(), keys.end());
+
+    for (size_t x = 0; x < keys.size(); x++)
+    {
+        if (m_aShardKeys.empty())
+        {
+            // Sampled keys at x / m_iShards of the way through the sample,
+            // unless the shard before would be empty.
+            size_t pos = (x + 1) * keys.size() / m_iShards;
+
+            if (x + 1 >= m_iShards)
+                break;
+
+            if (keys[pos].first == keys.front().first ||
+                (!m_aSplitKeys.empty() && keys[pos].first == m_aSplitKeys.back()))
+                continue;
+
+            m_aSplitKeys.push_back(keys[pos].first);
+            m_aSplitText.push_back(keys[pos].second);
+        }
+        else if (x == 0 || keys[x].first != keys[x - 1].first)
+        {
+            m_aSplitKeys.push_back(keys[x].first); // each given key
+            m_aSplitText.push_back(keys[x].second);
+        }
+    }
+
+    m_aSample.clear();
+
+    LOGMSG(LOG_INFO, "Shards: %zu", m_aSplitKeys.size() + 1);
+}
+
+/**
+ * @brief Makes the key of a boundary given by the user, which is read as a
+ * record holding just the sort columns, separated by the delimiter. It may
+ * give just the first ones, and has no --stable sequence number.
+ * 
+ * @param text Values of the sort columns.
+ * @param nkey Set to the key.
+ * 
+ * @return Void.
+ */
+void SortRoutines::BoundaryKey(const wstring &text, string *nkey)
+{
+    const uint sortCols[] = {m_iSortCol1, m_iSortCol2, m_iSortCol3};
+    const wchar_t *pos = text.c_str();
+    const wchar_t *end = pos + text.length();
+
+    nkey->clear();
+
+    for (int k = 0; k < 3 && pos < end; k++)
+    {
+        const wchar_t *eLoc;
+
+        if (sortCols[k] == 0)
+            continue;
+
+        pos = FindField(pos, end, 1, false, &eLoc);
+        AppendKey(nkey, pos, eLoc);
+        pos = eLoc + 1;
+    }
+}
+
+/**
+ * @brief Opens the output of the sort for ShardFile: one file if there are no
+ * shards, else the first shard. Each file starts with the header, if any.
+ * 
+ * @param hdr    Header as bytes, or NULL to write m_bFirstLn as wide text.
+ * @param hdrLen Length of hdr.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::OpenShards(const char *hdr, size_t hdrLen)
+{
+    char name[FNAME_SZ];
+    size_t shardN = 1;
+
+    if (m_iShards > 1 || !m_aShardKeys.empty())
+    {
+        PickSplitters();
+        shardN = m_aSplitKeys.size() + 1;
+    }
+
+    m_bShardWide = (hdr == NULL);
+    m_sShardHdr.assign(hdr ? hdr : "", hdr ? hdrLen : 0);
+    m_aShardOut.assign(shardN, ShardType());
+    m_iShard = 0;
+
+    if (shardN == 1 && m_iShards < 2 && m_aShardKeys.empty())
+    {
+        m_aShardOut[0].name = m_sOutfile;
+    }
+    else
+    {
+        for (size_t x = 0; x < shardN; x++)
+        {
+            snprintf(name, FNAME_SZ, SHARDFILE, m_sOutfile.c_str(), (uint)x);
+            m_aShardOut[x].name = name;
+        }
+    }
+
+    return OpenShard(0);
+}
+
+/**
+ * @brief Creates a shard file and writes the header to it. With --index, its
+ * KEYIDX file is created too and starts with the sort options, so LookupFile
+ * can tell if it was made by the same sort.
+ * 
+ * @param shard Number of the shard.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::OpenShard(uint shard)
+{
+    ShardType &out = m_aShardOut[shard];
+    char name[FNAME_SZ];
+    bool ok;
+
+    if (m_iOutZip != ZIP_NONE)
+    {
+        out.zip = make_shared<ZipStream>();
+        out.fp = out.zip->OpenWrite(out.name.c_str(), m_iOutZip);
+    }
+    else
+    {
+        out.fp = fopen(out.name.c_str(), "w+b");
+    }
+
+    if (!out.fp)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR18a", out.name.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    setvbuf(out.fp, NULL, _IOFBF, m_iIoBufSz);
+
+    if (!m_bSkipFirstLn)
+        ok = true;
+    else if (m_bShardWide)
+        ok = PutText(out.fp, m_bFirstLn);
+    else
+        ok = fwrite(m_sShardHdr.data(), 1, m_sShardHdr.length(), out.fp) ==
+             m_sShardHdr.length();
+
+    if (!ok)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR18b", out.name.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    if (m_iIndexEvery == 0)
+        return true;
+
+    snprintf(name, FNAME_SZ, KEYIDX, out.name.c_str());
+    out.idxPos.clear();
+
+    if (!(out.idxFp = fopen(name, "wb")))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR19a", name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    fprintf(out.idxFp, "file-sort index %d\n", KEYIDX_VERSION);
+    fprintf(out.idxFp, "keys %u %u %u %d %d %d %d %d\n", m_iSortCol1,
+            m_iSortCol2, m_iSortCol3, (int)m_cDelim, (int)m_cQuote,
+            (int)m_cEscape, m_iCollate, (int)m_bSkipFirstLn);
+    fprintf(out.idxFp, "every %u\n", m_iIndexEvery);
+
+    return true;
+}
+
+/**
+ * @brief Adds a record to the KEYIDX file of a shard: its key, without any
+ * --stable sequence number, and the offset the record is about to be written
+ * at. Each entry is the key length (uint32_t), the key and the offset
+ * (uint64_t).
+ * 
+ * @param out  Shard the record is written to.
+ * @param nkey Key of the record.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::AddIndexEntry(ShardType *out, const string &nkey)
+{
+    uint32_t keyLen = nkey.length() - (m_bStable ? sizeof(BufRecType::seq) : 0);
+    uint64_t off = ftell(out->fp);
+
+    out->idxPos.push_back(ftell(out->idxFp));
+
+    if (fwrite(&keyLen, sizeof(keyLen), 1, out->idxFp) != 1 ||
+        fwrite(nkey.data(), 1, keyLen, out->idxFp) != keyLen ||
+        fwrite(&off, sizeof(off), 1, out->idxFp) != 1)
+    {
+        char name[FNAME_SZ];
+
+        snprintf(name, FNAME_SZ, KEYIDX, out->name.c_str());
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR19a", name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Returns the file to write a record to. Records must come in key
+ * order: once a record's key reaches the next boundary, the shard being
+ * written is closed and the next one opened.
+ * 
+ * @param nkey Key of the record.
+ * 
+ * @return The file, or NULL if an error occurred.
+ */
+FILE *SortRoutines::ShardFile(const string &nkey)
+{
+    while (m_iShard < m_aSplitKeys.size() &&
+           nkey.compare(m_aSplitKeys[m_iShard]) >= 0)
+    {
+        if (!CloseShard(m_iShard) || !OpenShard(++m_iShard))
+            return NULL;
+    }
+
+    ShardType &out = m_aShardOut[m_iShard];
+
+    if (out.idxFp && out.recs % m_iIndexEvery == 0 && !AddIndexEntry(&out, nkey))
+        return NULL;
+
+    out.recs++;
+
+    return out.fp;
+}
+
+/**
+ * @brief Closes a shard file. Its KEYIDX file, if any, is finished with the
+ * position of each entry (uint64_t), so LookupFile can binary search them,
+ * and a trailer: the position of that table, the number of entries, and the
+ * size and modification time (in ns) of the shard file (all uint64_t).
+ * 
+ * @param shard Number of the shard.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::CloseShard(uint shard)
+{
+    ShardType &out = m_aShardOut[shard];
+    char name[FNAME_SZ];
+    uint64_t trailer[4];
+    struct stat st;
+    bool ok;
+
+    out.bytes = ftell(out.fp);
+    ok = !fclose(out.fp);
+    out.fp = NULL;
+    out.zip.reset();
+
+    if (!ok)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR18b", out.name.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    if (!out.idxFp)
+        return true;
+
+    trailer[0] = ftell(out.idxFp);
+    trailer[1] = out.idxPos.size();
+    trailer[2] = out.bytes;
+    trailer[3] = !stat(out.name.c_str(), &st) ? FileTimeNs(st) : 0;
+
+    ok = fwrite(out.idxPos.data(), sizeof(uint64_t), out.idxPos.size(),
+                out.idxFp) == out.idxPos.size() &&
+         fwrite(trailer, sizeof(trailer), 1, out.idxFp) == 1;
+    ok = !fclose(out.idxFp) && ok;
+    out.idxFp = NULL;
+
+    if (!ok)
+    {
+        snprintf(name, FNAME_SZ, KEYIDX, out.name.c_str());
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR19a", name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Closes the output of the sort. Shards that got no records are
+ * still created. If there are shards, SHARDIDX lists each one with its
+ * records, bytes and boundary keys (the lowest key of the shard, and the
+ * lowest key of the next) as tab separated values.
+ * 
+ * @param bytesOut Set to the bytes written to all the files.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::CloseShards(uint64_t *bytesOut)
+{
+    char name[FNAME_SZ];
+    FILE *fP;
+    bool ok;
+
+    *bytesOut = 0;
+
+    for (uint x = m_iShard; x < m_aShardOut.size(); x++)
+    {
+        if ((!m_aShardOut[x].fp && !OpenShard(x)) || !CloseShard(x))
+            return false;
+    }
+
+    for (const ShardType &out : m_aShardOut)
+        *bytesOut += out.bytes;
+
+    if (m_aShardOut.size() == 1 && m_aShardOut[0].name == m_sOutfile)
+        return true;
+
+    snprintf(name, FNAME_SZ, SHARDIDX, m_sOutfile.c_str());
+
+    if (!(fP = fopen(name, "w")))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR18c", name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    fwprintf(fP, L"shard\tfile\trecords\tbytes\tfirst_key\tend_key\n");
+
+    for (size_t x = 0; x < m_aShardOut.size(); x++)
+    {
+        fwprintf(fP, L"%zu\t%s\t%llu\t%llu\t%S\t%S\n", x,
+                 m_aShardOut[x].name.c_str(),
+                 (unsigned long long)m_aShardOut[x].recs,
+                 (unsigned long long)m_aShardOut[x].bytes,
+                 x > 0 ? m_aSplitText[x - 1].c_str() : L"",
+                 x < m_aSplitText.size() ? m_aSplitText[x].c_str() : L"");
+    }
+
+    ok = !ferror(fP);
+
+    if (fclose(fP) || !ok)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR18c", name);
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Copies the sorted records of the Holder file to the shards.
+ * 
+ * @param fP The Holder file.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::WriteShards(FILE *fP)
+{
+    BufRecType *rec = m_aBufArr[0].rec; // scratch record
+    FILE *fPOut;
+    uint64_t recs = 0;
+
+    rewind(fP);
+
+    while (ReadRecord(rec->dataLn, fP))
+    {
+        if ((++recs & TMP_CHECK_RECS) == 0)
+            DropRead(fP);
+
+        if (!m_aSplitKeys.empty() || m_iIndexEvery > 0)
+            GetKey(rec);
+
+        if (!(fPOut = ShardFile(rec->nkey)))
+            return false;
+
+        if (!PutText(fPOut, rec->dataLn))
+        {
+            snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR09b",
+                     m_aShardOut[m_iShard].name.c_str());
+            FileIOError(msg_buf);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Tells whether the output of SortFile goes through ShardFile, as it
+ * needs a header, shards, an index or compression, rather than being the
+ * Holder file itself under the output file's name.
+ * 
+ * @return true if the output is written through ShardFile.
+ */
+bool SortRoutines::OutputByShards(void)
+{
+    return m_sBaseFile.empty() &&
+           (m_bSkipFirstLn || m_iShards > 1 || !m_aShardKeys.empty() ||
+            m_iIndexEvery > 0 || m_iOutZip != ZIP_NONE);
+}
+
+/**
+ * @brief pens the files to be sorted and calls the merge sort subroutines.
+ * 
+ * @return true if the function was successful, else false if an error occurred.
+ */
+bool SortRoutines::SortFile()
+{
+    struct stat st;
+    fpos_t dataPos;   // start of the first record after any header
+    long dataOff;
+    uint sampleN = 0; // records read to estimate the record count
+    uint recEst;      // estimated records in the file
+    uint64_t inBytes = 0; // size of all the input files
+
+    // Make sure there was room to allocate the arrays we require.
+    if (m_iBufArrSz < MIN_ARR_SZ || m_iSrtFlArrSz < MIN_ARR_SZ)
+    {
+        sprintf(msg_buf, cNoMemory, "SR08a");
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    m_iRecTot = 0; // start record counter at zero.
+
+    // Find the size of the files we wish to sort, then open the first.
+    m_aInBytes.clear();
+
+    for (const string &name : m_aInFiles)
+    {
+        if (stat(name.c_str(), &st))
+        {
+            sprintf(msg_buf, cErrFileOpen, "SR08b", name.c_str());
+            FileIOError(msg_buf);
+            return false;
+        }
+
+        m_aInBytes.push_back(st.st_size);
+        inBytes += st.st_size;
+    }
+
+    if (!OpenInput(0))
+        return false;
+
+    // If nothing to sort in infile then stop.
+    if (inBytes == 0)
+    {
+        cout << "Error...no lines read\n";
+        fclose(m_fpInfile);
+        m_fpInfile = NULL;
+        return true;
+    }
+
+    DBGPRINT("Sorting file: %s", m_sUserFile.c_str());
+    if (m_aInFiles.size() > 1)
+        DBGPRINT("...and %zu more", m_aInFiles.size() - 1);
+
+    // Use the first line of the file to see how fields are delimited. If it
+    // is a header then hold onto it, else go back to the first line again.
+    // If the file is empty, the first file with a line is used instead (see
+    // OpenInput and ReadInput).
+    if (!ReadRecord(m_bFirstLn, m_fpInfile))
+        m_bFirstLn[0] = L'\0';
+    else
+        DetectDelimiter(m_bFirstLn);
+
+    if (!m_bSkipFirstLn)
+        rewind(m_fpInfile);
+
+    // Estimate the number of records from the size of the first few, rather
+    // than reading the whole input to count them.
+    fgetpos(m_fpInfile, &dataPos);
+    dataOff = ftell(m_fpInfile);
+
+    while (sampleN < PLAN_SAMPLE && ReadRecord(m_aBufArr[0].rec->dataLn, m_fpInfile))
+        sampleN++;
+
+    // A compressed input is taken to decompress as its first records did.
+    m_iInSize = inBytes;
+
+    if (m_iInZip != ZIP_NONE)
+        m_iInSize = inBytes * ftell(m_fpInfile) / max(1UL, m_pZipIn->SrcPos());
+
+    if (sampleN < PLAN_SAMPLE && m_aInFiles.size() == 1)
+        recEst = sampleN;
+    else
+        recEst = (uint)((m_iInSize - dataOff) * sampleN /
+                        max(1L, ftell(m_fpInfile) - dataOff));
+
+    fsetpos(m_fpInfile, &dataPos);
+
+    StartProgress(inBytes);
+
+    // If the limited output fits in memory then there is no need for any
+    // temporary sort files. (With a base file the input is sorted as usual
+    // and MergeSort stops once it has written m_iLimit records.)
+    if (m_iLimit > 0 && m_sBaseFile.empty())
+    {
+        bool fitsMem;
+        bool ok;
+
+        BeginPhase("topk", false);
+        ok = TopKSort(&fitsMem);
+        m_aStats[m_iStatPhase].recs = m_iRecTot;
+        m_aStats[m_iStatPhase].bytesIn = InputTell();
+        EndPhase();
+
+        if (!ok)
+            return false; // error occurred
+
+        if (fitsMem)
+        {
+            StopProgress();
+            fclose(m_fpInfile);
+            m_fpInfile = NULL;
+            return true;
+        }
+
+        // Otherwise start over with the external sort, in which MergeSort
+        // stops once it has written m_iLimit records.
+        DBGPRINT("%s", "Limit exceeds memory, using external sort...");
+
+        if (!RewindInput())
+            return false;
+        m_iRecTot = 0;
+    }
+
+    // Size the buffer array and sort files for this input.
+    if (!InitWorkDir())
+        return false;
+
+    PlanSort(recEst);
+
+    // --keys-only maps the input into memory, so cannot read it compressed
+    // or from several files.
+    if (m_bKeysOnly && m_sBaseFile.empty() && m_iInZip != ZIP_NONE)
+    {
+        LOGMSG(LOG_INFO, "%s is compressed, sorting whole records", m_sUserFile.c_str());
+    }
+    else if (m_bKeysOnly && m_sBaseFile.empty() && m_aInFiles.size() > 1)
+    {
+        LOGMSG(LOG_INFO, "%s", "Sorting several files, sorting whole records");
+    }
+    else if (m_bKeysOnly && m_sBaseFile.empty())
+    {
+        bool ok = KeySortFile();
+
+        StopProgress();
+        fclose(m_fpInfile);
+        m_fpInfile = NULL;
+
+        LOGMSG(LOG_INFO, "Total Records Read: = %llu", (unsigned long long)m_iRecTot);
+
+        return ok;
+    }
+
+    // Pick up where an interrupted sort of this file left off.
+    m_bResumed = m_bResume && ReadCheckpoint();
+
+    // Sorting the file.
+    if (!MakeRuns())
+        return false; // error occurred
+
+    StopProgress(); // the input has been read
+
+#ifdef _DEBUG
+    OrgRecCnt = m_iRecTot; // records, which may span several lines
+    CheckSort();
+#endif
+
+    sprintf(msg_buf, "Total Records Read: = %llu", (unsigned long long)m_iRecTot);
+    LOGMSG(LOG_INFO, "%s", msg_buf);
+    DBGPRINT("%s", msg_buf);
+    
+    // Close m_fpInfile file.
+    fclose(m_fpInfile);
+    m_fpInfile = NULL;
+
+    if (!m_sBaseFile.empty())
+    {
+        DBGPRINT("Merging into base file %s...", m_sBaseFile.c_str());
+
+        if (!MergeBase())
+            return false;
+
+        CloseHoldFile();
+        RemoveCheckpoint(m_iCkptGen);
+
+        return true;
+    }
+
+    // The last merge may have written the output files already.
+    if (m_bMergedOut)
+    {
+        CloseHoldFile();
+        RemoveCheckpoint(m_iCkptGen);
+        return true;
+    }
+
+    StatPhaseType &outPhase = BeginPhase("output", false);
+
+    outPhase.recs = m_iRunRecs;
+    outPhase.tmpRead = outPhase.bytesOut = ftell(m_fpHold);
+
+    if (OutputByShards())
+    {
+        DBGPRINT("%s", "Adding header to file...");
+
+        // Write the header line, then all records from m_sHoldFile, to the
+        // output file or to each shard (and index them). This happens only
+        // if there were no records, so no merge.
+        if (!OpenShards(NULL, 0) || !WriteShards(m_fpHold) ||
+            !CloseShards(&outPhase.bytesOut))
+            return false;
+
+    } // if (OutputByShards())
+    else
+    {
+        // Give the Holder file the output file's name.
+        remove(m_sOutfile.c_str());
+
+        if (!LinkOrCopy(m_sHoldFile, m_sOutfile))
+            return false;
+    }
+
+    CloseHoldFile();
+    EndPhase();
+
+    // The sort is done, so the checkpoint is no longer needed.
+    RemoveCheckpoint(m_iCkptGen);
+
+    return true;
+}
+
+/**
+ * @brief Checks that the input file is sorted by the sort columns, without
+ * changing it. Reports the first line found out of order.
+ * 
+ * @return true if the file is sorted, else false if it is not sorted or an
+ * error occurred.
+ */
+bool SortRoutines::CheckFile(void)
+{
+    size_t lineCnt;
+    bool sorted;
+
+    BeginPhase("check", false);
+    sorted = VerifySorted(m_sUserFile, m_bSkipFirstLn, &lineCnt);
+    EndPhase();
+
+    if (!sorted)
+        return false;
+
+    printf("%s is sorted (%zu records checked)\n", m_sUserFile.c_str(), lineCnt);
+
+    return true;
+}
+
+/**
+ * @brief Writes the records of a sorted file whose keys are in a range, using
+ * the KEYIDX file SortFile wrote beside it (see SetIndex). Both files are
+ * mapped into memory. A binary search of the index, which touches only
+ * O(log n) of its pages, finds the last entry before the range, and the file
+ * is read from there until a key is past the range. The header, if any, is
+ * written first.
+ * 
+ * @param from Lowest key of the range, as the values of the sort columns
+ *             separated by the delimiter (it may give just the first ones).
+ * @param to   Highest key of the range, in the same form, or empty for the
+ *             records matching from. A record matches if the sort columns
+ *             to gives are no higher.
+ * 
+ * @return true if successful, else false if an error occurred.
+ */
+bool SortRoutines::LookupFile(const string &from, const string &to)
+{
+    BufRecType *rec = m_aBufArr[0].rec; // scratch record
+    char idxName[FNAME_SZ];
+    const char *data = NULL, *idx = NULL, *end, *pos, *nl;
+    struct stat st, idxSt;
+    uint col1, col2, col3, every;
+    int version, delim, quote, escape, collate, skipHdr;
+    uint64_t trailer[4] = {0, 0, 0, 0}; // entry table, entries, data file size, mtime
+    string lo, hi, key;
+    FILE *fP, *fPOut = stdout;
+    size_t x, beg, cnt;
+    bool ok;
+
+    StatPhaseType &phase = BeginPhase("lookup", false);
+
+    snprintf(idxName, FNAME_SZ, KEYIDX, m_sUserFile.c_str());
+
+    if (!(fP = fopen(m_sUserFile.c_str(), "rb")) || fstat(fileno(fP), &st) ||
+        (st.st_size > 0 &&
+         (data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                    fileno(fP), 0)) == MAP_FAILED))
+    {
+        if (fP)
+            fclose(fP);
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileRead, "SR19c", m_sUserFile.c_str());
+        FileIOError(msg_buf);
+        EndPhase();
+        return false;
+    }
+
+    fclose(fP);
+    end = data + st.st_size;
+
+    // Use the first record to see how fields are delimited.
+    nl = data ? FindRecordEnd(data, end, false) : end;
+    WidenLine(data, nl, rec);
+    DetectDelimiter(rec->dataLn);
+
+    if (!(fP = fopen(idxName, "rb")))
+    {
+        if (data)
+            munmap((void *)data, st.st_size);
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR19b", idxName);
+        FileIOError(msg_buf);
+        EndPhase();
+        return false;
+    }
+
+    // The index must be of this file, sorted on these columns.
+    ok = fscanf(fP, "file-sort index %d\n", &version) == 1 &&
+         fscanf(fP, "keys %u %u %u %d %d %d %d %d\n", &col1, &col2, &col3,
+                &delim, &quote, &escape, &collate, &skipHdr) == 8 &&
+         fscanf(fP, "every %u\n", &every) == 1 &&
+         version == KEYIDX_VERSION && col1 == m_iSortCol1 &&
+         col2 == m_iSortCol2 && col3 == m_iSortCol3 &&
+         delim == (int)m_cDelim && quote == (int)m_cQuote &&
+         escape == (int)m_cEscape && collate == m_iCollate &&
+         skipHdr == (int)m_bSkipFirstLn && !fstat(fileno(fP), &idxSt) &&
+         idxSt.st_size >= ftell(fP) + (long)sizeof(trailer) &&
+         (idx = (const char *)mmap(NULL, idxSt.st_size, PROT_READ, MAP_PRIVATE,
+                                   fileno(fP), 0)) != MAP_FAILED;
+
+    fclose(fP);
+
+    if (ok)
+    {
+        memcpy(trailer, idx + idxSt.st_size - sizeof(trailer), sizeof(trailer));
+        ok = trailer[2] == (uint64_t)st.st_size &&
+             trailer[3] == FileTimeNs(st) &&
+             trailer[0] + trailer[1] * sizeof(uint64_t) + sizeof(trailer) ==
+                 (uint64_t)idxSt.st_size;
+    }
+
+    if (!ok)
+    {
+        if (idx && idx != MAP_FAILED)
+            munmap((void *)idx, idxSt.st_size);
+        if (data)
+            munmap((void *)data, st.st_size);
+        snprintf(msg_buf, sizeof(msg_buf), cErrBadIndex, "SR19b", idxName);
+        FileIOError(msg_buf);
+        EndPhase();
+        return false;
+    }
+
+    madvise((void *)idx, idxSt.st_size, MADV_RANDOM);
+
+    BoundaryKey(WidenArg(from), &lo);
+    BoundaryKey(WidenArg(to.empty() ? from : to), &hi);
+
+    // Get the key of entry x, and return its offset in the data file.
+    auto entry = [&](size_t x, string *key) -> uint64_t {
+        uint64_t entryPos, off;
+        uint32_t keyLen;
+
+        memcpy(&entryPos, idx + trailer[0] + x * sizeof(uint64_t), sizeof(entryPos));
+        memcpy(&keyLen, idx + entryPos, sizeof(keyLen));
+        key->assign(idx + entryPos + sizeof(keyLen), keyLen);
+        memcpy(&off, idx + entryPos + sizeof(keyLen) + keyLen, sizeof(off));
+        return off;
+    };
+
+    // Find the first entry not below the range. Records before it, back to
+    // the entry before, may still be in the range.
+    for (beg = 0, cnt = trailer[1]; cnt > 0;)
+    {
+        x = beg + cnt / 2;
+        entry(x, &key);
+
+        if (key < lo)
+        {
+            beg = x + 1;
+            cnt -= cnt / 2 + 1;
+        }
+        else
+            cnt /= 2;
+    }
+
+    pos = trailer[1] > 0 ? data + entry(beg > 0 ? beg - 1 : 0, &key) : end;
+    munmap((void *)idx, idxSt.st_size);
+
+    if (!m_sOutfile.empty() && !(fPOut = fopen(m_sOutfile.c_str(), "wb")))
+    {
+        if (data)
+            munmap((void *)data, st.st_size);
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR19d", m_sOutfile.c_str());
+        FileIOError(msg_buf);
+        EndPhase();
+        return false;
+    }
+
+    if (m_bSkipFirstLn && data)
+        fwrite(data, 1, nl - data, fPOut);
+
+    phase.bytesIn = end - pos;
+
+    for (; pos < end; pos = nl)
+    {
+        nl = FindRecordEnd(pos, end, false);
+
+        WidenLine(pos, nl, rec);
+        GetKey(rec);
+
+        if (m_bStable)
+            rec->nkey.resize(rec->nkey.length() - sizeof(rec->seq));
+
+        if (rec->nkey < lo)
+            continue;
+
+        if (rec->nkey.compare(0, hi.length(), hi) > 0)
+            break; // past the range
+
+        fwrite(pos, 1, nl - pos, fPOut);
+        phase.recs++;
+    }
+
+    phase.bytesIn -= end - pos;
+    phase.bytesOut = ftell(fPOut);
+
+    ok = !ferror(fPOut);
+    ok = (fPOut == stdout ? !fflush(fPOut) : !fclose(fPOut)) && ok;
+
+    if (data)
+        munmap((void *)data, st.st_size);
+
+    if (!ok)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR19d", m_sOutfile.c_str());
+        FileIOError(msg_buf);
+    }
+
+    EndPhase();
+
+    return ok;
+}
+
+/**
+ * @brief Checks that a file is sorted. The file is mapped into memory and
+ * split into one chunk per hardware thread, each chunk starting at the
+ * beginning of a record. The chunks are checked in parallel by CheckChunk,
+ * then the last record of each chunk is compared with the first record of
+ * the next.
+ * 
+ * As a quoted field may contain newlines, a newline only ends a record if it
+ * is outside quotes. So the quotes in each slice of the file are first
+ * counted in parallel, which tells whether each slice starts inside quotes
+ * and so where the first record after it begins. This needs a quote to be
+ * escaped by doubling it; with any other escape character the file is
+ * checked in one chunk.
+ * 
+ * @param fileName Name of the file to check.
+ * @param skipHdr  true if the first record of the file is a header.
+ * @param lineCnt  Set to the number of records checked (excluding header).
+ * 
+ * @return true if the file is sorted, else false if it is not sorted or an
+ * error occurred.
+ */
+bool SortRoutines::VerifySorted(const string &fileName, bool skipHdr,
+                                size_t *lineCnt)
+{
+    int fd;
+    struct stat st;
+    const char *data, *end, *pos, *nl;
+    vector<ChkChunkType> chunks;
+    vector<thread> workers;
+    vector<size_t> quoteCnt;
+    vector<const char *> starts;
+    size_t chunkN, sliceSz, lineNo;
+    bool inQuote = false;
+    const char *badPos = NULL;
+    size_t badLine = 0;
+
+    *lineCnt = 0;
+
+    if ((fd = open(fileName.c_str(), O_RDONLY)) < 0)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR11a", fileName.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    if (fstat(fd, &st))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileRead, "SR11d", fileName.c_str());
+        FileIOError(msg_buf);
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return true; // nothing to check
+    }
+
+    data = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileRead, "SR11b", fileName.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    end = data + st.st_size;
+    nl = FindRecordEnd(data, end, false);
+
+    // Use the first record to see how fields are delimited.
+    WidenLine(data, nl, m_aBufArr[0].rec);
+    DetectDelimiter(m_aBufArr[0].rec->dataLn);
+
+    pos = skipHdr ? nl : data;
+    lineNo = skipHdr ? 1 : 0;
+
+    // Split the file into slices, one per thread.
+    chunkN = min((size_t)max(1u, thread::hardware_concurrency()),
+                 (size_t)(end - pos) / CHK_CHUNK_SZ + 1);
+
+    if (m_cEscape != m_cQuote || m_cQuote > 0x7f)
+        chunkN = 1;
+
+    sliceSz = (end - pos) / chunkN + 1;
+    quoteCnt.resize(chunkN, 0);
+
+    auto countQuotes = [&](size_t i) {
+        const char *p = pos + i * sliceSz;
+        const char *e = min(end, p + sliceSz);
 
-    if (!InitTempFiles(0)) // initial all sort files
-        return false;      // error occurred
+        while ((p = (const char *)memchr(p, (char)m_cQuote, e - p)))
+        {
+            quoteCnt[i]++;
+            p++;
+        }
+    };
 
-    if (!AddToBuffer(-1, &totBufItems)) // fill entire buffer
-        return false;                   // error occurred
+    for (size_t i = 0; i + 2 < chunkN; i++)
+        workers.emplace_back(countQuotes, i);
 
-    m_iSrtFileN = 0; // init
+    if (chunkN > 1)
+        countQuotes(chunkN - 2);
 
-    DBGPRINT("%s", "Starting main loop in MakeRuns...");
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
 
-    while (totBufItems > 0) // get data from unsorted input file
+    workers.clear();
+
+    // Start each chunk at the first record that begins in its slice.
+    starts.push_back(pos);
+
+    for (size_t i = 1; i < chunkN; i++)
     {
-        lowRec.key1.clear();
-        lowRec.key2.clear();
-        lowRec.key3.clear();
+        inQuote ^= (quoteCnt[i - 1] & 1);
+        starts.push_back(max(starts.back(),
+                             FindRecordEnd(pos + i * sliceSz, end, inQuote)));
+    }
 
-        notEndRun = true; // init
+    starts.push_back(end);
 
-        while (m_iSrtFileN < m_iSrtFlArrSz - 1) // add run of items to m_aSrtFlArr
+    for (size_t i = 0; i < chunkN; i++)
+    {
+        if (starts[i] < starts[i + 1])
         {
-            // Add run of recs from m_aBufArr to m_aSrtFlArr[m_iSrtFileN] file
-            while (notEndRun)
-            {
-                notEndRun = FindLowest(&pos, &lowRec, totBufItems);
+            ChkChunkType chunk;
 
-                if (notEndRun)
-                {
-                    if (fwprintf(m_aSrtFlArr[m_iSrtFileN]->fp, L"%S",
-                                 m_aBufArr[pos]->dataLn) < 0)
-                    {
-                        sprintf(msg_buf, cErrFileWrite, "SR07a", m_aSrtFlArr[m_iSrtFileN]->name);
-                        FileIOError(msg_buf);
-                        return false;
-                    }
+            chunk.beg = starts[i];
+            chunk.end = starts[i + 1];
+            chunks.push_back(chunk);
+        }
+    }
 
-                    assert(pos != -1);
+    for (size_t i = 1; i < chunks.size(); i++)
+        workers.emplace_back(&SortRoutines::CheckChunk, this, &chunks[i]);
 
-                    if (!AddToBuffer(pos, &totBufItems))
-                        return false; // error occurred
+    if (!chunks.empty())
+        CheckChunk(&chunks[0]);
 
-                } // if (notEndRun)
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
 
-                if (totBufItems <= 0)
-                    break; // there is no more data to sort
+    // Stitch the chunks together, stopping at the first record out of order.
+    for (size_t i = 0; i < chunks.size() && !badPos; i++)
+    {
+        if (i > 0 && RecCmp(&chunks[i].first, &chunks[i - 1].last) < 0)
+        {
+            badPos = chunks[i].beg;
+            badLine = lineNo + 1;
+        }
+        else if (chunks[i].badPos)
+        {
+            badPos = chunks[i].badPos;
+            badLine = lineNo + chunks[i].badLine;
+        }
 
-            } // while (notEndRun)
+        lineNo += chunks[i].lineCnt;
+    }
 
-            notEndRun = true;
-            m_iSrtFileN++; // use next m_aSrtFlArr[srtFileN].fp file
+    // The threads compared each record of their chunk with the one before.
+    for (size_t i = 0; i < chunks.size(); i++)
+        if (chunks[i].lineCnt > 1)
+            m_iCmpCnt += (chunks[i].badPos ? chunks[i].badLine :
+                          chunks[i].lineCnt) - 1;
 
-            if (totBufItems <= 0)
-                break; // there is no more data to sort
+    if (m_iStatPhase >= 0)
+    {
+        m_aStats[m_iStatPhase].recs += lineNo;
+        m_aStats[m_iStatPhase].bytesIn += st.st_size;
+    }
 
-        } // while (m_iSrtFileN < m_aSrtFlArr-1)
+    munmap((void *)data, st.st_size);
 
-        // Merge the sort files into one file.
-        if (!MergeSort())
-            return false;
+    if (badPos)
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrNotSorted, "SR11c",
+                 fileName.c_str(), badLine, (size_t)(badPos - data));
+        FileIOError(msg_buf);
+        return false;
+    }
 
-        // Remove temporary sort files & rename last sort file to Holder file.
-        if (!TermTmpFiles())
-            return false;
+    *lineCnt = lineNo - (skipHdr ? 1 : 0);
 
-        // Check if there is still data in the buffer.
-        if (totBufItems > 0)
-        {
-            // Create the temporary sort files (except for _sort000.dat).
-            if (!InitTempFiles(1))
-                return false;
+    return true;
+}
 
-            // Rename _holder.dat file to _sort000.dat
-            // Allow 6 trys to rename file: some RAID systems cannot keep
-            // up with file I/O
-            i = 0;
-            filePathName = m_aSrtFlArr[0]->name;
+/**
+ * @brief Checks that the records in one chunk of a mapped file are sorted.
+ * It stops at the first record that is out of order. Called by VerifySorted
+ * from several threads at once.
+ * 
+ * @param chunk The chunk to check. Its lineCnt, badPos, badLine, first and
+ * last fields are filled in.
+ * 
+ * @return Void.
+ */
+void SortRoutines::CheckChunk(ChkChunkType *chunk)
+{
+    BufRecType *rec = new BufRecType;
+    const char *pos, *nl;
 
-            while (rename(m_sHoldFile.c_str(), filePathName.c_str()))
-            {
-                sprintf(msg_buf, cTryRename, "SR07b");
-                AddLogEntry(msg_buf);
+    chunk->lineCnt = 0;
+    chunk->badPos = NULL;
+    chunk->badLine = 0;
 
-                if (i > 5)
-                {
-                    sprintf(msg_buf, cErrFileRen, "SR07c", m_sHoldFile.c_str());
-                    FileIOError(msg_buf);
-                    return false;
-                }
-                i++;
-            }
+    for (pos = chunk->beg; pos < chunk->end; pos = nl)
+    {
+        nl = FindRecordEnd(pos, chunk->end, false);
 
-            // Open _sort000.dat file.
-            if (!(m_aSrtFlArr[0]->fp = fopen(filePathName.c_str(), "r+b")))
-            {
-                sprintf(msg_buf, cErrFileOpen, "SR07d", filePathName.c_str());
-                FileIOError(msg_buf);
-                return false;
-            }
+        WidenLine(pos, nl, rec);
+        GetKey(rec);
 
-        } // if (totBufNums > 0)
+        chunk->lineCnt++;
 
-        m_iSrtFileN = 1; // skip m_aSrtFlArr[0] as that contains the data from first pass
+        if (chunk->lineCnt == 1)
+        {
+            chunk->first = *rec;
+        }
+        else if (rec->nkey.compare(chunk->last.nkey) < 0) // as RecCmp does,
+        {                                                // but not counted
+            chunk->badPos = pos;
+            chunk->badLine = chunk->lineCnt;
+            break;
+        }
 
-    } // while (totBufNums > 0)
+        swap(chunk->last, *static_cast<KeyRecType *>(rec));
+    }
 
-    return true;
+    delete rec;
 }
 
 /**
- * @brief pens the files to be sorted and calls the merge sort subroutines.
+ * @brief Finds the end of the record that contains pos in a mapped file.
+ * Newlines within quotes do not end a record. FindAny jumps from one
+ * newline, quote or escape character to the next (within quotes, from one
+ * quote or escape character to the next), so the bytes between are not
+ * looked at one by one.
  * 
- * @return true if the function was successful, else false if an error occurred.
+ * @param pos     Position within the record.
+ * @param end     End of the mapped file.
+ * @param inQuote true if pos is within quotes.
+ * 
+ * @return Position one past the newline that ends the record, or end.
  */
-bool SortRoutines::SortFile()
+const char *SortRoutines::FindRecordEnd(const char *pos, const char *end,
+                                        bool inQuote)
 {
-    wchar_t ch;
-    uint lineCnt; // count lines to process in current file
-    string filePathName;
+    const char quote = (char)m_cQuote;
+    const char escape = (char)m_cEscape;
 
-    // Make sure there was room to allocate the arrays we require.
-    if (m_iBufArrSz < MIN_ARR_SZ || m_iSrtFlArrSz < MIN_ARR_SZ)
+    while ((pos = FindAny(pos, end, inQuote ? quote : '\n', quote, escape)) < end)
     {
-        sprintf(msg_buf, cNoMemory, "SR08a");
-        FileIOError(msg_buf);
-        return false;
+        if (*pos == escape && escape != quote)
+        {
+            pos += (pos + 1 < end) ? 2 : 1; // skip escaped character
+
+            if (pos[-1] == '\n' && !inQuote)
+                break;
+        }
+        else if (*pos == quote)
+        {
+            inQuote = !inQuote;
+            pos++;
+        }
+        else // a newline outside quotes
+        {
+            pos++;
+            break;
+        }
     }
 
-    m_iLineTot = 0; // start line counter at zero.
-    lineCnt = 0;    // count total lines in m_fpInfile
+    return pos;
+}
 
-    // Open file we wish to sort.
-    filePathName = "" + m_sUserFile;
-    //cout << "Attempting to open " + filePathName + "\n";
+/**
+ * @brief Copies a record from a mapped file into a record buffer, the same
+ * way ReadRecord would read it (including the newline). Multibyte characters
+ * are converted using LC_CTYPE, as fgetws does. Records longer than
+ * BUFFER_SZ are truncated.
+ * 
+ * @param beg First character of the line.
+ * @param end One past the last character of the line.
+ * @param rec Record to copy the line into.
+ * 
+ * @return Void.
+ */
+void SortRoutines::WidenLine(const char *beg, const char *end, BufRecType *rec)
+{
+    size_t len = min((size_t)(end - beg), (size_t)BUFFER_SZ - 1);
+    mbstate_t state = mbstate_t();
+    size_t n;
 
-    if (!(m_fpInfile = fopen(filePathName.c_str(), "r+b")))
+    if (MB_CUR_MAX == 1)
     {
-        sprintf(msg_buf, cErrFileOpen, "SR08b", m_sUserFile.c_str());
-        FileIOError(msg_buf);
-        return false;
+        for (size_t i = 0; i < len; i++)
+            rec->dataLn[i] = (unsigned char)beg[i];
+
+        rec->dataLn[len] = L'\0';
+        return;
     }
 
-    do // count the total lines in the file to sort
+    for (len = 0; beg < end && len < BUFFER_SZ - 1; beg += n)
     {
-        ch = fgetwc(m_fpInfile);
-        if (ch == CHR_LF)
-            lineCnt++;
-    } while (ch != WEOF);
+        n = mbrtowc(&rec->dataLn[len++], beg, end - beg, &state);
 
-    // If nothing to sort in infile then stop.
-    if (lineCnt == 0)
-    {
-        cout << "Error...no lines read\n";
-        fclose(m_fpInfile);
-        m_fpInfile = NULL;
-        return true;
+        if (n == 0 || n > (size_t)(end - beg)) // invalid or NUL byte
+        {
+            rec->dataLn[len - 1] = (unsigned char)*beg;
+            state = mbstate_t();
+            n = 1;
+        }
     }
 
-    DBGPRINT("Sorting file: %s", filePathName.c_str());
+    rec->dataLn[len] = L'\0';
+}
+
+/**
+ * @brief Starts measuring a phase of the sort for --stats.
+ * 
+ * @param name       Name of the phase.
+ * @param accumulate true to add to the last phase of the same name (if any),
+ *  else false to measure this call as a phase of its own.
+ * 
+ * @return The phase being measured.
+ */
+StatPhaseType &SortRoutines::BeginPhase(const char *name, bool accumulate)
+{
+    int x = (int)m_aStats.size() - 1;
 
-    // Go back to first line of m_fpInfile
-    rewind(m_fpInfile);
+    while (accumulate && x >= 0 && m_aStats[x].name != name)
+        x--;
 
-    // If first line of file is a header then hold onto it
-    if (m_bSkipFirstLn)
+    if (!accumulate || x < 0)
     {
-        fgetws(m_bFirstLn, BUFFER_SZ, m_fpInfile);
-        lineCnt -= 1; // subtract 1 line for header
+        m_aStats.emplace_back();
+        m_aStats.back().name = name;
+        x = (int)m_aStats.size() - 1;
     }
 
-    // Init the progress bar
-    ShowProgress(true, lineCnt);
+    StatPhaseType &phase = m_aStats[x];
 
-    // Sorting the file.
-    if (!MakeRuns())
-        return false; // error occurred
+    phase.calls++;
+    phase.wallBeg = WallSec();
+    phase.cpuBeg = CpuSec();
+    phase.cmpBeg = CmpCount();
+    m_iStatPhase = x;
 
-#ifdef _DEBUG
-    OrgLineCnt = lineCnt;
-    CheckSort();
-#endif
+    return phase;
+}
 
-    sprintf(msg_buf, "Total Lines Read: = %d", m_iLineTot);
-    AddLogEntry(msg_buf);
-    DBGPRINT("%s", msg_buf);
-    
-    // Close m_fpInfile file.
-    fclose(m_fpInfile);
-    m_fpInfile = NULL;
+/**
+ * @brief Stops measuring the phase started by BeginPhase.
+ * @return Void.
+ */
+void SortRoutines::EndPhase(void)
+{
+    if (m_iStatPhase < 0)
+        return;
 
-    if (m_bSkipFirstLn)
-    {
-        FILE *fP;
-        FILE *fPOutfile;
-        wchar_t dataLn[BUFFER_SZ + 1];
+    StatPhaseType &phase = m_aStats[m_iStatPhase];
 
-        DBGPRINT("%s", "Adding header to file...");
+    phase.wallSec += WallSec() - phase.wallBeg;
+    phase.cpuSec += CpuSec() - phase.cpuBeg;
+    phase.cmps += CmpCount() - phase.cmpBeg;
+    m_iStatPhase = -1;
+}
 
-        fP = fopen(m_sHoldFile.c_str(), "r+b");
+/**
+ * @brief Gives the key comparisons made so far: those made on this thread,
+ * which runs the sort, since the sorter was created, plus those that other
+ * threads counted for themselves and added to m_iCmpCnt.
+ * 
+ * @return Comparisons made.
+ */
+uint64_t SortRoutines::CmpCount(void)
+{
+    return t_iCmpCnt - m_iCmpBase + m_iCmpCnt.load(memory_order_relaxed);
+}
 
-        fPOutfile = fopen(m_sOutfile.c_str(), "w+b");
+/**
+ * @brief Writes the measurements of each phase of the sort as JSON (see
+ * StatPhaseType), along with totals and the plan chosen by PlanSort.
+ * 
+ * @param fileName File to write, or "-" for standard output.
+ * 
+ * @return true if successful, else false if error.
+ */
+bool SortRoutines::WriteStats(const string &fileName)
+{
+    FILE *fP = fileName == "-" ? stdout : fopen(fileName.c_str(), "w");
 
-        // FIRST, write header line.
-        if (fwprintf(fPOutfile, L"%S", m_bFirstLn) < 0)
-        {
-            sprintf(msg_buf, cErrFileWrite, "SR09a", m_sOutfile.c_str());
-            fclose(fP);
-            fclose(fPOutfile);
-            FileIOError(msg_buf);
-            return false;
-        }
-    
-           //    SECOND,    write all lines from m_sHoldFile.
-        while (fgetws(dataLn, BUFFER_SZ, fP))
+    auto quote = [](const string &str) {
+        string out = "\"";
+        char hex[8];
+
+        for (char c : str)
         {
-            if (fwprintf(fPOutfile, L"%S", dataLn) < 0)
+            if ((unsigned char)c < 0x20)
             {
-                sprintf(msg_buf, cErrFileWrite, "SR09b", m_sOutfile.c_str());
-                fclose(fP);
-                fclose(fPOutfile);
-                FileIOError(msg_buf);
-                return false;
+                snprintf(hex, sizeof(hex), "\\u%04x", c);
+                out += hex;
+                continue;
             }
+            if (c == '"' || c == '\\')
+                out += '\\';
+            out += c;
         }
-        fclose(fP);
-        fclose(fPOutfile);
-        remove(m_sHoldFile.c_str());
+        return out + "\"";
+    };
 
-    } // if (m_bSkipFirstLn)
-    else
+    if (!fP)
     {
-        // Rename _holder.dat file to m_fpInfile's file.
-        if (rename(m_sHoldFile.c_str(), m_sOutfile.c_str()))
-        {
-            sprintf(msg_buf, cErrFileRen, "SR08c", m_sHoldFile.c_str());
-            FileIOError(msg_buf);
-            return false;
-        }
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileOpen, "SR16a", fileName.c_str());
+        FileIOError(msg_buf);
+        return false;
+    }
+
+    fprintf(fP, "{\n  \"input\": %s,\n  \"output\": %s,\n"
+            "  \"wall_sec\": %.6f,\n  \"cpu_sec\": %.6f,\n"
+            "  \"records\": %llu,\n  \"comparisons\": %llu,\n"
+            "  \"temp_peak\": %llu,\n"
+            "  \"plan\": {\"buffer\": %d, \"fan_in\": %d, \"read_buffer\": %zu, "
+            "\"memory\": %zu},\n  \"phases\": [",
+            quote(m_sUserFile).c_str(), quote(m_sOutfile).c_str(),
+            WallSec() - m_fStartWall, CpuSec(), (unsigned long long)m_iRecTot,
+            (unsigned long long)CmpCount(), (unsigned long long)m_iTempPeak,
+            m_iBufArrSz, m_iSrtFlArrSz - 1,
+            m_iIoBufSz, m_iMemSz);
+
+    for (size_t x = 0; x < m_aStats.size(); x++)
+    {
+        const StatPhaseType &phase = m_aStats[x];
+
+        fprintf(fP, "%s\n    {\"name\": %s, \"calls\": %u, \"wall_sec\": %.6f, "
+                "\"cpu_sec\": %.6f, \"records\": %llu, \"bytes_in\": %llu, "
+                "\"bytes_out\": %llu, \"comparisons\": %llu, \"temp_read\": %llu, "
+                "\"temp_write\": %llu, \"runs\": %llu, \"run_min\": %llu, "
+                "\"run_max\": %llu}", x ? "," : "", quote(phase.name).c_str(),
+                phase.calls, phase.wallSec, phase.cpuSec,
+                (unsigned long long)phase.recs,
+                (unsigned long long)phase.bytesIn,
+                (unsigned long long)phase.bytesOut,
+                (unsigned long long)phase.cmps,
+                (unsigned long long)phase.tmpRead,
+                (unsigned long long)phase.tmpWrite,
+                (unsigned long long)phase.runs,
+                (unsigned long long)phase.runMin,
+                (unsigned long long)phase.runMax);
+    }
+
+    fprintf(fP, "\n  ]\n}\n");
+
+    if (fP == stdout ? fflush(fP) : fclose(fP))
+    {
+        snprintf(msg_buf, sizeof(msg_buf), cErrFileWrite, "SR16b", fileName.c_str());
+        FileIOError(msg_buf);
+        return false;
     }
 
     return true;
 }
 
 /**
- * @brief Updates the progress bar in the console out
+ * @brief Starts the thread that shows the progress of reading the input
+ * file every PROG_RATE_MS, as a bar or as JSON (see SetProgress).
  * 
- * @param setCnt This should be true if initializing progress bar, else false.
- * @param count The number of times the progress bar will be updated.
+ * @param total Size of the input file in bytes.
+ * 
+ * @return Void.
+ */
+void SortRoutines::StartProgress(uint64_t total)
+{
+    StopProgress();
+
+    m_bProgBar = m_iProgress == PROGRESS_BAR ||
+                 (m_iProgress == PROGRESS_AUTO && isatty(STDOUT_FILENO));
+
+    if (!m_bProgBar && m_iProgress != PROGRESS_JSON)
+        return;
+
+    m_iProgTotal = total;
+    m_iProgBytes.store(0, memory_order_relaxed);
+    m_iProgRecs.store(0, memory_order_relaxed);
+    m_fProgStart = WallSec();
+    m_bProgStop = false;
+    m_ProgThread = thread(&SortRoutines::ProgressLoop, this);
+}
+
+/**
+ * @brief Stops the progress thread, if running, and shows the final
+ * progress.
  * 
  * @return Void.
  */
-void SortRoutines::ShowProgress(bool setCnt, uint count)
+void SortRoutines::StopProgress(void)
 {
-    if (setCnt)
+    if (!m_ProgThread.joinable())
+        return;
+
     {
-        m_fProgress = count;
+        lock_guard<mutex> lock(m_ProgMutex);
+        m_bProgStop = true;
     }
-    else
+
+    m_ProgCond.notify_one();
+    m_ProgThread.join();
+
+    if (m_fpInfile)
+        m_iProgBytes.store(InputPos(), memory_order_relaxed);
+    m_iProgRecs.store(m_iRecTot, memory_order_relaxed);
+    ShowProgress(true);
+}
+
+/**
+ * @brief Body of the progress thread: shows the progress every PROG_RATE_MS
+ * until StopProgress.
+ * 
+ * @return Void.
+ */
+void SortRoutines::ProgressLoop(void)
+{
+    unique_lock<mutex> lock(m_ProgMutex);
+
+    while (!m_ProgCond.wait_for(lock, chrono::milliseconds(PROG_RATE_MS),
+                                [this] { return m_bProgStop; }))
+        ShowProgress(false);
+}
+
+/**
+ * @brief Publishes the input bytes and records read so far for the progress
+ * thread. Called for each record read, it only does so every PROG_RECS + 1
+ * records.
+ * 
+ * @param inPos Input bytes read, or -1 for the position of m_fpInfile.
+ * 
+ * @return Void.
+ */
+void SortRoutines::UpdateProgress(long inPos)
+{
+    if ((m_iRecTot & PROG_RECS) != 0)
+        return;
+
+    if (inPos >= 0)
+        m_iProgBytes.store(inPos, memory_order_relaxed);
+    else if (m_fpInfile)
+        m_iProgBytes.store(InputPos(), memory_order_relaxed);
+    m_iProgRecs.store(m_iRecTot, memory_order_relaxed);
+}
+
+/**
+ * @brief Gives the bytes of the input files read so far, for the progress. A
+ * compressed input counts its compressed bytes, as its size does.
+ * 
+ * @return Bytes read.
+ */
+uint64_t SortRoutines::InputPos(void)
+{
+    return m_iInSrcBase + (m_iInZip != ZIP_NONE ? m_pZipIn->SrcPos() :
+                                                  ftell(m_fpInfile));
+}
+
+/**
+ * @brief Updates the progress bar in the console out, or writes a line of
+ * JSON to standard error.
+ * 
+ * @param done true if the input file has been read.
+ * 
+ * @return Void.
+ */
+void SortRoutines::ShowProgress(bool done)
+{
+    uint64_t bytes = m_iProgBytes.load(memory_order_relaxed);
+    float progPct = m_iProgTotal ? float(bytes) / m_iProgTotal : 1;
+
+    if (progPct > 1)
+        progPct = 1;
+
+    if (!m_bProgBar)
     {
-        if (count % 100 != 0 and count != m_fProgress)
-            return;
+        fprintf(stderr, "{\"bytes\": %llu, \"total\": %llu, \"percent\": %.1f, "
+                "\"records\": %llu, \"elapsed_sec\": %.3f, \"done\": %s}\n",
+                (unsigned long long)bytes, (unsigned long long)m_iProgTotal,
+                progPct * 100.0,
+                (unsigned long long)m_iProgRecs.load(memory_order_relaxed),
+                WallSec() - m_fProgStart, done ? "true" : "false");
+        fflush(stderr);
+        return;
+    }
 
-        int barWidth = 60;
-        float progPct = float(count / m_fProgress);
+    int barWidth = 60;
 
-        std::cout << "[";
-        int pos = barWidth * progPct;
-        for (int i = 0; i < barWidth; ++i)
-        {
-            if (i < pos)
-                std::cout << "=";
-            else if (i == pos)
-                std::cout << ">";
-            else
-                std::cout << " ";
-        }
-        std::cout << "] " << int(progPct * 100.0) << " %\r";
-        std::cout.flush();
+    std::cout << "[";
+    int pos = barWidth * progPct;
+    for (int i = 0; i < barWidth; ++i)
+    {
+        if (i < pos)
+            std::cout << "=";
+        else if (i == pos)
+            std::cout << ">";
+        else
+            std::cout << " ";
     }
+    std::cout << "] " << int(progPct * 100.0) << " %" << (done ? "\n" : "\r");
+    std::cout.flush();
 }
 
 #ifdef _DEBUG
 /**
  * @brief Checks the last sorted file to make sure it was sorted correctly. 
- * Makes sure total lines in final file is same as in original file. 
+ * Makes sure total records in final file is same as in original file. 
  * FOR DEBUGING PURPOSES ONLY.  Do no compile this in final code.
  * 
  * @return Void.
  */
 void SortRoutines::CheckSort(void)
 {
-    BufRecType rec1;
-    BufRecType rec2;
-    FILE *fP;
-    uint chkLineCnt = 0;
+    size_t chkLineCnt = 0;
+    size_t shardCnt;
 
-    std::cout << "\n";
     DBGPRINT("%s", "Checking that data was sorted correctly.");
 
-    fP = fopen(m_sHoldFile.c_str(), "r+b");
+    BeginPhase("verify", false);
 
-    while (fgetws(rec2.dataLn, BUFFER_SZ, fP))
+    if (!m_bMergedOut)
     {
-        chkLineCnt++;
-
-        GetKey(&rec2);
+        if (!VerifySorted(m_sHoldFile, false, &chkLineCnt))
+            FileIOError("CheckSort Sorting Error");
 
-        if (RecCmp(&rec2, &rec1) < 0)
+        swap(m_aStats.back().bytesIn, m_aStats.back().tmpRead); // it read the Holder
+    }
+    else if (m_iOutZip != ZIP_NONE)
+    {
+        chkLineCnt = OrgRecCnt; // the merge wrote compressed output files
+    }
+    else
+    {
+        for (const ShardType &out : m_aShardOut)
         {
-            FileIOError("CheckSort Sorting Error");
+            shardCnt = 0;
+            if (!VerifySorted(out.name, m_bSkipFirstLn, &shardCnt))
+                FileIOError("CheckSort Sorting Error");
+            chkLineCnt += shardCnt;
         }
-        rec1.key1.clear();
-        rec1.key1.append(rec2.key1.c_str());
-        rec1.key2.clear();
-        rec1.key2.append(rec2.key2.c_str());
-        rec1.key3.clear();
-        rec1.key3.append(rec2.key3.c_str());
     }
 
-    assert(chkLineCnt == OrgLineCnt);
+    EndPhase();
 
-    DBGPRINT("%s", "Data was sorted correctly.");
+    assert(chkLineCnt == OrgRecCnt || m_iLimit > 0);
 
-    fclose(fP);
+    DBGPRINT("%s", "Data was sorted correctly.");
 }
 #endif
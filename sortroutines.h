@@ -13,8 +13,17 @@
 #define _SORT_ROUTINES_H_
 
 #include "defines.h"
+#include "arena.h"
+#include "compress.h"
 #include <string>
+#include <vector>
 #include <iostream>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
 using namespace std;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -27,25 +36,127 @@ const char cErrFileRen[]    = "Error #%s renaming file: %s\n";
 const char cErrFileClose[]  = "Error #%s closing file: %s\n";
 const char cTryRename[]     = "Re-attempting file rename #%s\n";
 const char cNoMemory[]      = "Error #%s insufficient memory for array.\n";
+const char cNoResume[]      = "Checkpoint %s does not match this sort, starting over.\n";
+const char cErrNotSorted[]  = "Error #%s %s is not sorted at record %zu (byte %zu)\n";
+const char cErrBadIndex[]   = "Error #%s %s does not match this sort or its data file\n";
+const char cErrTempFull[]   = "Error #%s the sort needs more than %lluMB of temp space\n";
+const char cErrNoZstd[]     = "Error #%s %s is zstd compressed, which needs a build with USE_ZSTD\n";
 
-#define SRTFILE             "_sort%03d.dat"   // Temporary sort file name
-#define HLDFILE             "_holder.dat" // Temp file for sorted data
-#define WORK_DIR            ""
+#define SRTFILE             "%s/_sort%03u.dat" // Temporary sort file name
+#define WORKFILE            "%s/_sortjob.XXXXXX" // Private temp directory
+#define MRGFILE             "%s/_merge%03d.dat" // Intermediate file for --merge
+#define CKPTFILE            "%s.ckpt"         // Checkpoint manifest (--resume)
+#define CKPTRUN             "%s.ckpt%u.run"   // Checkpointed sorted data
+#define CKPTPEND            "%s.ckpt%u.pnd"   // Checkpointed buffer records
+#define CKPT_VERSION    2   // version of the checkpoint manifest format
+#define SHARDFILE           "%s.%03u"         // Output shard (--shards)
+#define SHARDIDX            "%s.shards"       // Boundary keys of the shards
+#define KEYIDX              "%s.idx"          // Sparse key index (--index)
+#define KEYIDX_VERSION  2   // version of the key index format
+#define WORK_DIR            "."   // default parent of the temp directory
 
 // Note the number of sort files makes the biggest difference in sorting time.
 // Increasing the BUF_ARR_SZ seems to slow down the sort time signficantly.
+// SortFile picks both at runtime (see PlanSort); these are the defaults.
 #define SRT_FL_ARR_SZ  24   // max number of temporary sort files created
 #define BUF_ARR_SZ     24   // max number of elements for buffer array
+#define SRT_FL_MAX    128   // most sort files PlanSort will use
+#define BUF_ARR_MAX   256   // most buffer array elements PlanSort will use
+#define SORT_MEM_SZ    0x10000000 // default memory budget of a sort (256MB)
+#define IO_BUF_SSD     0x10000    // min read buffer per sort file on SSDs
+#define IO_BUF_HDD     0x100000   // min read buffer per sort file on disks
+#define IO_BUF_MAX     0x400000   // max read buffer per sort file
+#define IO_BUF_MIN     0x2000     // least read buffer per sort file (small --mem)
 #define MIN_ARR_SZ      3   // minimum size of m_aSrtFlArr & m_aBufArr arrrays
-#define FNAME_SZ       16   // maximum size of a file name (eg "_sort000.dat")
+#define FNAME_SZ      256   // maximum size of a file path (eg "_sort000.dat")
+#define CACHE_LINE_SZ  64   // bytes in a cpu cache line
+#define MRG_FD_RESERVE  8   // file descriptors kept free when merging files
+#define CHK_CHUNK_SZ   0x400000   // min bytes checked by each --check thread
+#define PLAN_SAMPLE   100   // records read to estimate the number of records
+#define PROG_RATE_MS  250   // milliseconds between progress updates
+#define PROG_RECS     0x3ff // records read between progress counter updates
+#define GATHER_RECS   0x1000 // records written per prefetch batch (--keys-only)
+#define TMP_CHECK_RECS 0x3fff // records written between temp file checks (--no-cache, --max-temp)
+#define IN_AHEAD_SZ   0x4000000 // bytes of the next input file read ahead (64MB)
+#define SHARD_SAMPLE  0x1000 // records sampled to pick shard boundaries
 
-typedef struct // holds line of data and its sort keys
+// Progress modes (see SetProgress)
+#define PROGRESS_AUTO   0   // a bar if standard output is a terminal
+#define PROGRESS_BAR    1   // a bar on standard output
+#define PROGRESS_JSON   2   // a JSON object per update on standard error
+#define PROGRESS_NONE   3   // no progress
+
+// Collation modes for sort keys (see SetCollation)
+#define COLLATE_BINARY  0   // order of character codes
+#define COLLATE_CASE    1   // order of character codes, ignoring case
+#define COLLATE_LOCALE  2   // order of the LC_COLLATE locale
+
+struct KeyRecType // holds the sort key of a line of data
 {
-    wstring         key1;
-    wstring         key2;
-    wstring         key3;
+    string          nkey;          // normalized key of all sort columns
+};
+
+struct BufRecType : KeyRecType // holds line of data and its sort keys
+{
+   uint64_t        seq = 0;       // input line number, used by --stable
    wchar_t         dataLn[BUFFER_SZ+1]; // a line of data read from input file.
-}   BufRecType;
+};
+
+struct BufKeyType // an item of the buffer array: a key prefix and its record
+{
+   uint64_t        prefix;        // first 8 bytes of rec->nkey (see KeyPrefix)
+   BufRecType*     rec;           // the record
+};
+
+struct KeyOffType : KeyRecType // a record's key and place in the input file
+{
+   uint64_t        off = 0;       // byte offset of the record
+   uint            len = 0;       // bytes in the record, including its newline
+};
+
+struct KeyRunType // a sorted run of KeyOffType records (--keys-only)
+{
+   FILE*           fp = NULL;     // temporary file holding the run
+   char            name[FNAME_SZ]; // temporary file name
+   KeyOffType      rec;           // next record of the run
+   bool            eof = false;   // end of the run was reached
+};
+
+struct TopRecType : KeyRecType // holds a line kept by the --limit heap
+{
+   wstring         dataLn;        // a line of data read from input file.
+};
+
+struct StatPhaseType // --stats measurements of one phase of the sort
+{
+   string          name;          // eg "runs" or "merge"
+   uint            calls = 0;     // times the phase was entered
+   double          wallSec = 0;   // elapsed time
+   double          cpuSec = 0;    // cpu time of all threads
+   uint64_t        recs = 0;      // records processed
+   uint64_t        bytesIn = 0;   // bytes read from input files
+   uint64_t        bytesOut = 0;  // bytes written to the output file
+   uint64_t        cmps = 0;      // key comparisons
+   uint64_t        tmpRead = 0;   // bytes read from temporary files
+   uint64_t        tmpWrite = 0;  // bytes written to temporary files
+   uint64_t        runs = 0;      // runs made
+   uint64_t        runMin = 0;    // records in the smallest run
+   uint64_t        runMax = 0;    // records in the largest run
+   double          wallBeg = 0;   // start of the current call
+   double          cpuBeg = 0;
+   uint64_t        cmpBeg = 0;
+};
+
+typedef struct // result of checking one chunk of a file for sort order
+{
+   const char*  beg;          // first byte of chunk (start of a line)
+   const char*  end;          // one past last byte of chunk
+   size_t       lineCnt;      // number of records in chunk
+   const char*  badPos;       // first record out of order, or NULL if none
+   size_t       badLine;      // record number of badPos within chunk
+   KeyRecType   first;        // keys of the first record in chunk
+   KeyRecType   last;         // keys of the last record in chunk
+}   ChkChunkType;
 
 typedef struct 
 {
@@ -53,8 +164,31 @@ typedef struct
    char       name[FNAME_SZ]; // sort file name (eg _sort001.dat)
    BufRecType rec;            // line records
    bool       eof;            // end of file flag
+   bool       hdr;            // first line of file is a header to skip
+   off_t      syncOff;        // bytes sent to disk by DropWritten
+   bool       tmp;            // a temporary file, counted by TempSpace
+   bool       punch;          // merged data may be freed by FreeRead
 }   SrtFlRecType;
 
+struct ShardType // an output file holding one range of keys
+{
+   string          name;          // file name
+   FILE*           fp = NULL;     // open while its records are written
+   uint64_t        recs = 0;      // records written
+   uint64_t        bytes = 0;     // bytes written, including any header
+   FILE*           idxFp = NULL;  // its KEYIDX file, if --index is set
+   shared_ptr<ZipStream> zip;     // compresses fp, if --compress is set
+   vector<uint64_t> idxPos;       // position of each entry in idxFp
+};
+
+typedef struct // a file waiting to be merged by MergeFiles
+{
+   string     name;           // file name
+   bool       hdr;            // first line of file is a header
+   bool       isTmp;          // intermediate file to remove once merged
+   FILE*      fp;             // already open (eg the Holder file), else NULL
+}   MrgFileType;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // SortRoutines Class Definition
@@ -68,53 +202,210 @@ public:
                  uint col3=0);
    ~SortRoutines();
     bool SortFile(void);
+    bool CheckFile(void);
+    bool MergeFiles(const vector<string>& inFiles);
+    bool LookupFile(const string& from, const string& to);
+    void SetLimit(uint limit);
+    void SetStable(bool stable);
+    void SetKeysOnly(bool keysOnly);
+    void SetShards(uint shards);
+    void SetShardKeys(const vector<string>& keys);
+    void SetIndex(uint every);
+    void SetBaseFile(const string& baseFile);
+    void SetNoCache(bool noCache);
+    void SetMaxTemp(uint64_t maxTemp);
+    void SetCompress(int type);
+    void SetInputs(const vector<string>& inFiles);
+    void SetCsvFormat(wchar_t delim, wchar_t quote, wchar_t escape);
+    void SetCollation(int collate);
+    void SetResume(bool resume);
+    void SetTempDir(string tempDir);
+    void SetMemory(size_t memSz);
+    void SetProgress(int progress);
+    bool WriteStats(const string& fileName);
 
 protected:
 
+   bool      AddIndexEntry(ShardType* out, const string& nkey);
    bool      AddToBuffer(int position, int *totBufNums);
+   int       BufCmp(const BufKeyType* item1, const BufKeyType* item2);
+   void      BoundaryKey(const wstring& text, string* nkey);
+   void      AppendKey(string* nkey, const wchar_t* beg, const wchar_t* end);
+   void      EncodeKey(string* nkey, const wchar_t* beg, const wchar_t* end);
+   void      CheckChunk(ChkChunkType* chunk);
    void      AllocateBufArr(int maxSz);
    void      AllocateSrtFlArr(int maxSz);
    void      DeallocateBufArr(uint bufArrSz);
    void      DeallocateSrtFlArr(int srtFlArrSz);
    void      DeleteSortFiles(void);
+   void      DetectDelimiter(const wchar_t* dataLn);
+   void      DropRead(FILE* fp);
+   void      DropWritten(SrtFlRecType* srtFl, bool done);
+   const char* FindRecordEnd(const char* pos, const char* end, bool inQuote);
+   const wchar_t* FindFieldEnd(const wchar_t* pos, const wchar_t* end);
    void      FileIOError(string errMsg);
-   void      AddLogEntry(const string msg);
+   void      FreeRead(SrtFlRecType* srtFl);
+   wchar_t*  GetLine(wchar_t* buf, int n, FILE* fp);
+   bool      PutText(FILE* fp, const wchar_t* text);
+   uint64_t  InputPos(void);
+   uint64_t  InputTell(void);
+   bool      InputDone(void);
+   FILE*     OpenInFile(const char* name, ZipStream* zip, int* zipType, bool report);
+   bool      OpenInput(size_t idx);
+   wchar_t*  ReadInput(wchar_t* dataLn);
+   bool      RewindInput(void);
+   bool      CopyFile(const string& fromFile, const string& toFile);
+   const wchar_t* FindField(const wchar_t* data, const wchar_t* dataEnd,
+                            uint col, bool noQuotes, const wchar_t** fieldEnd);
    bool      FindLowest(int* pos, BufRecType* holdRec, uint totBufSz);
+   bool      GatherRecords(const KeyOffType* recs, size_t n, const char* data);
    void      GetKey(BufRecType* rec);
+   void      GetBufKey(BufKeyType* item);
+   static uint64_t KeyPrefix(const string& nkey);
    bool      InitTempFiles(int startFileN);
+   bool      InitWorkDir(void);
+   bool      KeySortFile(void);
+   void      CloseKeyRuns(vector<KeyRunType>* runs);
+   bool      MergeKeyRuns(vector<KeyRunType>* runs, size_t n, const char* data,
+                          bool gather);
+   FILE*     OpenTempFile(char* name);
+   bool      OpenShard(uint shard);
+   bool      OpenShards(const char* hdr, size_t hdrLen);
+   bool      CloseShard(uint shard);
+   bool      CloseShards(uint64_t* bytesOut);
+   FILE*     ShardFile(const string& nkey);
+   void      PickSplitters(void);
+   void      SampleRecord(const BufRecType* rec);
+   bool      WriteShards(FILE* fP);
+   bool      OutputByShards(void);
+   bool      ReadKeyRun(KeyRunType* run);
+   bool      WriteKeyRec(KeyRunType* run, const KeyOffType& key);
+   bool      WriteKeyRun(vector<KeyOffType>* keys, vector<KeyRunType>* runs);
+   int       IsRotational(const string& path);
+   void      CloseHoldFile(void);
+   bool      MergeBase(void);
+   bool      LinkOrCopy(const string& fromFile, const string& toFile);
    bool      MakeRuns(void);
-   bool      MergeSort(void);
-   int       RecCmp(BufRecType* rec1, BufRecType* rec2);
+   bool      MergeGroup(const vector<MrgFileType>& files, int n,
+                        const string& outName, bool writeHdr);
+   bool      MergeSort(bool toShards = false);
+   void      PlanSort(uint recCnt, uint sortedRuns = 0);
+   StatPhaseType& BeginPhase(const char* name, bool accumulate);
+   void      EndPhase(void);
+   uint64_t  CmpCount(void);
+   int       RecCmp(const KeyRecType* rec1, const KeyRecType* rec2);
+   wchar_t*  ReadRecord(wchar_t* dataLn, FILE* fp);
+   bool      ReadCheckpoint(void);
+   void      RemoveCheckpoint(uint gen);
+   bool      ResumeRuns(int* totBufItems);
    bool      RewindF(const int pos);
-   void      ShowProgress(bool setCnt, uint count);
+   uint64_t  TempSpace(void);
+   bool      CheckTempSpace(void);
+   void      ProgressLoop(void);
+   void      ShowProgress(bool done);
+   void      StartProgress(uint64_t total);
+   void      StopProgress(void);
+   void      UpdateProgress(long inPos = -1);
    void      SortList(int totBufSz);
    void      SortListIncr(const int totBufSz, int pos);
+   bool      TopKSort(bool* fitsMem);
+   bool      WriteTopK(vector<TopRecType>& heap);
    bool      TermTmpFiles(void);
+   bool      VerifySorted(const string& fileName, bool skipHdr, size_t* lineCnt);
+   bool      WriteCheckpoint(int totBufItems);
+   void      WidenLine(const char* beg, const char* end, BufRecType* rec);
 
    #ifdef _DEBUG
    void   CheckSort(void); // checks files are sorted correctly
    #endif
 
-    BufRecType**     m_aBufArr;        // buffer of text lines to be sorted
+    BufKeyType*      m_aBufArr;        // buffer of text lines to be sorted
     SrtFlRecType**   m_aSrtFlArr;      // sort file array
     int              m_iBufArrSz;      // holds actual size of m_Buffer array
+    Arena            m_Arena;          // memory of the m_aBufArr records
     int              m_iSrtFlArrSz;    // holds actual size of buffer array
-    uint             m_iLineTot;       // counter for total lines in infile
+    uint64_t         m_iRecTot;        // counter for total records in infile
     uint             m_iTotInFiles;    // count of total sort files
     int              m_iSrtFileN;      // current sort file num being processed
     string           m_sOutfile;       // name of output file
     FILE*            m_fpInfile;       // input file containing unsorted text
+    unique_ptr<ZipStream> m_pZipIn;    // decompresses m_fpInfile, if compressed
+    int              m_iInZip;         // ZIP_ type of the input file
+    uint64_t         m_iInSize;        // input bytes, estimated if compressed
+    vector<string>   m_aInFiles;       // files sorted as one input, in order
+    vector<uint64_t> m_aInBytes;       // size of each of m_aInFiles
+    size_t           m_iInFile;        // m_aInFiles item m_fpInfile reads
+    uint64_t         m_iInBase;        // bytes read from the files before it
+    uint64_t         m_iInSrcBase;     // size of the files before it
+    FILE*            m_fpNextIn;       // the next input file, opened ahead
+    unique_ptr<ZipStream> m_pZipNext;  // decompresses m_fpNextIn, if compressed
+    int              m_iNextZip;       // ZIP_ type of the next input file
+    int              m_iOutZip;        // ZIP_ type to write the output as
     string           m_sHoldFile;      // name of the temporary Holder File
-    string           m_sUserFile;      // file to be sorted
+    FILE*            m_fpHold;         // open stream of the Holder File
+    string           m_sTempDir;       // parent of the temp directory
+    string           m_sWorkDir;       // private temp directory of this sort
+    bool             m_bTmpFile;       // sort files are unnamed (O_TMPFILE)
+    bool             m_bHoles;         // holes can be punched in sort files
+    uint64_t         m_iMaxTemp;       // most temp space to use (0 = no limit)
+    uint64_t         m_iTempPeak;      // most temp space seen by TempSpace
+    uint             m_iTmpFileN;      // number of the next named sort file
+    size_t           m_iMemSz;         // memory budget of the sort in bytes
+    size_t           m_iIoBufSz;       // stdio buffer size of each sort file
+    vector<StatPhaseType> m_aStats;    // --stats measurements, in order
+    int              m_iStatPhase;     // m_aStats item being measured
+    atomic<uint64_t> m_iCmpCnt;        // key comparisons added by other threads
+    uint64_t         m_iCmpBase;       // t_iCmpCnt of this thread when created
+    double           m_fStartWall;     // time the sorter was created
+    string           m_sUserFile;      // file to be sorted (the first input)
     bool             m_bSkipFirstLn;   // skip first line of data file (header)
     wchar_t          m_bFirstLn[BUFFER_SZ+1]; // first line of data file
-    float            m_fProgress;
-    bool             m_bUsingQuotes;     // flag file has quotes between fields
+    int              m_iProgress;      // PROGRESS_ mode
+    bool             m_bProgBar;       // the progress is drawn as a bar
+    atomic<uint64_t> m_iProgBytes;     // input bytes read so far
+    atomic<uint64_t> m_iProgRecs;      // input records read so far
+    uint64_t         m_iProgTotal;     // input bytes to read
+    double           m_fProgStart;     // time the progress started
+    thread           m_ProgThread;     // draws the progress every PROG_RATE_MS
+    mutex            m_ProgMutex;      // guards m_bProgStop
+    condition_variable m_ProgCond;     // wakes m_ProgThread to stop
+    bool             m_bProgStop;      // tells m_ProgThread to stop
+    wchar_t          m_cDelim;           // field delimiter (0 = detect)
+    wchar_t          m_cQuote;           // quote around fields
+    wchar_t          m_cEscape;          // escapes a quote within quotes
     uint             m_iSortCol1;
     uint             m_iSortCol2;
     uint             m_iSortCol3;
-    FILE*            m_LogFileP;         // pointer to the log file
-    char             msg_buf[100];        // for error messages
+    uint             m_iLimit;           // max records to output (0 = all)
+    bool             m_bStable;          // keep input order of equal keys
+    bool             m_bKeysOnly;        // sort keys and offsets, then gather
+    uint             m_iShards;          // output shards wanted (0 = one file)
+    vector<wstring>  m_aShardKeys;       // boundary keys given by the user
+    vector<wstring>  m_aSample;          // records sampled by SampleRecord
+    mt19937          m_Rng;              // picks the records to sample
+    vector<string>   m_aSplitKeys;       // lowest key of each shard after the first
+    vector<wstring>  m_aSplitText;       // sort columns of each m_aSplitKeys
+    vector<ShardType> m_aShardOut;       // output files being written
+    uint             m_iShard;           // m_aShardOut item being written
+    string           m_sShardHdr;        // header bytes to start each shard
+    bool             m_bShardWide;       // shards are written as wide text
+    bool             m_bMergedOut;       // the last merge wrote the shards
+    uint             m_iIndexEvery;      // records per key index entry (0 = none)
+    string           m_sBaseFile;        // sorted file to merge the input into
+    bool             m_bNoCache;         // keep sort files out of the page cache
+    int              m_iCollate;         // COLLATE_BINARY, _CASE or _LOCALE
+    bool             m_bResume;          // checkpoint and resume the sort
+    bool             m_bResumed;         // a checkpoint was found to resume
+    uint             m_iCkptGen;         // generation of the last checkpoint
+    long             m_iCkptOffset;      // input offset of the checkpoint
+    size_t           m_iCkptFile;        // input file of the checkpoint
+    uint64_t         m_iCkptBase;        // bytes read from the files before it
+    uint64_t         m_iCkptRecs;        // records read at the checkpoint
+    uint             m_iCkptPending;     // buffer records in the checkpoint
+    size_t           m_iRunRecs;         // records written by MergeSort
+    string           m_sRunMinKey;       // lowest key written by MergeSort
+    string           m_sRunMaxKey;       // highest key written by MergeSort
+    char             msg_buf[FNAME_SZ+100]; // for error messages
 };
 
 #endif //SORT_ROUTINES_H_
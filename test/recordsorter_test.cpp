@@ -0,0 +1,143 @@
+/**
+ * @file recordsorter_test.cpp
+ * @author Daniel Rencricca
+ * @brief Checks RecordSorter against std::stable_sort. Each case sorts the
+ * same records both ways and compares them field by field, so both the
+ * order and the stability of equal keys are checked. The memory budgets are
+ * small enough that the larger cases write hundreds of runs, which are
+ * merged level by level and then REC_FAN_IN at a time.
+ *
+ * Prints one line per case and returns 1 if any case failed.
+ *
+ * @version 1.1
+ * @date 2015-12-22
+ *
+ * @copyright Copyright (c) 2015
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include "../recordsorter.h"
+
+using namespace std;
+
+struct TestRec
+{
+    unsigned key; // sort key
+    unsigned seq; // order added, to check stability
+    char     name[12];
+};
+
+/**
+ * @brief Returns true if both arrays hold the same records in the same order.
+ */
+static bool SameRecs(const vector<TestRec> &want, const vector<TestRec> &got)
+{
+    if (want.size() != got.size())
+        return false;
+
+    for (size_t x = 0; x < want.size(); x++)
+        if (want[x].key != got[x].key || want[x].seq != got[x].seq ||
+            memcmp(want[x].name, got[x].name, sizeof(want[x].name)))
+            return false;
+
+    return true;
+}
+
+/**
+ * @brief Makes n records with keys drawn from [0, unique).
+ */
+static vector<TestRec> MakeRecs(size_t n, unsigned unique, unsigned seed)
+{
+    mt19937 rng(seed);
+    vector<TestRec> recs(n);
+
+    for (size_t x = 0; x < n; x++)
+    {
+        recs[x].key = rng() % unique;
+        recs[x].seq = (unsigned)x;
+        snprintf(recs[x].name, sizeof(recs[x].name), "n%08u",
+                 (unsigned)(rng() % 100000000));
+    }
+
+    return recs;
+}
+
+/**
+ * @brief Sorts recs with a RecordSorter and with std::stable_sort and
+ * compares the results.
+ *
+ * @param memSz Bytes of records the sorter holds in memory.
+ * @param reps  Times to sort the same records with one sorter, to check
+ *              that it can be used again after Sort.
+ *
+ * @return true if the results match every time.
+ */
+template <class KeyFn, class Cmp>
+static bool CheckSort(const char *name, const vector<TestRec> &recs,
+                      KeyFn keyFn, Cmp cmp, size_t memSz, int reps = 1)
+{
+    RecordSorter<TestRec, KeyFn, Cmp> sorter(keyFn, cmp, memSz);
+    vector<TestRec> want(recs), got;
+    bool ok = true;
+
+    stable_sort(want.begin(), want.end(),
+                [&](const TestRec &rec1, const TestRec &rec2) {
+                    return cmp(keyFn(rec1), keyFn(rec2));
+                });
+
+    for (int r = 0; r < reps && ok; r++)
+    {
+        got.clear();
+
+        // Add half one at a time and half as a range.
+        for (size_t x = 0; x < recs.size() / 2 && ok; x++)
+            ok = sorter.Add(recs[x]);
+
+        ok = ok && sorter.Add(recs.begin() + recs.size() / 2, recs.end());
+        ok = ok && sorter.Count() == recs.size();
+        ok = ok && sorter.Sort([&](const TestRec &rec) { got.push_back(rec); });
+        ok = ok && sorter.Count() == 0 && SameRecs(want, got);
+    }
+
+    printf("%-28s %8zu records  %s\n", name, recs.size(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(void)
+{
+    auto byKey = [](const TestRec &rec) { return rec.key; };
+    auto byName = [](const TestRec &rec) {
+        return string_view(rec.name, strnlen(rec.name, sizeof(rec.name)));
+    };
+    size_t recSz = sizeof(TestRec);
+    bool ok = true;
+
+    ok &= CheckSort("empty", MakeRecs(0, 10, 1), byKey, less<>(), 1 << 20);
+    ok &= CheckSort("one record", MakeRecs(1, 10, 2), byKey, less<>(), 1 << 20);
+    ok &= CheckSort("in memory", MakeRecs(50000, 1000000, 3), byKey, less<>(),
+                    1 << 24);
+    ok &= CheckSort("in memory, few keys", MakeRecs(50000, 7, 4), byKey,
+                    less<>(), 1 << 24);
+    ok &= CheckSort("one record per run", MakeRecs(500, 5, 5), byKey, less<>(),
+                    recSz);
+    ok &= CheckSort("runs, few keys", MakeRecs(200000, 13, 6), byKey,
+                    less<>(), 100 * recSz);
+    ok &= CheckSort("runs over two levels", MakeRecs(300000, 1000, 7), byKey,
+                    less<>(), 64 * recSz);
+    ok &= CheckSort("runs, descending", MakeRecs(100000, 50, 8), byKey,
+                    greater<>(), 300 * recSz);
+    ok &= CheckSort("runs, string keys", MakeRecs(100000, 10, 9), byName,
+                    less<>(), 500 * recSz);
+    ok &= CheckSort("runs, used again", MakeRecs(20000, 100, 10), byKey,
+                    less<>(), 100 * recSz, 3);
+
+    return ok ? 0 : 1;
+}